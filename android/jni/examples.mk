@@ -85,19 +85,19 @@ LOCAL_MODULE:= fxload
 
 include $(BUILD_EXECUTABLE)
 
-# sam3u_benchmake
+# throughput
 
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
-  $(LIBUSB_ROOT_REL)/examples/sam3u_benchmark.c
+  $(LIBUSB_ROOT_REL)/examples/throughput.c
 
 LOCAL_C_INCLUDES += \
   $(LIBUSB_ROOT_ABS)
 
 LOCAL_SHARED_LIBRARIES += libusb1.0
 
-LOCAL_MODULE:= sam3u_benchmark
+LOCAL_MODULE:= throughput
 
 include $(BUILD_EXECUTABLE)
 
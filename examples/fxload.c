@@ -250,6 +250,8 @@ int main(int argc, char*argv[])
 
 	/* We need to claim the first interface */
 	libusb_set_auto_detach_kernel_driver(device, 1);
+	/* we only ever do synchronous control transfers from a single thread */
+	libusb_set_direct_sync_transfers(device, 1);
 	status = libusb_claim_interface(device, 0);
 	if (status != LIBUSB_SUCCESS) {
 		libusb_close(device);
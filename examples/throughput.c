@@ -0,0 +1,482 @@
+/*
+ * libusb example program to measure the throughput and latency of an endpoint
+ * Copyright (C) 2012 Harald Welte <laforge@gnumonks.org>
+ *
+ * Based on the sam3u_benchmark example, which was copied with the author's
+ * permission under LGPL-2.1 from
+ * http://git.gnumonks.org/cgi-bin/gitweb.cgi?p=sam3u-tests.git;a=blob;f=usb-benchmark-project/host/benchmark.c;h=74959f7ee88f1597286cd435f312a8ff52c56b7e
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Keeps a number of transfers in flight on one endpoint of a device, prints
+ * the throughput every interval, and the transfer latency percentiles at
+ * the end. The direction of the transfers is given by the endpoint address.
+ *
+ * The Atmel SAM3U test firmware from the repository above is measured with:
+ *
+ *   throughput -d 16c0:0763 -i 2 -e 0x86
+ *
+ * and the source/sink function of the Linux gadget zero driver, loaded
+ * with pattern=1, with e.g.:
+ *
+ *   throughput -d 1a0a:badd -e 0x81 -p mod63
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libusb.h"
+
+enum pattern {
+	PATTERN_NONE,
+	PATTERN_ZERO,
+	PATTERN_MOD63
+};
+
+static volatile int do_exit = 0;
+static int stopping = 0;
+static int in_flight = 0;
+static int failed = 0;
+
+static enum pattern pattern = PATTERN_NONE;
+static int max_packet_size;
+
+static unsigned long long num_bytes = 0, num_xfer = 0;
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* the byte the pattern has at an offset in a transfer. mod63 counts up
+ * within each packet, like the gadget zero source/sink function does. */
+static unsigned char pattern_byte(int offset)
+{
+	if (pattern == PATTERN_MOD63)
+		return (unsigned char)((offset % max_packet_size) % 63);
+	return 0;
+}
+
+static void fill_pattern(unsigned char *buf, int length)
+{
+	int i;
+
+	for (i = 0; i < length; i++)
+		buf[i] = pattern_byte(i);
+}
+
+static int check_pattern(const unsigned char *buf, int length)
+{
+	int i;
+
+	for (i = 0; i < length; i++) {
+		if (buf[i] != pattern_byte(i)) {
+			fprintf(stderr, "data mismatch at offset %d: 0x%02x instead of 0x%02x\n",
+				i, buf[i], pattern_byte(i));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void LIBUSB_CALL cb_xfr(struct libusb_transfer *xfr)
+{
+	int is_in = xfr->endpoint & LIBUSB_ENDPOINT_IN;
+	int i;
+
+	if (xfr->status == LIBUSB_TRANSFER_CANCELLED && stopping)
+		goto stop;
+	if (xfr->status != LIBUSB_TRANSFER_COMPLETED) {
+		fprintf(stderr, "transfer status %d\n", xfr->status);
+		failed = 1;
+		goto stop;
+	}
+
+	if (xfr->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		for (i = 0; i < xfr->num_iso_packets; i++) {
+			struct libusb_iso_packet_descriptor *pack = &xfr->iso_packet_desc[i];
+
+			if (pack->status != LIBUSB_TRANSFER_COMPLETED) {
+				fprintf(stderr, "packet %d status %d\n", i, pack->status);
+				failed = 1;
+				goto stop;
+			}
+			if (is_in && pattern != PATTERN_NONE &&
+			    check_pattern(libusb_get_iso_packet_buffer_simple(xfr, i),
+					  pack->actual_length)) {
+				failed = 1;
+				goto stop;
+			}
+			num_bytes += pack->actual_length;
+		}
+	} else {
+		if (is_in && pattern != PATTERN_NONE &&
+		    check_pattern(xfr->buffer, xfr->actual_length)) {
+			failed = 1;
+			goto stop;
+		}
+		num_bytes += xfr->actual_length;
+	}
+	num_xfer++;
+
+	if (stopping)
+		goto stop;
+	if (libusb_submit_transfer(xfr) < 0) {
+		fprintf(stderr, "error re-submitting transfer\n");
+		failed = 1;
+		goto stop;
+	}
+	return;
+
+stop:
+	stopping = 1;
+	in_flight--;
+}
+
+/* find the interface, the altsetting and the descriptor of an endpoint in
+ * the active configuration */
+static int find_endpoint(libusb_device *dev, unsigned char endpoint,
+	int *interface, int *altsetting, unsigned char *type)
+{
+	struct libusb_config_descriptor *config;
+	int i, j, k, r;
+
+	r = libusb_get_active_config_descriptor(dev, &config);
+	if (r < 0)
+		return r;
+	r = LIBUSB_ERROR_NOT_FOUND;
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+		for (j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *alt = &iface->altsetting[j];
+			if (*interface >= 0 && alt->bInterfaceNumber != *interface)
+				continue;
+			if (*altsetting >= 0 && alt->bAlternateSetting != *altsetting)
+				continue;
+			for (k = 0; k < alt->bNumEndpoints; k++) {
+				if (alt->endpoint[k].bEndpointAddress != endpoint)
+					continue;
+				*interface = alt->bInterfaceNumber;
+				*altsetting = alt->bAlternateSetting;
+				*type = alt->endpoint[k].bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+				r = 0;
+				goto out;
+			}
+		}
+	}
+out:
+	libusb_free_config_descriptor(config);
+	return r;
+}
+
+static void print_latency(unsigned char endpoint)
+{
+	static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+	struct libusb_stats *stats;
+	unsigned int i;
+	int j;
+
+	if (libusb_get_stats(NULL, &stats) < 0)
+		return;
+	for (j = 0; j < stats->num_endpoints; j++) {
+		const struct libusb_stats_histogram *latency =
+			&stats->endpoints[j].transfer_latency;
+
+		if (stats->endpoints[j].endpoint != endpoint)
+			continue;
+		printf("latency:");
+		for (i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+			printf(" p%g %.1f us,", percentiles[i],
+				libusb_stats_histogram_percentile(latency, percentiles[i]) / 1000.0);
+		printf(" max %.1f us\n", latency->max_ns / 1000.0);
+	}
+	libusb_free_stats(stats);
+}
+
+static void sig_hdlr(int signum)
+{
+	(void)signum;
+	do_exit = 1;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s -d vid:pid -e endpoint [options]\n"
+		"   -d vid:pid   device to use\n"
+		"   -e endpoint  endpoint address, e.g. 0x81 for IN endpoint 1\n"
+		"   -i iface     interface of the endpoint, found if not given\n"
+		"   -a alt       altsetting of the interface, found if not given\n"
+		"   -t type      bulk, interrupt or iso, from the endpoint if not given\n"
+		"   -q depth     number of transfers to keep in flight, default 8\n"
+		"   -s size      size of each transfer in bytes, default 16384\n"
+		"   -T seconds   duration, default until interrupted\n"
+		"   -I seconds   interval of the throughput reports, default 1\n"
+		"   -p pattern   data pattern to send or check, zero or mod63\n",
+		name);
+}
+
+int main(int argc, char **argv)
+{
+	struct libusb_device_handle *devh = NULL;
+	struct libusb_transfer **xfrs = NULL;
+	struct sigaction sigact;
+	unsigned int vid = 0, pid = 0;
+	int interface = -1, altsetting = -1;
+	int depth = 8, size = 16384, packets = 0;
+	double duration = 0.0, interval = 1.0;
+	unsigned char endpoint = 0, type = 0xff, ep_type;
+	uint64_t start, now, last;
+	unsigned long long last_bytes = 0, last_xfer = 0;
+	int cancelled = 0;
+	int opt, i, rc;
+
+	while ((opt = getopt(argc, argv, "d:e:i:a:t:q:s:T:I:p:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'e':
+			endpoint = (unsigned char)strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interface = atoi(optarg);
+			break;
+		case 'a':
+			altsetting = atoi(optarg);
+			break;
+		case 't':
+			if (!strcmp(optarg, "bulk"))
+				type = LIBUSB_TRANSFER_TYPE_BULK;
+			else if (!strcmp(optarg, "interrupt"))
+				type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+			else if (!strcmp(optarg, "iso"))
+				type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 's':
+			size = atoi(optarg);
+			break;
+		case 'T':
+			duration = atof(optarg);
+			break;
+		case 'I':
+			interval = atof(optarg);
+			break;
+		case 'p':
+			if (!strcmp(optarg, "zero"))
+				pattern = PATTERN_ZERO;
+			else if (!strcmp(optarg, "mod63"))
+				pattern = PATTERN_MOD63;
+			else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+	if (!vid || !endpoint || depth <= 0 || size <= 0 || interval <= 0.0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	sigact.sa_handler = sig_hdlr;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = 0;
+	sigaction(SIGINT, &sigact, NULL);
+
+	rc = libusb_init(NULL);
+	if (rc < 0) {
+		fprintf(stderr, "Error initializing libusb: %s\n", libusb_error_name(rc));
+		return 1;
+	}
+	libusb_set_stats_enabled(NULL, 1);
+
+	devh = libusb_open_device_with_vid_pid(NULL, (uint16_t)vid, (uint16_t)pid);
+	if (!devh) {
+		fprintf(stderr, "Error finding USB device\n");
+		rc = LIBUSB_ERROR_NO_DEVICE;
+		goto out;
+	}
+
+	rc = find_endpoint(libusb_get_device(devh), endpoint, &interface,
+		&altsetting, &ep_type);
+	if (rc < 0) {
+		fprintf(stderr, "Error finding endpoint 0x%02x: %s\n", endpoint,
+			libusb_error_name(rc));
+		goto out;
+	}
+	if (type == 0xff)
+		type = ep_type;
+
+	libusb_set_auto_detach_kernel_driver(devh, 1);
+	rc = libusb_claim_interface(devh, interface);
+	if (rc < 0) {
+		fprintf(stderr, "Error claiming interface: %s\n", libusb_error_name(rc));
+		goto out;
+	}
+	if (altsetting > 0) {
+		rc = libusb_set_interface_alt_setting(devh, interface, altsetting);
+		if (rc < 0) {
+			fprintf(stderr, "Error setting altsetting: %s\n", libusb_error_name(rc));
+			goto out_release;
+		}
+	}
+
+	max_packet_size = libusb_get_max_packet_size(libusb_get_device(devh), endpoint);
+	if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		int iso_packet_size = libusb_get_max_iso_packet_size(libusb_get_device(devh),
+			endpoint);
+		if (iso_packet_size <= 0) {
+			fprintf(stderr, "Error getting the packet size of the endpoint\n");
+			rc = LIBUSB_ERROR_OTHER;
+			goto out_release;
+		}
+		packets = size / iso_packet_size ? size / iso_packet_size : 1;
+		size = packets * iso_packet_size;
+		max_packet_size = iso_packet_size;
+	}
+	if (max_packet_size <= 0)
+		max_packet_size = 64;
+
+	xfrs = calloc(depth, sizeof(*xfrs));
+	if (!xfrs) {
+		rc = LIBUSB_ERROR_NO_MEM;
+		goto out_release;
+	}
+	for (i = 0; i < depth; i++) {
+		unsigned char *buf = calloc(1, size);
+
+		xfrs[i] = libusb_alloc_transfer(packets);
+		if (!buf || !xfrs[i]) {
+			free(buf);
+			rc = LIBUSB_ERROR_NO_MEM;
+			goto out_free;
+		}
+		if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+			libusb_fill_iso_transfer(xfrs[i], devh, endpoint, buf, size,
+				packets, cb_xfr, NULL, 0);
+			libusb_set_iso_packet_lengths(xfrs[i], size / packets);
+		} else {
+			libusb_fill_bulk_transfer(xfrs[i], devh, endpoint, buf, size,
+				cb_xfr, NULL, 0);
+			xfrs[i]->type = type;
+		}
+		xfrs[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		if (!(endpoint & LIBUSB_ENDPOINT_IN) && pattern != PATTERN_NONE) {
+			if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+				int j;
+				for (j = 0; j < packets; j++)
+					fill_pattern(libusb_get_iso_packet_buffer_simple(xfrs[i], j),
+						size / packets);
+			} else {
+				fill_pattern(buf, size);
+			}
+		}
+	}
+
+	printf("%s transfers of %d bytes to endpoint 0x%02x, %d in flight\n",
+		type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS ? "isochronous" :
+		type == LIBUSB_TRANSFER_TYPE_INTERRUPT ? "interrupt" : "bulk",
+		size, endpoint, depth);
+
+	/* keep all the transfers in flight, so that the host controller never
+	 * waits for the callback of a transfer to submit the next one */
+	start = last = get_time_ns();
+	for (i = 0; i < depth; i++) {
+		rc = libusb_submit_transfer(xfrs[i]);
+		if (rc < 0) {
+			fprintf(stderr, "Error submitting transfer: %s\n", libusb_error_name(rc));
+			stopping = 1;
+			break;
+		}
+		in_flight++;
+	}
+
+	while (in_flight) {
+		struct timeval tv = { 0, 100000 };
+
+		rc = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+		if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+			fprintf(stderr, "Error handling events: %s\n", libusb_error_name(rc));
+			break;
+		}
+
+		now = get_time_ns();
+		if (now - last >= interval * 1e9) {
+			printf("%8.1f s: %10.3f MB/s, %8.1f transfers/s\n",
+				(now - start) / 1e9,
+				(num_bytes - last_bytes) * 1e3 / (now - last),
+				(num_xfer - last_xfer) * 1e9 / (now - last));
+			fflush(stdout);
+			last = now;
+			last_bytes = num_bytes;
+			last_xfer = num_xfer;
+		}
+		if (do_exit || (duration > 0.0 && now - start >= duration * 1e9))
+			stopping = 1;
+
+		/* do not wait for transfers on an idle endpoint to complete */
+		if (stopping && !cancelled) {
+			for (i = 0; i < depth; i++)
+				libusb_cancel_transfer(xfrs[i]);
+			cancelled = 1;
+		}
+	}
+	rc = failed ? LIBUSB_ERROR_IO : 0;
+
+	now = get_time_ns();
+	printf("%llu transfers (total %llu bytes) in %.3f seconds => %.3f MB/s\n",
+		num_xfer, num_bytes, (now - start) / 1e9,
+		num_bytes * 1e3 / (now - start));
+	print_latency(endpoint);
+
+	/* transfers still in flight after an error cannot be freed */
+	if (in_flight)
+		goto out_release;
+
+out_free:
+	for (i = 0; i < depth; i++)
+		libusb_free_transfer(xfrs[i]);
+	free(xfrs);
+out_release:
+	libusb_release_interface(devh, interface);
+out:
+	if (devh)
+		libusb_close(devh);
+	libusb_exit(NULL);
+	return rc < 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * libusb example program to decode trace files written by libusb_trace_dump()
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb.h"
+
+/* must match struct usbi_trace_record in libusb/core.c */
+struct trace_record {
+	uint64_t timestamp;
+	uint32_t tid;
+	uint16_t point;
+	uint16_t reserved;
+	uint64_t arg[2];
+};
+
+struct trace_header {
+	char signature[8];
+	uint32_t record_size;
+	uint32_t num_points;
+};
+
+static int compare_records(const void *a, const void *b)
+{
+	const struct trace_record *ra = a, *rb = b;
+
+	if (ra->timestamp < rb->timestamp)
+		return -1;
+	return ra->timestamp > rb->timestamp;
+}
+
+static int read_name(FILE *f, char *name, size_t size)
+{
+	size_t i;
+	int c;
+
+	for (i = 0; i < size; i++) {
+		c = fgetc(f);
+		if (c == EOF)
+			return -1;
+		name[i] = (char)c;
+		if (!c)
+			return 0;
+	}
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct trace_header header;
+	struct trace_record *records = NULL;
+	char (*names)[64] = NULL;
+	size_t count = 0, allocated = 0, i;
+	uint64_t origin, previous;
+	FILE *f;
+	int r = 1;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+		return 1;
+	}
+
+	f = fopen(argv[1], "rb");
+	if (!f) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.signature, "LUSBTRC1", sizeof(header.signature)) ||
+	    header.record_size != sizeof(struct trace_record)) {
+		fprintf(stderr, "%s: not a libusb trace file\n", argv[1]);
+		goto out;
+	}
+
+	names = calloc(header.num_points, sizeof(*names));
+	if (!names)
+		goto out;
+	for (i = 0; i < header.num_points; i++) {
+		if (read_name(f, names[i], sizeof(names[i]))) {
+			fprintf(stderr, "%s: truncated trace point names\n", argv[1]);
+			goto out;
+		}
+	}
+
+	for (;;) {
+		if (count == allocated) {
+			struct trace_record *grown;
+
+			allocated = allocated ? allocated * 2 : 4096;
+			grown = realloc(records, allocated * sizeof(*records));
+			if (!grown)
+				goto out;
+			records = grown;
+		}
+		if (fread(&records[count], sizeof(*records), 1, f) != 1)
+			break;
+		count++;
+	}
+
+	/* each thread's records are in order, merge them */
+	qsort(records, count, sizeof(*records), compare_records);
+
+	printf("[   time (us)] [ delta] [threadID] event            arguments\n");
+	origin = previous = count ? records[0].timestamp : 0;
+	for (i = 0; i < count; i++) {
+		struct trace_record *record = &records[i];
+		const char *name = record->point < header.num_points ?
+			names[record->point] : "unknown";
+
+		printf("[%12.3f] [%6.3f] [%08x] %-16s 0x%llx 0x%llx\n",
+			(record->timestamp - origin) / 1000.0,
+			(record->timestamp - previous) / 1000.0,
+			record->tid, name,
+			(unsigned long long)record->arg[0],
+			(unsigned long long)record->arg[1]);
+		previous = record->timestamp;
+	}
+	r = 0;
+
+out:
+	free(records);
+	free(names);
+	fclose(f);
+	return r;
+}
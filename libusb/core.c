@@ -69,6 +69,9 @@ static const struct libusb_version libusb_version_internal =
 static int default_context_refcnt = 0;
 static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
 static struct timeval timestamp_origin = { 0, 0 };
+static int env_debug_level = 0;
+
+static void trace_init(void);
 
 usbi_mutex_static_t active_contexts_lock = USBI_MUTEX_INITIALIZER;
 struct list_head active_contexts_list;
@@ -170,6 +173,17 @@ struct list_head active_contexts_list;
  * always logged. libusb_set_debug() and the LIBUSB_DEBUG environment variable
  * have no effects.
  *
+ * Debug logging formats and writes out every message as it happens, which
+ * changes the timing of the application noticeably. For timing sensitive
+ * problems, the LIBUSB_TRACE environment variable enables compact binary
+ * tracing of the I/O paths instead, see libusb_trace_dump().
+ *
+ * On Linux, if the SystemTap SDT header is found at build time (see the
+ * --enable-usdt configure option), the same trace points are also built in
+ * as USDT probes of the "libusb" provider, e.g. libusb:submit and
+ * libusb:urb_reap. These cost nothing until a tool such as perf, bpftrace
+ * or SystemTap attaches to them, and need no environment variable.
+ *
  * \section remarks Other remarks
  *
  * libusb does have imperfections. The \ref caveats "caveats" page attempts
@@ -714,6 +728,9 @@ void usbi_disconnect_device(struct libusb_device *dev)
 	list_del(&dev->list);
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
 
+	/* a device showing up at the same address is a different one */
+	usbi_free_endpoint_stats(dev);
+
 	/* Signal that an event has occurred for this device if we support hotplug AND
 	 * the hotplug message list is ready. This prevents an event from getting raised
 	 * during initial enumeration. libusb_handle_events will take care of dereferencing
@@ -1153,6 +1170,7 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 			usbi_disconnect_device(dev);
 		}
 
+		usbi_free_endpoint_stats(dev);
 		usbi_mutex_destroy(&dev->lock);
 		free(dev);
 	}
@@ -1199,16 +1217,31 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		free(_handle);
 		return LIBUSB_ERROR_OTHER;
 	}
+	r = usbi_cond_init(&_handle->callbacks_cond, NULL);
+	if (r) {
+		usbi_mutex_destroy(&_handle->lock);
+		free(_handle);
+		return LIBUSB_ERROR_OTHER;
+	}
 
 	_handle->dev = libusb_ref_device(dev);
 	_handle->auto_detach_kernel_driver = 0;
+	_handle->direct_sync_transfers = 0;
 	_handle->claimed_interfaces = 0;
+	_handle->sync_transfer = NULL;
+	_handle->sync_buffer = NULL;
+	_handle->sync_buffer_len = 0;
+	_handle->shard = NULL;
+	_handle->queued_callbacks = 0;
+	_handle->callback_worker = NULL;
+	_handle->closing = 0;
 	memset(&_handle->os_priv, 0, priv_size);
 
 	r = usbi_backend->open(_handle);
 	if (r < 0) {
 		usbi_dbg("open %d.%d returns %d", dev->bus_number, dev->device_address, r);
 		libusb_unref_device(dev);
+		usbi_cond_destroy(&_handle->callbacks_cond);
 		usbi_mutex_destroy(&_handle->lock);
 		free(_handle);
 		return r;
@@ -1283,7 +1316,7 @@ static void do_close(struct libusb_context *ctx,
 	libusb_lock_events(ctx);
 
 	/* remove any transfers in flight that are for this device */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_lock_flying_transfers(ctx);
 
 	/* safe iteration because transfers may be being deleted */
 	list_for_each_entry_safe(itransfer, tmp, &ctx->flying_transfers, list, struct usbi_transfer) {
@@ -1318,7 +1351,7 @@ static void do_close(struct libusb_context *ctx,
 		usbi_dbg("Removed transfer %p from the in-flight list because device handle %p closed",
 			 transfer, dev_handle);
 	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_unlock_flying_transfers(ctx);
 
 	libusb_unlock_events(ctx);
 
@@ -1328,6 +1361,10 @@ static void do_close(struct libusb_context *ctx,
 
 	usbi_backend->close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
+	if (dev_handle->sync_transfer)
+		libusb_free_transfer(dev_handle->sync_transfer);
+	free(dev_handle->sync_buffer);
+	usbi_cond_destroy(&dev_handle->callbacks_cond);
 	usbi_mutex_destroy(&dev_handle->lock);
 	free(dev_handle);
 }
@@ -1346,6 +1383,7 @@ static void do_close(struct libusb_context *ctx,
 void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 {
 	struct libusb_context *ctx;
+	struct usbi_event_shard *shard;
 	int pending_events;
 
 	if (!dev_handle)
@@ -1354,6 +1392,14 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 
 	ctx = HANDLE_CTX(dev_handle);
 
+	/* Let the callback executor finish the callbacks of transfers that
+	 * have completed. This is done before taking the event handling lock,
+	 * as a callback may need event handling to complete a synchronous
+	 * transfer. The callbacks of transfers completing from now on are
+	 * invoked by the thread handling the events of the device, which
+	 * do_close() stops doing. */
+	usbi_drain_transfer_callbacks(dev_handle);
+
 	/* Similarly to libusb_open(), we want to interrupt all event handlers
 	 * at this point. More importantly, we want to perform the actual close of
 	 * the device while holding the event handling lock (preventing any other
@@ -1362,27 +1408,30 @@ void API_EXPORTED libusb_close(libusb_device_handle *dev_handle)
 
 	/* Record that we are closing a device.
 	 * Only signal an event if there are no prior pending events. */
-	usbi_mutex_lock(&ctx->event_data_lock);
+	usbi_lock_event_data(ctx);
 	pending_events = usbi_pending_events(ctx);
 	ctx->device_close++;
 	if (!pending_events)
-		usbi_signal_event(&ctx->event);
-	usbi_mutex_unlock(&ctx->event_data_lock);
+		usbi_signal_context_event(ctx);
+	usbi_unlock_event_data(ctx);
 
-	/* take event handling lock */
+	/* take event handling lock, and that of the event shard handling the
+	 * device, if any */
 	libusb_lock_events(ctx);
+	shard = usbi_lock_event_shard(dev_handle);
 
 	/* Close the device */
 	do_close(ctx, dev_handle);
+	usbi_unlock_event_shard(shard);
 
 	/* We're done with closing this device.
 	 * Clear the event pipe if there are no further pending events. */
-	usbi_mutex_lock(&ctx->event_data_lock);
+	usbi_lock_event_data(ctx);
 	ctx->device_close--;
 	pending_events = usbi_pending_events(ctx);
 	if (!pending_events)
-		usbi_clear_event(&ctx->event);
-	usbi_mutex_unlock(&ctx->event_data_lock);
+		usbi_clear_context_event(ctx);
+	usbi_unlock_event_data(ctx);
 
 	/* Release event handling lock and wake up event waiters */
 	libusb_unlock_events(ctx);
@@ -1896,6 +1945,45 @@ int API_EXPORTED libusb_set_auto_detach_kernel_driver(
 	return LIBUSB_SUCCESS;
 }
 
+/** \ingroup dev
+ * Enable/disable direct synchronous transfers. When this is enabled, the
+ * \ref syncio "synchronous I/O functions" hand control, bulk and interrupt
+ * transfers directly to the operating system as blocking requests, instead
+ * of submitting an asynchronous transfer and running the event loop until
+ * it completes. This roughly halves the overhead of each call, which
+ * matters to applications that issue many small synchronous transfers.
+ *
+ * Requests the platform cannot perform this way (for instance, bulk
+ * transfers larger than what a single request can carry) transparently
+ * fall back to the regular asynchronous path.
+ *
+ * Direct transfers are not visible to the event loop. They cannot be
+ * cancelled, other threads waiting for events are not woken when they
+ * complete, and if a direct bulk or interrupt transfer times out, no
+ * partial data is reported in <tt>transferred</tt>.
+ *
+ * Direct synchronous transfers are disabled on newly opened device handles
+ * by default.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev a device handle
+ * \param enable whether to enable or disable direct synchronous transfers
+ *
+ * \returns LIBUSB_SUCCESS on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on platforms where the functionality
+ * is not available
+ */
+int API_EXPORTED libusb_set_direct_sync_transfers(
+	libusb_device_handle *dev, int enable)
+{
+	if (!usbi_backend->sync_control_transfer || !usbi_backend->sync_bulk_transfer)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	dev->direct_sync_transfers = enable;
+	return LIBUSB_SUCCESS;
+}
+
 /** \ingroup lib
  * Set log message verbosity.
  *
@@ -1951,6 +2039,11 @@ int API_EXPORTED libusb_init(libusb_context **context)
 
 	usbi_mutex_static_lock(&default_context_lock);
 
+	/* used for messages logged without a context, saving a getenv() call
+	 * for every one of them */
+	env_debug_level = dbg ? atoi(dbg) : 0;
+	trace_init();
+
 	if (!timestamp_origin.tv_sec) {
 		usbi_gettimeofday(&timestamp_origin, NULL);
 	}
@@ -2052,7 +2145,10 @@ err_unlock:
 
 /** \ingroup lib
  * Deinitialize libusb. Should be called after closing all open devices and
- * before your application terminates.
+ * before your application terminates. An event handling thread started with
+ * libusb_start_event_thread(), event shards started with
+ * libusb_start_event_shards() and a callback executor started with
+ * libusb_start_callback_executor() are stopped.
  * \param ctx the context to deinitialize, or NULL for the default context
  */
 void API_EXPORTED libusb_exit(struct libusb_context *ctx)
@@ -2077,6 +2173,10 @@ void API_EXPORTED libusb_exit(struct libusb_context *ctx)
 	}
 	usbi_mutex_static_unlock(&default_context_lock);
 
+	libusb_stop_event_thread(ctx);
+	libusb_stop_event_shards(ctx);
+	libusb_stop_callback_executor(ctx);
+
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_del (&ctx->list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
@@ -2196,6 +2296,271 @@ int usbi_gettimeofday(struct timeval *tp, void *tzp)
 }
 #endif
 
+/* The compiler's thread-local storage keeps each thread's trace ring at
+ * hand without any locking. Without it, tracing is not available. */
+#if defined(_MSC_VER)
+#define USBI_THREAD_LOCAL	__declspec(thread)
+#elif defined(__GNUC__)
+#define USBI_THREAD_LOCAL	__thread
+#endif
+
+/* Number of records in each thread's trace ring, unless set through the
+ * LIBUSB_TRACE environment variable. Rounded up to a power of 2. */
+#define TRACE_RING_SIZE_DEFAULT	4096
+#define TRACE_RING_SIZE_MIN	64
+#define TRACE_RING_SIZE_MAX	(1 << 20)
+
+/* The layout of a trace record in the output of libusb_trace_dump() */
+struct usbi_trace_record {
+	uint64_t timestamp;	/* nanoseconds, monotonic clock */
+	uint32_t tid;
+	uint16_t point;
+	uint16_t reserved;
+	uint64_t arg[2];
+};
+
+struct usbi_trace_ring {
+	struct list_head list;
+	uint32_t tid;
+
+	/* number of records ever written. only the thread owning the ring
+	 * writes to it, libusb_trace_dump() reads it from other threads */
+	volatile unsigned long head;
+
+	/* set when the owning thread has exited, protected by
+	 * trace_rings_lock */
+	int retired;
+
+	struct usbi_trace_record *records;
+};
+
+/* indexed by enum usbi_trace_point */
+static const char * const usbi_trace_point_names[USBI_TRACE_POINT_COUNT] = {
+	"submit",
+	"cancel",
+	"timeout",
+	"complete",
+	"callback_done",
+	"events_wait",
+	"events_done",
+	"hotplug_arrived",
+	"hotplug_left",
+	"urb_submit",
+	"urb_reap",
+};
+
+int usbi_trace_enabled = 0;
+static unsigned long trace_ring_size;
+
+/* rings of all threads that hit a trace point. the ring of a thread that
+ * has exited is kept, so that its last events can still be dumped, until a
+ * new thread takes it over. the number of rings is thus bounded by the
+ * number of threads tracing at the same time. */
+static usbi_mutex_static_t trace_rings_lock = USBI_MUTEX_INITIALIZER;
+static struct list_head trace_rings = { &trace_rings, &trace_rings };
+
+#ifdef USBI_THREAD_LOCAL
+static USBI_THREAD_LOCAL struct usbi_trace_ring *trace_ring;
+#endif
+
+#if defined(USBI_THREAD_LOCAL) && defined(PLATFORM_POSIX)
+/* thread-local storage has no destructors, so a key with the same value
+ * tells when a thread exits. without it, rings are never reused. */
+static pthread_key_t trace_ring_key;
+
+static void trace_ring_retire(void *arg)
+{
+	struct usbi_trace_ring *ring = arg;
+
+	trace_ring = NULL;
+	usbi_mutex_static_lock(&trace_rings_lock);
+	ring->retired = 1;
+	usbi_mutex_static_unlock(&trace_rings_lock);
+}
+#endif
+
+/* called with default_context_lock held */
+static void trace_init(void)
+{
+#ifdef USBI_THREAD_LOCAL
+	static int trace_initialized = 0;
+	unsigned long size;
+	char *env;
+
+	if (trace_initialized)
+		return;
+	trace_initialized = 1;
+
+	env = getenv("LIBUSB_TRACE");
+	if (!env)
+		return;
+	size = strtoul(env, NULL, 0);
+	if (!size)
+		return;
+	if (size == 1)
+		size = TRACE_RING_SIZE_DEFAULT;
+	if (size > TRACE_RING_SIZE_MAX)
+		size = TRACE_RING_SIZE_MAX;
+
+	for (trace_ring_size = TRACE_RING_SIZE_MIN; trace_ring_size < size;
+	     trace_ring_size <<= 1)
+		;
+#if defined(PLATFORM_POSIX)
+	if (pthread_key_create(&trace_ring_key, trace_ring_retire) != 0)
+		return;
+#endif
+	usbi_trace_enabled = 1;
+	usbi_dbg("tracing enabled, %lu records per thread", trace_ring_size);
+#endif
+}
+
+#ifdef USBI_THREAD_LOCAL
+static struct usbi_trace_ring *trace_ring_create(void)
+{
+	struct usbi_trace_ring *ring;
+
+	/* take over the ring of a thread that has exited, if any */
+	usbi_mutex_static_lock(&trace_rings_lock);
+	list_for_each_entry(ring, &trace_rings, list, struct usbi_trace_ring) {
+		if (ring->retired) {
+			ring->retired = 0;
+			ring->head = 0;
+			ring->tid = (uint32_t)usbi_get_tid();
+			usbi_mutex_static_unlock(&trace_rings_lock);
+			return ring;
+		}
+	}
+	usbi_mutex_static_unlock(&trace_rings_lock);
+
+	ring = malloc(sizeof(*ring));
+	if (!ring)
+		return NULL;
+	ring->records = malloc(trace_ring_size * sizeof(*ring->records));
+	if (!ring->records) {
+		free(ring);
+		return NULL;
+	}
+	ring->tid = (uint32_t)usbi_get_tid();
+	ring->head = 0;
+	ring->retired = 0;
+
+	usbi_mutex_static_lock(&trace_rings_lock);
+	list_add_tail(&ring->list, &trace_rings);
+	usbi_mutex_static_unlock(&trace_rings_lock);
+	return ring;
+}
+#endif
+
+void usbi_trace_event(enum usbi_trace_point point, uint64_t arg0,
+	uint64_t arg1)
+{
+#ifdef USBI_THREAD_LOCAL
+	struct usbi_trace_ring *ring = trace_ring;
+	struct usbi_trace_record *record;
+
+	if (!ring) {
+		ring = trace_ring_create();
+		if (!ring)
+			return;
+		trace_ring = ring;
+#if defined(PLATFORM_POSIX)
+		pthread_setspecific(trace_ring_key, ring);
+#endif
+	}
+
+	record = &ring->records[ring->head & (trace_ring_size - 1)];
+	record->timestamp = usbi_get_monotonic_ns();
+	record->tid = ring->tid;
+	record->point = (uint16_t)point;
+	record->reserved = 0;
+	record->arg[0] = arg0;
+	record->arg[1] = arg1;
+	ring->head++;
+#else
+	UNUSED(point);
+	UNUSED(arg0);
+	UNUSED(arg1);
+#endif
+}
+
+/** \ingroup lib
+ * Write the contents of the trace buffers to a file.
+ *
+ * When the LIBUSB_TRACE environment variable is set when libusb is first
+ * initialized, libusb records events on its hot paths (transfer submission
+ * and completion, event handling, URB submission and reaping) in a ring
+ * buffer for each thread. Set the variable to 1 to keep the last 4096
+ * events per thread, or to the number of events to keep. Recording an
+ * event takes in the order of 50 nanoseconds, so unlike debug logging this
+ * hardly changes the timing of the application.
+ *
+ * The file written starts with an 8 byte signature "LUSBTRC1", the size of
+ * a trace record and the number of trace points as 32-bit integers, and the
+ * names of the trace points as NUL terminated strings. The records of each
+ * thread follow in the order they were recorded. Each record consists of a
+ * 64-bit timestamp in nanoseconds, a 32-bit thread ID, a 16-bit trace point
+ * number, 16 reserved bits, and two 64-bit arguments. All values are in
+ * host byte order. The tracedump example program decodes these files.
+ *
+ * Records are written by their threads without locking, so the events that
+ * happen while this function runs may be missing or garbled in its output.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param path name of the file to write
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if tracing is not enabled or not
+ * available on this platform
+ * \returns LIBUSB_ERROR_IO if the file could not be written
+ */
+int API_EXPORTED libusb_trace_dump(const char *path)
+{
+	struct {
+		char signature[8];
+		uint32_t record_size;
+		uint32_t num_points;
+	} header;
+	struct usbi_trace_ring *ring;
+	FILE *f;
+	int i, r = 0;
+
+	if (!usbi_trace_enabled)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	f = fopen(path, "wb");
+	if (!f)
+		return LIBUSB_ERROR_IO;
+
+	memcpy(header.signature, "LUSBTRC1", sizeof(header.signature));
+	header.record_size = sizeof(struct usbi_trace_record);
+	header.num_points = USBI_TRACE_POINT_COUNT;
+	fwrite(&header, sizeof(header), 1, f);
+	for (i = 0; i < USBI_TRACE_POINT_COUNT; i++)
+		fwrite(usbi_trace_point_names[i],
+			strlen(usbi_trace_point_names[i]) + 1, 1, f);
+
+	usbi_mutex_static_lock(&trace_rings_lock);
+	list_for_each_entry(ring, &trace_rings, list, struct usbi_trace_ring) {
+		unsigned long head = ring->head;
+		unsigned long count = MIN(head, trace_ring_size);
+		unsigned long first = (head - count) & (trace_ring_size - 1);
+		unsigned long wrapped = first + count > trace_ring_size ?
+			first + count - trace_ring_size : 0;
+
+		/* oldest records first */
+		fwrite(&ring->records[first], sizeof(struct usbi_trace_record),
+			count - wrapped, f);
+		fwrite(ring->records, sizeof(struct usbi_trace_record), wrapped, f);
+	}
+	usbi_mutex_static_unlock(&trace_rings_lock);
+
+	if (ferror(f))
+		r = LIBUSB_ERROR_IO;
+	if (fclose(f) != 0)
+		r = LIBUSB_ERROR_IO;
+	return r;
+}
+
 static void usbi_log_str(struct libusb_context *ctx,
 	enum libusb_log_level level, const char * str)
 {
@@ -2250,13 +2615,10 @@ void usbi_log_v(struct libusb_context *ctx, enum libusb_log_level level,
 	int ctx_level = 0;
 
 	USBI_GET_CONTEXT(ctx);
-	if (ctx) {
+	if (ctx)
 		ctx_level = ctx->debug;
-	} else {
-		char *dbg = getenv("LIBUSB_DEBUG");
-		if (dbg)
-			ctx_level = atoi(dbg);
-	}
+	else
+		ctx_level = env_debug_level;
 	global_debug = (ctx_level == LIBUSB_LOG_LEVEL_DEBUG);
 	if (!ctx_level)
 		return;
@@ -67,6 +67,12 @@
  *
  * Callbacks for a particular context are automatically deregistered by libusb_exit().
  *
+ * On Linux builds that do not use udev, the arrivals reported can be limited
+ * to a set of devices with the LIBUSB_HOTPLUG_ALLOWLIST environment variable,
+ * a comma separated list of hexadecimal vendor:product IDs such as
+ * "046d:c52b,1d6b:0002". It is read when the first context is initialized.
+ * Departures are always reported.
+ *
  * As of 1.0.16 there are two supported hotplug events:
  *  - LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED: A device has arrived and is ready to use
  *  - LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT: A device has left and is no longer available
@@ -203,28 +209,102 @@ void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
 	/* the backend is expected to call the callback for each active transfer */
 }
 
+/* Populate the per-context pool of hotplug messages. Called with the list
+ * heads initialized, before any hotplug notification can be raised. */
+int usbi_hotplug_msg_pool_init(struct libusb_context *ctx)
+{
+	libusb_hotplug_message *message;
+	int i;
+
+	for (i = 0; i < USBI_HOTPLUG_MSG_POOL_SIZE; i++) {
+		message = calloc(1, sizeof(*message));
+		if (!message) {
+			usbi_hotplug_msg_pool_exit(ctx);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		list_add(&message->list, &ctx->hotplug_msgs_free);
+		ctx->hotplug_msgs_allocated++;
+	}
+
+	return 0;
+}
+
+/* Free the pool along with any message that was never processed */
+void usbi_hotplug_msg_pool_exit(struct libusb_context *ctx)
+{
+	libusb_hotplug_message *message, *tmp;
+
+	list_for_each_entry_safe(message, tmp, &ctx->hotplug_msgs, list, libusb_hotplug_message) {
+		list_del(&message->list);
+		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message->event)
+			libusb_unref_device(message->device);
+		free(message);
+	}
+
+	list_for_each_entry_safe(message, tmp, &ctx->hotplug_msgs_free, list, libusb_hotplug_message) {
+		list_del(&message->list);
+		free(message);
+	}
+
+	if (ctx->hotplug_msgs_dropped)
+		usbi_warn(ctx, "%u hotplug notification(s) were dropped",
+			ctx->hotplug_msgs_dropped);
+	ctx->hotplug_msgs_allocated = 0;
+}
+
+/* Return a processed message to the pool */
+void usbi_hotplug_msg_release(struct libusb_context *ctx,
+	libusb_hotplug_message *message)
+{
+	usbi_lock_event_data(ctx);
+	list_add(&message->list, &ctx->hotplug_msgs_free);
+	usbi_unlock_event_data(ctx);
+}
+
 void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device *dev,
 	libusb_hotplug_event event)
 {
 	int pending_events;
-	libusb_hotplug_message *message = calloc(1, sizeof(*message));
-
-	if (!message) {
-		usbi_err(ctx, "error allocating hotplug message");
-		return;
+	libusb_hotplug_message *message;
+
+	/* dev is NULL when a callback was deregistered */
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		usbi_trace(HOTPLUG_ARRIVED, dev,
+			dev->bus_number << 8 | dev->device_address);
+	else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		usbi_trace(HOTPLUG_LEFT, dev,
+			dev->bus_number << 8 | dev->device_address);
+
+	/* Take the event data lock and add a message from the pool to the list,
+	 * growing the pool if it has been exhausted by a burst of events.
+	 * Only signal an event if there are no prior pending events. */
+	usbi_lock_event_data(ctx);
+	if (!list_empty(&ctx->hotplug_msgs_free)) {
+		message = list_first_entry(&ctx->hotplug_msgs_free, libusb_hotplug_message, list);
+		list_del(&message->list);
+	} else {
+		message = malloc(sizeof(*message));
+		if (!message) {
+			ctx->hotplug_msgs_dropped++;
+			usbi_unlock_event_data(ctx);
+			usbi_err(ctx, "error allocating hotplug message");
+			/* nobody will process this departure, drop its reference */
+			if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == event)
+				libusb_unref_device(dev);
+			return;
+		}
+		ctx->hotplug_msgs_allocated++;
+		usbi_dbg("grew hotplug message pool to %u", ctx->hotplug_msgs_allocated);
 	}
 
 	message->event = event;
 	message->device = dev;
 
-	/* Take the event data lock and add this message to the list.
-	 * Only signal an event if there are no prior pending events. */
-	usbi_mutex_lock(&ctx->event_data_lock);
 	pending_events = usbi_pending_events(ctx);
 	list_add_tail(&message->list, &ctx->hotplug_msgs);
 	if (!pending_events)
-		usbi_signal_event(&ctx->event);
-	usbi_mutex_unlock(&ctx->event_data_lock);
+		usbi_signal_context_event(ctx);
+	usbi_unlock_event_data(ctx);
 }
 
 int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
@@ -81,6 +81,13 @@ struct libusb_hotplug_message {
 
 typedef struct libusb_hotplug_message libusb_hotplug_message;
 
+/* Number of hotplug messages preallocated for each context */
+#define USBI_HOTPLUG_MSG_POOL_SIZE	32
+
+int usbi_hotplug_msg_pool_init(struct libusb_context *ctx);
+void usbi_hotplug_msg_pool_exit(struct libusb_context *ctx);
+void usbi_hotplug_msg_release(struct libusb_context *ctx,
+			libusb_hotplug_message *message);
 void usbi_hotplug_deregister_all(struct libusb_context *ctx);
 void usbi_hotplug_match(struct libusb_context *ctx, struct libusb_device *dev,
 			libusb_hotplug_event event);
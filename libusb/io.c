@@ -23,6 +23,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
@@ -584,6 +585,22 @@ void my_libusb_exit(void)
     libusb_exit(ctx);
 }
 \endcode
+ *
+ * Alternatively, libusb_start_event_thread() starts a thread running this
+ * loop which libusb_stop_event_thread() wakes up and stops without either
+ * of the above, and which can be pinned to CPUs and given a real-time
+ * priority.
+ *
+ * Transfer callbacks are invoked by the thread handling events, which can't
+ * reap other transfers meanwhile. Applications doing lengthy work in their
+ * callbacks can have them invoked by a pool of threads instead, see
+ * libusb_start_callback_executor().
+ *
+ * Likewise a single thread reaps the transfers of all devices of a context.
+ * libusb_start_event_shards() partitions the device handles opened
+ * afterwards over several threads instead, each polling and reaping the
+ * transfers of its own handles, while timeouts and hotplug events are still
+ * handled as above.
  */
 
 /**
@@ -694,6 +711,11 @@ while (user has not requested application exit) {
 
 // clean up and exit
 \endcode
+ *
+ * On Linux, libusb_get_event_fd() returns a single file descriptor which
+ * stands for the whole set and, where libusb uses a timer, also for the
+ * timeouts. The main loop then only needs to monitor that descriptor and
+ * call libusb_handle_events_ready() when it is readable.
  *
  * \subsection polltime Notes on time-based events
  *
@@ -1111,6 +1133,120 @@ printf("completed!\n");
  * give up the events lock if instructed.
  */
 
+/* What is recorded in the statistics about a completed transfer. This is
+ * gathered before the callback runs, as it may free the transfer. */
+struct transfer_sample {
+	unsigned char endpoint;
+	unsigned char type;
+	enum libusb_transfer_status status;
+	int transferred;
+	uint64_t submit_time;
+	uint64_t in_flight_time;
+	uint64_t completed_time;
+};
+
+/* Free the statistics of a device, when it is destroyed or disconnected */
+void usbi_free_endpoint_stats(struct libusb_device *dev)
+{
+	int i;
+
+	usbi_mutex_lock(&dev->lock);
+	for (i = 0; i < USBI_ENDPOINT_STATS_SLOTS; i++) {
+		free(dev->endpoint_stats[i]);
+		dev->endpoint_stats[i] = NULL;
+	}
+	usbi_mutex_unlock(&dev->lock);
+}
+
+static int histogram_bucket(uint64_t value)
+{
+	int msb = 3;
+
+	if (value < 8)
+		return (int)value;
+
+	while (msb < 63 && (value >> (msb + 1)))
+		msb++;
+	return MIN((msb - 2) * 8 + (int)((value >> (msb - 3)) & 7),
+		LIBUSB_STATS_HISTOGRAM_BUCKETS - 1);
+}
+
+/* largest value counted in a bucket */
+static uint64_t histogram_bucket_max(int bucket)
+{
+	int msb;
+
+	if (bucket < 8)
+		return bucket;
+
+	msb = bucket / 8 + 2;
+	return ((uint64_t)(8 + bucket % 8 + 1) << (msb - 3)) - 1;
+}
+
+static void histogram_add(struct libusb_stats_histogram *histogram,
+	uint64_t value)
+{
+	histogram->count++;
+	histogram->total_ns += value;
+	if (value > histogram->max_ns)
+		histogram->max_ns = value;
+	histogram->buckets[histogram_bucket(value)]++;
+}
+
+static void update_endpoint_stats(struct libusb_device *dev,
+	const struct transfer_sample *sample, uint64_t callback_time)
+{
+	/* endpoint number in the low bits, direction above */
+	int slot = (sample->endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) |
+		((sample->endpoint & LIBUSB_ENDPOINT_DIR_MASK) >> 3);
+	struct libusb_endpoint_stats *stats;
+
+	usbi_mutex_lock(&dev->lock);
+	stats = dev->endpoint_stats[slot];
+	if (!stats) {
+		stats = calloc(1, sizeof(*stats));
+		if (!stats) {
+			usbi_mutex_unlock(&dev->lock);
+			return;
+		}
+		stats->bus_number = dev->bus_number;
+		stats->device_address = dev->device_address;
+		stats->endpoint = sample->endpoint;
+		dev->endpoint_stats[slot] = stats;
+	}
+
+	stats->transfer_type = sample->type;
+	stats->transfers++;
+	stats->bytes += sample->transferred;
+	switch (sample->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		stats->timeouts++;
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		stats->cancellations++;
+		break;
+	default:
+		stats->errors++;
+		break;
+	}
+
+	/* the transfer may have completed before the submitting thread
+	 * got to record when the backend had submitted it */
+	if (sample->in_flight_time >= sample->submit_time &&
+	    sample->in_flight_time <= sample->completed_time)
+		histogram_add(&stats->submit_latency,
+			sample->in_flight_time - sample->submit_time);
+	if (sample->completed_time >= sample->submit_time)
+		histogram_add(&stats->transfer_latency,
+			sample->completed_time - sample->submit_time);
+	if (callback_time >= sample->completed_time)
+		histogram_add(&stats->callback_latency,
+			callback_time - sample->completed_time);
+	usbi_mutex_unlock(&dev->lock);
+}
+
 int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
@@ -1122,13 +1258,20 @@ int usbi_io_init(struct libusb_context *ctx)
 	usbi_mutex_init(&ctx->event_data_lock, NULL);
 	list_init(&ctx->flying_transfers);
 	list_init(&ctx->event_sources);
+	ctx->event_fd = -1;
 	list_init(&ctx->hotplug_msgs);
+	list_init(&ctx->hotplug_msgs_free);
 	list_init(&ctx->completed_transfers);
+	list_init(&ctx->sync_waiters);
+
+	r = usbi_hotplug_msg_pool_init(ctx);
+	if (r < 0)
+		goto err;
 
 	r = usbi_create_event(&ctx->event);
 	if (r < 0) {
 		r = LIBUSB_ERROR_OTHER;
-		goto err;
+		goto err_free_msgs;
 	}
 
 	r = usbi_add_event_source(ctx, USBI_EVENT_GET_SOURCE(ctx->event), USBI_EVENT_MASK);
@@ -1150,6 +1293,9 @@ err_destroy_timer:
 	usbi_remove_event_source(ctx, USBI_EVENT_GET_SOURCE(ctx->event));
 err_destroy_event:
 	usbi_destroy_event(&ctx->event);
+	free(ctx->event_slots);
+err_free_msgs:
+	usbi_hotplug_msg_pool_exit(ctx);
 err:
 	usbi_mutex_destroy(&ctx->flying_transfers_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
@@ -1171,9 +1317,12 @@ void usbi_io_exit(struct libusb_context *ctx)
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
+	usbi_hotplug_msg_pool_exit(ctx);
+	usbi_destroy_event_fd(ctx);
 	usbi_mutex_destroy(&ctx->event_data_lock);
 	if (ctx->event_data)
 		free(ctx->event_data);
+	free(ctx->event_slots);
 }
 
 static int calculate_timeout(struct usbi_transfer *transfer)
@@ -1306,6 +1455,59 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 	free(itransfer);
 }
 
+/* arms the timer to expire at an absolute deadline, rounded up to a
+ * multiple of the timer slack of the context. the timer is left alone if it
+ * is already armed to expire at that time, which with a slack saves the
+ * system call for most transfers when many are queued with the same timeout.
+ * must be called with flying_list locked.
+ * returns 0 on success or a LIBUSB_ERROR code on failure.
+ */
+static int arm_timer(struct libusb_context *ctx, const struct timeval *deadline)
+{
+	struct timeval expiry = *deadline;
+	struct timeval timeout;
+	int r;
+
+	if (ctx->timer_slack_us) {
+		uint64_t usec = (uint64_t)expiry.tv_sec * 1000000 + expiry.tv_usec;
+
+		usec += ctx->timer_slack_us - 1;
+		usec -= usec % ctx->timer_slack_us;
+		expiry.tv_sec = (long)(usec / 1000000);
+		expiry.tv_usec = (long)(usec % 1000000);
+	}
+
+	if (timerisset(&ctx->timer_expiry) &&
+	    ctx->timer_expiry.tv_sec == expiry.tv_sec &&
+	    ctx->timer_expiry.tv_usec == expiry.tv_usec) {
+		ctx->counters.timer_arms_skipped++;
+		return 0;
+	}
+
+	/* since time has elapsed since the deadline was set, we calculate the
+	 * remaining time and arm the timer to expire then. if the deadline has
+	 * already passed, we arm the timer with the smallest possible timeout
+	 * so that it is immediately triggered. */
+	r = calculate_remaining(ctx, &expiry, &timeout);
+	if (r < 0)
+		return LIBUSB_ERROR_OTHER;
+
+	if (!timerisset(&timeout)) {
+		usbi_dbg("transfer already timed out, arming timer for shortest timeout");
+		timeout.tv_usec = 1;
+	}
+
+	ctx->counters.timer_arms++;
+	r = usbi_arm_timer(ctx->timer, &timeout);
+	if (r < 0) {
+		timerclear(&ctx->timer_expiry);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	ctx->timer_expiry = expiry;
+	return 0;
+}
+
 /* iterates through the flying transfers, and rearms the timer based on the
  * next upcoming timeout.
  * must be called with flying_list locked.
@@ -1327,33 +1529,16 @@ static int arm_timer_for_next_timeout(struct libusb_context *ctx)
 
 		/* act on first transfer that is not already cancelled */
 		if (!(transfer->flags & USBI_TRANSFER_TIMEOUT_HANDLED)) {
-			struct timeval timeout;
-			int r;
 			usbi_dbg("next timeout originally %dms",
 					USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
-
-			/* since time has elapsed since this transfer was added to the list,
-			 * we calculate the remaining time and arm the timer to expire then.
-			 * if the transfer has already timed out, we arm the timer with the
-			 * smallest possible timeout so that it is immediately triggered. */
-			r = calculate_remaining(ctx, &transfer->timeout, &timeout);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
-
-			if (!timerisset(&timeout)) {
-				usbi_dbg("transfer already timed out, arming timer for shortest timeout");
-				timeout.tv_usec = 1;
-			}
-
-			r = usbi_arm_timer(ctx->timer, &timeout);
-			if (r < 0)
-				return LIBUSB_ERROR_OTHER;
-			return 0;
+			return arm_timer(ctx, &transfer->timeout);
 		}
 	}
 
 disarm:
 	usbi_dbg("no timeouts, disarming timer");
+	ctx->counters.timer_disarms++;
+	timerclear(&ctx->timer_expiry);
 	return usbi_disarm_timer(ctx->timer);
 }
 
@@ -1368,7 +1553,7 @@ static int add_to_flying_list(struct usbi_transfer *transfer)
 	int r = 0;
 	int first = 1;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_lock_flying_transfers(ctx);
 
 	/* if we have no other flying transfers, start the list with this one */
 	if (list_empty(&ctx->flying_transfers)) {
@@ -1404,10 +1589,9 @@ out:
 	if (first && usbi_using_timer(ctx) && timerisset(timeout)) {
 		/* if this transfer has the lowest timeout of all active transfers,
 		 * rearm the timer with this transfer's timeout */
-		int timeout_ms = USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout;
-		struct timeval timeout_tv = { (timeout_ms / 1000), ((timeout_ms % 1000) * 1000) };
-		usbi_dbg("arm timer for timeout in %dms (first in line)", timeout_ms);
-		r = usbi_arm_timer(ctx->timer, &timeout_tv);
+		usbi_dbg("arm timer for timeout in %dms (first in line)",
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer)->timeout);
+		r = arm_timer(ctx, timeout);
 		if (r < 0) {
 			usbi_warn(ctx, "failed to arm first timer (errno %d)", errno);
 			r = LIBUSB_ERROR_OTHER;
@@ -1417,7 +1601,7 @@ out:
 	if (r)
 		list_del(&transfer->list);
 
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_unlock_flying_transfers(ctx);
 	return r;
 }
 
@@ -1431,14 +1615,98 @@ static int remove_from_flying_list(struct usbi_transfer *transfer)
 	int rearm_timer;
 	int r = 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_lock_flying_transfers(ctx);
 	rearm_timer = (timerisset(&transfer->timeout) &&
 		list_first_entry(&ctx->flying_transfers, struct usbi_transfer, list) == transfer);
 	list_del(&transfer->list);
 	if (usbi_using_timer(ctx) && rearm_timer)
 		r = arm_timer_for_next_timeout(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_unlock_flying_transfers(ctx);
+
+	return r;
+}
+
+/* copy the scatter-gather segments of a transfer into a contiguous bounce
+ * buffer, for backends which cannot transfer from them directly */
+static int bounce_iovec(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
+		== LIBUSB_ENDPOINT_OUT;
+	unsigned char *bounce;
+	int i, offset = 0;
+
+	bounce = malloc(transfer->length ? transfer->length : 1);
+	if (!bounce)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (is_out) {
+		for (i = 0; i < itransfer->iovcnt; i++) {
+			int len = itransfer->iov[i].iov_len;
+			if (len > transfer->length - offset)
+				len = transfer->length - offset;
+			memcpy(bounce + offset, itransfer->iov[i].iov_base, len);
+			offset += len;
+		}
+	}
+
+	itransfer->iov_bounce = bounce;
+	itransfer->iov_saved_buffer = transfer->buffer;
+	transfer->buffer = bounce;
+	return 0;
+}
+
+/* release the bounce buffer of a transfer, if it has one. if copy_in is set
+ * the data received by an IN transfer is copied back to the segments. */
+static void unbounce_iovec(struct usbi_transfer *itransfer, int copy_in)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int i, offset = 0;
+
+	if (!itransfer->iov_bounce)
+		return;
+
+	if (copy_in && (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
+			== LIBUSB_ENDPOINT_IN) {
+		for (i = 0; i < itransfer->iovcnt
+				&& offset < itransfer->transferred; i++) {
+			int len = itransfer->iov[i].iov_len;
+			if (len > itransfer->transferred - offset)
+				len = itransfer->transferred - offset;
+			memcpy(itransfer->iov[i].iov_base,
+				itransfer->iov_bounce + offset, len);
+			offset += len;
+		}
+	}
+
+	transfer->buffer = itransfer->iov_saved_buffer;
+	free(itransfer->iov_bounce);
+	itransfer->iov_bounce = NULL;
+	itransfer->iov_saved_buffer = NULL;
+}
+
+static int submit_to_backend(struct usbi_transfer *itransfer)
+{
+	int r;
+
+	if (itransfer->iov && !(usbi_backend->caps & USBI_CAP_SUPPORTS_BULK_IOVEC)) {
+		r = bounce_iovec(itransfer);
+		if (r < 0)
+			return r;
+	}
+
+	r = usbi_backend->submit_transfer(itransfer);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED && usbi_transfer_get_iovec(itransfer)) {
+		usbi_dbg("backend cannot use segments directly, bouncing");
+		r = bounce_iovec(itransfer);
+		if (r == 0)
+			r = usbi_backend->submit_transfer(itransfer);
+	}
 
+	if (r < 0)
+		unbounce_iovec(itransfer, 0);
 	return r;
 }
 
@@ -1452,6 +1720,9 @@ static int remove_from_flying_list(struct usbi_transfer *transfer)
  * \returns LIBUSB_ERROR_BUSY if the transfer has already been submitted.
  * \returns LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
  * by the operating system.
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a start frame was set with
+ * libusb_transfer_set_iso_start_frame() which is out of range, or the
+ * transfer is not isochronous
  * \returns another LIBUSB_ERROR code on other failure
  */
 int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
@@ -1462,12 +1733,31 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 	int r;
 
 	usbi_dbg("transfer %p", transfer);
+	usbi_trace(SUBMIT, transfer, transfer->length);
+	itransfer->submit_time = TRANSFER_CTX(transfer)->stats_enabled ?
+		usbi_get_monotonic_ns() : 0;
+	itransfer->in_flight_time = 0;
 	usbi_mutex_lock(&itransfer->lock);
 	usbi_mutex_lock(&itransfer->flags_lock);
 	if (itransfer->flags & USBI_TRANSFER_IN_FLIGHT) {
 		r = LIBUSB_ERROR_BUSY;
 		goto out;
 	}
+	if (itransfer->iov && transfer->type != LIBUSB_TRANSFER_TYPE_BULK) {
+		r = LIBUSB_ERROR_INVALID_PARAM;
+		goto out;
+	}
+	if (itransfer->iso_scheduled) {
+		if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+			goto out;
+		}
+		if (!(usbi_backend->caps & USBI_CAP_SUPPORTS_ISO_START_FRAME)) {
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+			goto out;
+		}
+	}
+	itransfer->iso_reaped_time = 0;
 	itransfer->transferred = 0;
 	itransfer->flags = 0;
 	r = calculate_timeout(itransfer);
@@ -1487,7 +1777,9 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 
 	/* keep a reference to this device */
 	libusb_ref_device(transfer->dev_handle->dev);
-	r = usbi_backend->submit_transfer(itransfer);
+	r = submit_to_backend(itransfer);
+	if (r == LIBUSB_SUCCESS && itransfer->submit_time)
+		itransfer->in_flight_time = usbi_get_monotonic_ns();
 
 	usbi_mutex_lock(&itransfer->flags_lock);
 	itransfer->flags &= ~USBI_TRANSFER_SUBMITTING;
@@ -1498,6 +1790,7 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
 		 */
 		if (itransfer->flags & USBI_TRANSFER_DEVICE_DISAPPEARED) {
 			usbi_backend->clear_transfer_priv(itransfer);
+			unbounce_iovec(itransfer, 0);
 			remove = 1;
 			r = LIBUSB_ERROR_NO_DEVICE;
 		}
@@ -1513,6 +1806,7 @@ out:
 		libusb_unref_device(transfer->dev_handle->dev);
 		remove_from_flying_list(itransfer);
 	}
+	itransfer->iso_scheduled = 0;
 	usbi_mutex_unlock(&itransfer->lock);
 	return r;
 }
@@ -1538,6 +1832,7 @@ int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
 	int r;
 
 	usbi_dbg("transfer %p", transfer );
+	usbi_trace(CANCEL, transfer, 0);
 	usbi_mutex_lock(&itransfer->lock);
 	usbi_mutex_lock(&itransfer->flags_lock);
 	if (!(itransfer->flags & USBI_TRANSFER_IN_FLIGHT)
@@ -1603,178 +1898,689 @@ uint32_t API_EXPORTED libusb_transfer_get_stream_id(
 	return itransfer->stream_id;
 }
 
-/* Handle completion of a transfer (completion might be an error condition).
- * This will invoke the user-supplied callback function, which may end up
- * freeing the transfer. Therefore you cannot use the transfer structure
- * after calling this function, and you should free all backend-specific
- * data before calling it.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
-	enum libusb_transfer_status status)
+/** \ingroup asyncio
+ * Have the next submission of an isochronous transfer start in a particular
+ * frame, rather than as soon as possible. Together with
+ * libusb_transfer_get_iso_timing() this allows aligning the streams of
+ * several devices without resampling.
+ *
+ * Frames are numbered by the host controller of the device, and there is
+ * no way to query the current frame number. Submit the first transfer as
+ * soon as possible and derive the start frames of the following transfers
+ * from its timing. Transfers following a scheduled one on the same endpoint
+ * may be submitted as soon as possible, they are queued after it.
+ *
+ * The start frame applies to the next call to libusb_submit_transfer()
+ * only, which fails with LIBUSB_ERROR_INVALID_PARAM if the frame has already
+ * passed or is too far ahead for the host controller, and with
+ * LIBUSB_ERROR_NOT_SUPPORTED if the backend does not support scheduling
+ * transfers. Currently only Linux does.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param transfer the isochronous transfer
+ * \param start_frame the frame to start in, or \ref LIBUSB_ISO_START_ASAP
+ */
+void API_EXPORTED libusb_transfer_set_iso_start_frame(
+	struct libusb_transfer *transfer, int start_frame)
 {
-	struct libusb_transfer *transfer =
-		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-	struct libusb_device_handle *handle = transfer->dev_handle;
-	uint8_t flags;
-	int r;
-
-	r = remove_from_flying_list(itransfer);
-	if (r < 0)
-		usbi_err(ITRANSFER_CTX(itransfer), "failed to set timer for next timeout, errno=%d", errno);
-
-	usbi_mutex_lock(&itransfer->flags_lock);
-	itransfer->flags &= ~USBI_TRANSFER_IN_FLIGHT;
-	itransfer->flags |= USBI_TRANSFER_COMPLETED;
-	usbi_mutex_unlock(&itransfer->flags_lock);
-
-	if (status == LIBUSB_TRANSFER_COMPLETED
-			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
-		int rqlen = transfer->length;
-		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
-			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
-		if (rqlen != itransfer->transferred) {
-			usbi_dbg("interpreting short transfer as error");
-			status = LIBUSB_TRANSFER_ERROR;
-		}
-	}
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
 
-	flags = transfer->flags;
-	transfer->status = status;
-	transfer->actual_length = itransfer->transferred;
-	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
-	if (transfer->callback)
-		transfer->callback(transfer);
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
-	libusb_unref_device(handle->dev);
-	return r;
+	itransfer->iso_scheduled = start_frame >= 0;
+	itransfer->iso_start_frame = start_frame;
 }
 
-/* Similar to usbi_handle_transfer_completion() but exclusively for transfers
- * that were asynchronously cancelled. The same concerns w.r.t. freeing of
- * transfers exist here.
- * Do not call this function with the usbi_transfer lock held. User-specified
- * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
-int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
+/** \ingroup asyncio
+ * Get the timing of a completed isochronous transfer: the frame it started
+ * in and the time its last packets were reaped at, which correlates the
+ * frame numbers of the host controller with the host clock. This may be
+ * called from the transfer callback.
+ *
+ * The reap time is taken when the operating system hands the completed
+ * packets to libusb, so it lags the end of the last frame of the transfer
+ * by the latency of the event handling.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param transfer the isochronous transfer
+ * \param timing output location for the timing
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if the transfer did not complete, or the
+ * backend does not report its timing
+ */
+int API_EXPORTED libusb_transfer_get_iso_timing(
+	struct libusb_transfer *transfer, struct libusb_iso_timing *timing)
 {
-	/* if the URB was cancelled due to timeout, report timeout to the user */
-	if (transfer->flags & USBI_TRANSFER_TIMED_OUT) {
-		usbi_dbg("detected timeout cancellation");
-		return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_TIMED_OUT);
-	}
-
-	/* otherwise its a normal async cancel */
-	return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_CANCELLED);
-}
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
 
-/* Add a completed transfer to the completed_transfers list of the
- * context and signal the event. The backend's handle_transfer_completion()
- * function will be called the next time an event handler runs. */
-void usbi_signal_transfer_completion(struct usbi_transfer *transfer)
-{
-	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
-	int pending_events;
+	if (!itransfer->iso_reaped_time)
+		return LIBUSB_ERROR_NOT_FOUND;
 
-	usbi_mutex_lock(&ctx->event_data_lock);
-	pending_events = usbi_pending_events(ctx);
-	list_add_tail(&transfer->completed_list, &ctx->completed_transfers);
-	if (!pending_events)
-		usbi_signal_event(&ctx->event);
-	usbi_mutex_unlock(&ctx->event_data_lock);
+	timing->start_frame = itransfer->iso_actual_start_frame;
+	timing->reaped_ns = itransfer->iso_reaped_time;
+	return 0;
 }
 
-/** \ingroup poll
- * Attempt to acquire the event handling lock. This lock is used to ensure that
- * only one thread is monitoring libusb event sources at any one time.
+/** \ingroup asyncio
+ * Set scatter-gather segments for a bulk transfer. Instead of transferring
+ * from or to \ref libusb_transfer::buffer "buffer", the transfer will
+ * consist of the segments in order, as if they were one contiguous buffer.
+ * This allows e.g. a header and a payload to be sent in a single transfer
+ * without copying them together first.
  *
- * You only need to use this lock if you are developing an application
- * which calls poll() or select() on libusb's file descriptors directly.
- * If you stick to libusb's event handling loop functions (e.g.
- * libusb_handle_events()) then you do not need to be concerned with this
- * locking.
+ * The \ref libusb_transfer::length "length" field of the transfer is set to
+ * the total length of the segments. The segment array is not copied; it
+ * and the memory it describes must remain valid until the transfer has
+ * completed. Pass a NULL array to make the transfer use its buffer again.
  *
- * While holding this lock, you are trusted to actually be handling events.
- * If you are no longer handling events, you must call libusb_unlock_events()
- * as soon as possible.
+ * Where the platform can, the segments are handed to the kernel directly.
+ * Otherwise they are copied through an internal bounce buffer.
  *
- * \param ctx the context to operate on, or NULL for the default context
- * \returns 0 if the lock was obtained successfully
- * \returns 1 if the lock was not obtained (i.e. another thread holds the lock)
- * \ref mtasync
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param transfer a bulk transfer which is not in progress
+ * \param iov array of segments, or NULL
+ * \param iovcnt number of segments in the array
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a segment length is negative or the
+ * total length does not fit in an int
  */
-int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
+int API_EXPORTED libusb_transfer_set_iovec(struct libusb_transfer *transfer,
+	const struct libusb_iovec *iov, int iovcnt)
 {
-	int r;
-	unsigned int ru;
-	USBI_GET_CONTEXT(ctx);
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int i, length = 0;
 
-	/* is someone else waiting to close a device? if so, don't let this thread
-	 * start event handling */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	ru = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
-	if (ru) {
-		usbi_dbg("someone else is closing a device");
-		return 1;
+	if (!iov || iovcnt <= 0) {
+		itransfer->iov = NULL;
+		itransfer->iovcnt = 0;
+		return 0;
 	}
 
-	r = usbi_mutex_trylock(&ctx->events_lock);
-	if (r)
-		return 1;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len < 0 || iov[i].iov_len > INT_MAX - length)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		length += iov[i].iov_len;
+	}
 
-	ctx->event_handler_active = 1;
+	itransfer->iov = iov;
+	itransfer->iovcnt = iovcnt;
+	transfer->length = length;
 	return 0;
 }
 
-/** \ingroup poll
- * Acquire the event handling lock, blocking until successful acquisition if
- * it is contended. This lock is used to ensure that only one thread is
- * monitoring libusb event sources at any one time.
+/** \ingroup asyncio
+ * Enable or disable the collection of transfer statistics for a context,
+ * see libusb_get_stats(). Statistics are disabled by default, as collecting
+ * them takes three clock readings and a lock for every transfer. While they
+ * are enabled, the time the internal locks are held is measured as well,
+ * see libusb_get_event_counters().
  *
- * You only need to use this lock if you are developing an application
- * which calls poll() or select() on libusb's file descriptors directly.
- * If you stick to libusb's event handling loop functions (e.g.
- * libusb_handle_events()) then you do not need to be concerned with this
- * locking.
+ * Only transfers submitted while statistics are enabled are counted.
+ * Disabling them keeps the statistics collected so far.
  *
- * While holding this lock, you are trusted to actually be handling events.
- * If you are no longer handling events, you must call libusb_unlock_events()
- * as soon as possible.
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \ref mtasync
+ * \param enabled nonzero to collect statistics, 0 to stop
  */
-void API_EXPORTED libusb_lock_events(libusb_context *ctx)
+void API_EXPORTED libusb_set_stats_enabled(libusb_context *ctx, int enabled)
 {
 	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->events_lock);
-	ctx->event_handler_active = 1;
+	ctx->stats_enabled = enabled ? 1 : 0;
 }
 
-/** \ingroup poll
- * Release the lock previously acquired with libusb_try_lock_events() or
- * libusb_lock_events(). Releasing this lock will wake up any threads blocked
- * on libusb_wait_for_event().
+/** \ingroup asyncio
+ * Get statistics of the transfers completed in a context: the number of
+ * transfers, bytes and failures, and latency histograms for each endpoint
+ * of each device. Statistics are only collected once enabled with
+ * libusb_set_stats_enabled(). They are kept until the device is
+ * disconnected; take the difference between two calls to get them for an
+ * interval.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
  *
  * \param ctx the context to operate on, or NULL for the default context
- * \ref mtasync
+ * \param stats output location for the statistics. Only valid if 0 was
+ * returned. Must be freed with libusb_free_stats() after use.
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
  */
-void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
+int API_EXPORTED libusb_get_stats(libusb_context *ctx,
+	struct libusb_stats **stats)
 {
+	struct libusb_device *dev;
+	struct libusb_stats *ret;
+	int num_endpoints = 0;
+	int i;
+
 	USBI_GET_CONTEXT(ctx);
-	ctx->event_handler_active = 0;
-	usbi_mutex_unlock(&ctx->events_lock);
 
-	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
-	 * the availability of the events lock when we are modifying pollfds
-	 * (check ctx->device_close)? */
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device) {
+		usbi_mutex_lock(&dev->lock);
+		for (i = 0; i < USBI_ENDPOINT_STATS_SLOTS; i++)
+			if (dev->endpoint_stats[i])
+				num_endpoints++;
+		usbi_mutex_unlock(&dev->lock);
+	}
+
+	ret = malloc(sizeof(*ret) +
+		num_endpoints * sizeof(struct libusb_endpoint_stats));
+	if (!ret) {
+		usbi_mutex_unlock(&ctx->usb_devs_lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* endpoints may have been added since they were counted */
+	ret->num_endpoints = 0;
+	ret->endpoints = (struct libusb_endpoint_stats *)(ret + 1);
+	list_for_each_entry(dev, &ctx->usb_devs, list, struct libusb_device) {
+		usbi_mutex_lock(&dev->lock);
+		for (i = 0; i < USBI_ENDPOINT_STATS_SLOTS; i++)
+			if (dev->endpoint_stats[i] &&
+			    ret->num_endpoints < num_endpoints)
+				ret->endpoints[ret->num_endpoints++] =
+					*dev->endpoint_stats[i];
+		usbi_mutex_unlock(&dev->lock);
+	}
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+
+	*stats = ret;
+	return 0;
+}
+
+/** \ingroup asyncio
+ * Free statistics obtained from libusb_get_stats().
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param stats the statistics to free. If NULL, this function does nothing.
+ */
+void API_EXPORTED libusb_free_stats(struct libusb_stats *stats)
+{
+	free(stats);
+}
+
+/** \ingroup asyncio
+ * Estimate a percentile of the values recorded in a latency histogram, e.g.
+ * 99 for the latency that 99% of the transfers did not exceed. The result
+ * is the upper bound of the histogram bucket the percentile falls in, so it
+ * errs on the high side by at most 12.5%.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param histogram the histogram to read
+ * \param percentile the percentile, from 0 to 100
+ * \returns the percentile in nanoseconds, or 0 if the histogram is empty
+ */
+uint64_t API_EXPORTED libusb_stats_histogram_percentile(
+	const struct libusb_stats_histogram *histogram, double percentile)
+{
+	uint64_t rank, seen = 0;
+	int i;
+
+	if (!histogram->count)
+		return 0;
+	if (percentile >= 100.0)
+		return histogram->max_ns;
+
+	/* the number of values the percentile must not be below */
+	rank = (uint64_t)(histogram->count * (percentile / 100.0));
+	if (rank < histogram->count * (percentile / 100.0) || !rank)
+		rank++;
+
+	for (i = 0; i < LIBUSB_STATS_HISTOGRAM_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= rank)
+			return MIN(histogram_bucket_max(i), histogram->max_ns);
+	}
+	return histogram->max_ns;
+}
+
+/* Invoke the callback of a completed transfer and account for it in the
+ * endpoint statistics. */
+static void invoke_transfer_callback(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	/* the callback may close the device handle */
+	struct libusb_device *dev = transfer->dev_handle->dev;
+	struct transfer_sample sample;
+	uint8_t flags = transfer->flags;
+
+	sample.endpoint = transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL ?
+		0 : transfer->endpoint;
+	sample.type = transfer->type;
+	sample.status = transfer->status;
+	sample.transferred = itransfer->transferred;
+	sample.submit_time = itransfer->submit_time;
+	sample.in_flight_time = itransfer->in_flight_time;
+	sample.completed_time = itransfer->completed_time;
+
+	usbi_dbg("transfer %p has callback %p", transfer, transfer->callback);
+	if (transfer->callback)
+		transfer->callback(transfer);
+	usbi_trace(CALLBACK_DONE, transfer, 0);
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (sample.submit_time)
+		update_endpoint_stats(dev, &sample, usbi_get_monotonic_ns());
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+	libusb_unref_device(dev);
+}
+
+#if defined(PLATFORM_POSIX)
+/* A thread of the callback executor. Each device is served by a single
+ * worker, which invokes the callbacks of the transfers queued to it in
+ * order, so that the callbacks of a device's transfers are invoked in the
+ * order the transfers completed. */
+struct usbi_executor_worker {
+	struct libusb_context *ctx;
+	pthread_t thread;
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	/* completed transfers, linked by their completed_list */
+	struct list_head queue;
+	int stop;
+	/* the device handle of the transfer whose callback is being invoked,
+	 * and whether that callback closed it. only accessed by the worker
+	 * thread */
+	struct libusb_device_handle *handle;
+	int handle_closed;
+};
+
+struct usbi_executor {
+	int num_workers;
+	struct usbi_executor_worker *workers;
+};
+
+static void *executor_worker_main(void *arg)
+{
+	struct usbi_executor_worker *worker = arg;
+	struct libusb_context *ctx = worker->ctx;
+	struct libusb_device_handle *handle;
+	struct usbi_transfer *itransfer;
+	int idle, pending_events;
+
+	usbi_mutex_lock(&worker->lock);
+	for (;;) {
+		while (list_empty(&worker->queue) && !worker->stop)
+			usbi_cond_wait(&worker->cond, &worker->lock);
+		/* finish the queued callbacks before stopping */
+		if (list_empty(&worker->queue))
+			break;
+
+		itransfer = list_first_entry(&worker->queue, struct usbi_transfer,
+			completed_list);
+		list_del(&itransfer->completed_list);
+		idle = list_empty(&worker->queue);
+		usbi_mutex_unlock(&worker->lock);
+
+		handle = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
+		worker->handle = handle;
+		invoke_transfer_callback(itransfer);
+		worker->handle = NULL;
+
+		/* let libusb_close() know once the callbacks of the handle
+		 * are done */
+		if (worker->handle_closed) {
+			worker->handle_closed = 0;
+		} else {
+			usbi_mutex_lock(&handle->lock);
+			if (--handle->queued_callbacks == 0) {
+				handle->callback_worker = NULL;
+				usbi_cond_broadcast(&handle->callbacks_cond);
+			}
+			usbi_mutex_unlock(&handle->lock);
+		}
+
+		/* callbacks typically set the completion flag another thread
+		 * is waiting on in libusb_handle_events_completed(). Wake up
+		 * the event handler after a burst of callbacks, so that it
+		 * returns and the flag is checked. */
+		if (idle) {
+			usbi_lock_event_data(ctx);
+			pending_events = usbi_pending_events(ctx);
+			if (!pending_events)
+				usbi_signal_context_event(ctx);
+			usbi_unlock_event_data(ctx);
+		}
+
+		usbi_mutex_lock(&worker->lock);
+	}
+	usbi_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
+
+/* Stop the workers started so far, once they have invoked the callbacks
+ * queued to them, and free the executor. */
+static void executor_destroy(struct usbi_executor *executor, int started)
+{
+	struct usbi_executor_worker *worker;
+	int i;
+
+	for (i = 0; i < started; i++) {
+		worker = &executor->workers[i];
+		usbi_mutex_lock(&worker->lock);
+		worker->stop = 1;
+		usbi_cond_signal(&worker->cond);
+		usbi_mutex_unlock(&worker->lock);
+	}
+	for (i = 0; i < executor->num_workers; i++) {
+		worker = &executor->workers[i];
+		if (i < started)
+			pthread_join(worker->thread, NULL);
+		usbi_cond_destroy(&worker->cond);
+		usbi_mutex_destroy(&worker->lock);
+	}
+	free(executor);
+}
+
+/* Hand a completed transfer to the executor, if one is running. Returns 1
+ * if the transfer was queued, or 0 if its callback must be invoked by the
+ * caller. */
+static int queue_transfer_callback(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *handle = transfer->dev_handle;
+	struct usbi_executor *executor;
+	struct usbi_executor_worker *worker;
+	int queue = 0;
+
+	usbi_lock_event_data(ctx);
+	executor = ctx->executor;
+	if (executor) {
+		worker = &executor->workers[handle->dev->session_data
+			% executor->num_workers];
+		/* once libusb_close() has drained the callbacks of the handle,
+		 * none may be queued, as it is about to be freed */
+		usbi_mutex_lock(&handle->lock);
+		queue = !handle->closing || handle->queued_callbacks;
+		if (queue) {
+			handle->queued_callbacks++;
+			handle->callback_worker = worker;
+		}
+		usbi_mutex_unlock(&handle->lock);
+		if (queue) {
+			usbi_mutex_lock(&worker->lock);
+			list_add_tail(&itransfer->completed_list, &worker->queue);
+			usbi_cond_signal(&worker->cond);
+			usbi_mutex_unlock(&worker->lock);
+		}
+	}
+	usbi_unlock_event_data(ctx);
+
+	return queue;
+}
+
+/* Wait for the callback executor to invoke the callbacks of the transfers
+ * of a device handle that is being closed. When called from a callback
+ * invoked by the worker serving the handle, the callbacks queued behind it
+ * cannot be invoked any more, so they are dropped, as the transfers in
+ * flight are by libusb_close(). Either way, the callbacks of transfers
+ * completing afterwards are no longer queued but invoked right away. */
+void usbi_drain_transfer_callbacks(struct libusb_device_handle *dev_handle)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_executor_worker *worker;
+	struct usbi_transfer *itransfer, *tmp;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	dev_handle->closing = 1;
+	worker = dev_handle->callback_worker;
+	if (worker && pthread_equal(worker->thread, pthread_self())) {
+		usbi_mutex_lock(&worker->lock);
+		list_for_each_entry_safe(itransfer, tmp, &worker->queue,
+				completed_list, struct usbi_transfer) {
+			struct libusb_transfer *transfer =
+				USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+			if (transfer->dev_handle != dev_handle)
+				continue;
+			usbi_err(ctx, "Device handle closed from a transfer callback before the callback of transfer %p was invoked",
+				 transfer);
+			list_del(&itransfer->completed_list);
+			transfer->dev_handle = NULL;
+			libusb_unref_device(dev_handle->dev);
+		}
+		usbi_mutex_unlock(&worker->lock);
+		/* the worker must not touch the handle after this callback */
+		if (worker->handle == dev_handle)
+			worker->handle_closed = 1;
+		dev_handle->queued_callbacks = 0;
+		dev_handle->callback_worker = NULL;
+	} else {
+		while (dev_handle->queued_callbacks)
+			usbi_cond_wait(&dev_handle->callbacks_cond,
+				&dev_handle->lock);
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+#else
+static int queue_transfer_callback(struct usbi_transfer *itransfer)
+{
+	UNUSED(itransfer);
+	return 0;
+}
+
+void usbi_drain_transfer_callbacks(struct libusb_device_handle *dev_handle)
+{
+	UNUSED(dev_handle);
+}
+#endif
+
+/* Handle completion of a transfer (completion might be an error condition).
+ * This will invoke the user-supplied callback function, or hand the transfer
+ * to the callback executor to do so, which may end up freeing the transfer.
+ * Therefore you cannot use the transfer structure after calling this
+ * function, and you should free all backend-specific data before calling it.
+ * Do not call this function with the usbi_transfer lock held. User-specified
+ * callback functions may attempt to directly resubmit the transfer, which
+ * will attempt to take the lock. */
+int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int r;
+
+	if (itransfer->submit_time)
+		itransfer->completed_time = usbi_get_monotonic_ns();
+
+	r = remove_from_flying_list(itransfer);
+	if (r < 0)
+		usbi_err(ITRANSFER_CTX(itransfer), "failed to set timer for next timeout, errno=%d", errno);
+
+	usbi_mutex_lock(&itransfer->flags_lock);
+	itransfer->flags &= ~USBI_TRANSFER_IN_FLIGHT;
+	itransfer->flags |= USBI_TRANSFER_COMPLETED;
+	usbi_mutex_unlock(&itransfer->flags_lock);
+
+	unbounce_iovec(itransfer, 1);
+
+	if (status == LIBUSB_TRANSFER_COMPLETED
+			&& transfer->flags & LIBUSB_TRANSFER_SHORT_NOT_OK) {
+		int rqlen = transfer->length;
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+		if (rqlen != itransfer->transferred) {
+			usbi_dbg("interpreting short transfer as error");
+			status = LIBUSB_TRANSFER_ERROR;
+		}
+	}
+
+	transfer->status = status;
+	transfer->actual_length = itransfer->transferred;
+	usbi_trace(COMPLETE, transfer, status);
+
+	/* the thread waiting for a synchronous transfer may be the event
+	 * handler itself, so its callback is always invoked right away */
+	if (transfer->callback == usbi_sync_transfer_cb
+			|| !queue_transfer_callback(itransfer))
+		invoke_transfer_callback(itransfer);
+	return r;
+}
+
+/* Similar to usbi_handle_transfer_completion() but exclusively for transfers
+ * that were asynchronously cancelled. The same concerns w.r.t. freeing of
+ * transfers exist here.
+ * Do not call this function with the usbi_transfer lock held. User-specified
+ * callback functions may attempt to directly resubmit the transfer, which
+ * will attempt to take the lock. */
+int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer)
+{
+	/* if the URB was cancelled due to timeout, report timeout to the user */
+	if (transfer->flags & USBI_TRANSFER_TIMED_OUT) {
+		usbi_dbg("detected timeout cancellation");
+		return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_TIMED_OUT);
+	}
+
+	/* otherwise its a normal async cancel */
+	return usbi_handle_transfer_completion(transfer, LIBUSB_TRANSFER_CANCELLED);
+}
+
+/* Add a completed transfer to the completed_transfers list of the
+ * context and signal the event. The backend's handle_transfer_completion()
+ * function will be called the next time an event handler runs. */
+void usbi_signal_transfer_completion(struct usbi_transfer *transfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(transfer);
+	int pending_events;
+
+	usbi_lock_event_data(ctx);
+	pending_events = usbi_pending_events(ctx);
+	list_add_tail(&transfer->completed_list, &ctx->completed_transfers);
+	if (!pending_events)
+		usbi_signal_context_event(ctx);
+	usbi_unlock_event_data(ctx);
+}
+
+/* Account for the events_lock having been taken by the calling thread. */
+static void events_lock_acquired(struct libusb_context *ctx)
+{
+	ctx->event_handler_active = 1;
+	ctx->counters.events_lock_acquisitions++;
+	if (ctx->events_lock_depth++ == 0)
+		ctx->events_lock_time = usbi_get_monotonic_ns();
+}
+
+/** \ingroup poll
+ * Attempt to acquire the event handling lock. This lock is used to ensure that
+ * only one thread is monitoring libusb event sources at any one time.
+ *
+ * You only need to use this lock if you are developing an application
+ * which calls poll() or select() on libusb's file descriptors directly.
+ * If you stick to libusb's event handling loop functions (e.g.
+ * libusb_handle_events()) then you do not need to be concerned with this
+ * locking.
+ *
+ * While holding this lock, you are trusted to actually be handling events.
+ * If you are no longer handling events, you must call libusb_unlock_events()
+ * as soon as possible.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 if the lock was obtained successfully
+ * \returns 1 if the lock was not obtained (i.e. another thread holds the lock)
+ * \ref mtasync
+ */
+int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
+{
+	int r;
+	unsigned int ru;
+	USBI_GET_CONTEXT(ctx);
+
+	/* is someone else waiting to close a device? if so, don't let this thread
+	 * start event handling */
+	usbi_lock_event_data(ctx);
+	ru = ctx->device_close;
+	usbi_unlock_event_data(ctx);
+	if (ru) {
+		usbi_dbg("someone else is closing a device");
+		return 1;
+	}
+
+	r = usbi_mutex_trylock(&ctx->events_lock);
+	if (r) {
+		usbi_lock_event_data(ctx);
+		ctx->counters.events_lock_contended++;
+		usbi_unlock_event_data(ctx);
+		return 1;
+	}
+
+	events_lock_acquired(ctx);
+	return 0;
+}
+
+/** \ingroup poll
+ * Acquire the event handling lock, blocking until successful acquisition if
+ * it is contended. This lock is used to ensure that only one thread is
+ * monitoring libusb event sources at any one time.
+ *
+ * You only need to use this lock if you are developing an application
+ * which calls poll() or select() on libusb's file descriptors directly.
+ * If you stick to libusb's event handling loop functions (e.g.
+ * libusb_handle_events()) then you do not need to be concerned with this
+ * locking.
+ *
+ * While holding this lock, you are trusted to actually be handling events.
+ * If you are no longer handling events, you must call libusb_unlock_events()
+ * as soon as possible.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref mtasync
+ */
+void API_EXPORTED libusb_lock_events(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	if (usbi_mutex_trylock(&ctx->events_lock)) {
+		usbi_lock_event_data(ctx);
+		ctx->counters.events_lock_contended++;
+		usbi_unlock_event_data(ctx);
+		usbi_mutex_lock(&ctx->events_lock);
+	}
+	events_lock_acquired(ctx);
+}
+
+/** \ingroup poll
+ * Release the lock previously acquired with libusb_try_lock_events() or
+ * libusb_lock_events(). Releasing this lock will wake up any threads blocked
+ * on libusb_wait_for_event().
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \ref mtasync
+ */
+void API_EXPORTED libusb_unlock_events(libusb_context *ctx)
+{
+	USBI_GET_CONTEXT(ctx);
+	ctx->event_handler_active = 0;
+	if (--ctx->events_lock_depth == 0)
+		ctx->counters.events_lock_held_ns +=
+			usbi_get_monotonic_ns() - ctx->events_lock_time;
+	usbi_mutex_unlock(&ctx->events_lock);
+
+	/* FIXME: perhaps we should be a bit more efficient by not broadcasting
+	 * the availability of the events lock when we are modifying pollfds
+	 * (check ctx->device_close)? */
 	usbi_mutex_lock(&ctx->event_waiters_lock);
 	usbi_cond_broadcast(&ctx->event_waiters_cond);
+	/* hand event handling over to a single synchronous waiter. The others
+	 * stay asleep until their own transfer completes or the lock is handed
+	 * to them in turn. */
+	if (!list_empty(&ctx->sync_waiters)) {
+		struct usbi_sync_waiter *waiter = list_first_entry(
+			&ctx->sync_waiters, struct usbi_sync_waiter, list);
+		list_del(&waiter->list);
+		list_init(&waiter->list);
+		usbi_cond_signal(&waiter->cond);
+	}
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
 
@@ -1806,9 +2612,9 @@ int API_EXPORTED libusb_event_handling_ok(libusb_context *ctx)
 
 	/* is someone else waiting to close a device? if so, don't let this thread
 	 * continue event handling */
-	usbi_mutex_lock(&ctx->event_data_lock);
+	usbi_lock_event_data(ctx);
 	r = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
+	usbi_unlock_event_data(ctx);
 	if (r) {
 		usbi_dbg("someone else is closing a device");
 		return 0;
@@ -1834,9 +2640,9 @@ int API_EXPORTED libusb_event_handler_active(libusb_context *ctx)
 
 	/* is someone else waiting to close a device? if so, don't let this thread
 	 * start event handling -- indicate that event handling is happening */
-	usbi_mutex_lock(&ctx->event_data_lock);
+	usbi_lock_event_data(ctx);
 	r = ctx->device_close;
-	usbi_mutex_unlock(&ctx->event_data_lock);
+	usbi_unlock_event_data(ctx);
 	if (r) {
 		usbi_dbg("someone else is closing a device");
 		return 1;
@@ -1881,39 +2687,34 @@ void API_EXPORTED libusb_unlock_event_waiters(libusb_context *ctx)
 	usbi_mutex_unlock(&ctx->event_waiters_lock);
 }
 
-/** \ingroup poll
- * Wait for another thread to signal completion of an event. Must be called
- * with the event waiters lock held, see libusb_lock_event_waiters().
- *
- * This function will block until any of the following conditions are met:
- * -# The timeout expires
- * -# A transfer completes
- * -# A thread releases the event handling lock through libusb_unlock_events()
- *
- * Condition 1 is obvious. Condition 2 unblocks your thread <em>after</em>
- * the callback for the transfer has completed. Condition 3 is important
- * because it means that the thread that was previously handling events is no
- * longer doing so, so if any events are to complete, another thread needs to
- * step up and start event handling.
- *
- * This function releases the event waiters lock before putting your thread
- * to sleep, and reacquires the lock as it is being woken up.
- *
- * \param ctx the context to operate on, or NULL for the default context
- * \param tv maximum timeout for this blocking function. A NULL value
- * indicates unlimited timeout.
- * \returns 0 after a transfer completes or another thread stops event handling
- * \returns 1 if the timeout expired
- * \ref mtasync
- */
-int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
+/* Threads waiting for a transfer to complete are counted, as event shards
+ * complete transfers behind the back of the event handler and then have to
+ * wake it up, see shard_thread_main(). */
+static void add_completion_waiter(struct libusb_context *ctx)
+{
+	usbi_lock_event_data(ctx);
+	ctx->completion_waiters++;
+	usbi_unlock_event_data(ctx);
+}
+
+static void remove_completion_waiter(struct libusb_context *ctx)
+{
+	usbi_lock_event_data(ctx);
+	ctx->completion_waiters--;
+	usbi_unlock_event_data(ctx);
+}
+
+/* wait on cond, which must be paired with the event waiters lock. returns 1
+ * if the timeout expired, 0 otherwise. */
+static int wait_for_event_cond(struct libusb_context *ctx, usbi_cond_t *cond,
+	struct timeval *tv)
 {
 	struct timespec timeout;
 	int r;
 
-	USBI_GET_CONTEXT(ctx);
+	ctx->counters.events_lock_waits++;
 	if (tv == NULL) {
-		usbi_cond_wait(&ctx->event_waiters_cond, &ctx->event_waiters_lock);
+		usbi_cond_wait(cond, &ctx->event_waiters_lock);
 		return 0;
 	}
 
@@ -1930,17 +2731,53 @@ int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
 		timeout.tv_sec++;
 	}
 
-	r = usbi_cond_timedwait(&ctx->event_waiters_cond,
-		&ctx->event_waiters_lock, &timeout);
+	r = usbi_cond_timedwait(cond, &ctx->event_waiters_lock, &timeout);
 	return (r == ETIMEDOUT);
 }
 
+/** \ingroup poll
+ * Wait for another thread to signal completion of an event. Must be called
+ * with the event waiters lock held, see libusb_lock_event_waiters().
+ *
+ * This function will block until any of the following conditions are met:
+ * -# The timeout expires
+ * -# A transfer completes
+ * -# A thread releases the event handling lock through libusb_unlock_events()
+ *
+ * Condition 1 is obvious. Condition 2 unblocks your thread <em>after</em>
+ * the callback for the transfer has completed. Condition 3 is important
+ * because it means that the thread that was previously handling events is no
+ * longer doing so, so if any events are to complete, another thread needs to
+ * step up and start event handling.
+ *
+ * This function releases the event waiters lock before putting your thread
+ * to sleep, and reacquires the lock as it is being woken up.
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param tv maximum timeout for this blocking function. A NULL value
+ * indicates unlimited timeout.
+ * \returns 0 after a transfer completes or another thread stops event handling
+ * \returns 1 if the timeout expired
+ * \ref mtasync
+ */
+int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
+{
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+	add_completion_waiter(ctx);
+	r = wait_for_event_cond(ctx, &ctx->event_waiters_cond, tv);
+	remove_completion_waiter(ctx);
+	return r;
+}
+
 static void handle_timeout(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	int r;
 
+	usbi_trace(TIMEOUT, transfer, 0);
 	itransfer->flags |= USBI_TRANSFER_TIMEOUT_HANDLED;
 	r = libusb_cancel_transfer(transfer);
 	if (r == 0)
@@ -1996,9 +2833,9 @@ static int handle_timeouts(struct libusb_context *ctx)
 {
 	int r;
 	USBI_GET_CONTEXT(ctx);
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_lock_flying_transfers(ctx);
 	r = handle_timeouts_locked(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_unlock_flying_transfers(ctx);
 	return r;
 }
 
@@ -2026,12 +2863,12 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	else
 		internal_event_sources_cnt = 1;
 
-	/* only reallocate the event source data when the list of event sources has
-	 * been modified since the last handle_events(), otherwise reuse them to
-	 * save the additional overhead */
-	usbi_mutex_lock(&ctx->event_data_lock);
-	if (ctx->event_sources_modified) {
-		usbi_dbg("event sources modified, reallocating event data");
+	/* only refill the event source data when the event sources have changed
+	 * since the last handle_events(), otherwise reuse it to save the
+	 * additional overhead */
+	usbi_lock_event_data(ctx);
+	if (!ctx->event_data || ctx->event_data_generation != ctx->event_sources_generation) {
+		usbi_dbg("event sources modified, updating event data");
 
 		/* sanity check - it is invalid for a context to have fewer than the
 		 * required internal event sources (memory corruption?) */
@@ -2039,21 +2876,23 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 
 		r = usbi_alloc_event_data(ctx);
 		if (r) {
-			usbi_mutex_unlock(&ctx->event_data_lock);
+			usbi_unlock_event_data(ctx);
 			return r;
 		}
-
+		ctx->event_data_generation = ctx->event_sources_generation;
+	}
+	if (ctx->event_sources_modified) {
 		/* reset the flag now that we have the updated list */
 		ctx->event_sources_modified = 0;
 
 		/* if no further pending events, clear the event so that we do
 		 * not immediately return from poll */
 		if (!usbi_pending_events(ctx))
-			usbi_clear_event(&ctx->event);
+			usbi_clear_context_event(ctx);
 	}
 	event_data = ctx->event_data;
 	event_sources_cnt = ctx->event_sources_cnt;
-	usbi_mutex_unlock(&ctx->event_data_lock);
+	usbi_unlock_event_data(ctx);
 
 	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
 
@@ -2061,7 +2900,9 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (tv->tv_usec % 1000)
 		timeout_ms++;
 
+	usbi_trace(EVENTS_WAIT, timeout_ms, event_sources_cnt);
 	r = usbi_handle_events(ctx, event_data, event_sources_cnt, internal_event_sources_cnt, timeout_ms);
+	usbi_trace(EVENTS_DONE, r, 0);
 	if (r == LIBUSB_ERROR_TIMEOUT)
 		return handle_timeouts(ctx);
 
@@ -2095,6 +2936,58 @@ static int get_next_timeout(libusb_context *ctx, struct timeval *tv,
 	return 0;
 }
 
+static int handle_events_completed(struct libusb_context *ctx,
+	struct timeval *tv, int *completed)
+{
+	int r;
+	struct timeval poll_timeout;
+
+	r = get_next_timeout(ctx, tv, &poll_timeout);
+	if (r) {
+		/* timeout already expired */
+		return handle_timeouts(ctx);
+	}
+
+retry:
+	if (libusb_try_lock_events(ctx) == 0) {
+		if (completed == NULL || !*completed) {
+			/* we obtained the event lock: do our own event handling */
+			usbi_dbg("doing our own event handling");
+			r = handle_events(ctx, &poll_timeout);
+		}
+		libusb_unlock_events(ctx);
+		return r;
+	}
+
+	/* another thread is doing event handling. wait for thread events that
+	 * notify event completion. */
+	libusb_lock_event_waiters(ctx);
+
+	if (completed && *completed)
+		goto already_done;
+
+	if (!libusb_event_handler_active(ctx)) {
+		/* we hit a race: whoever was event handling earlier finished in the
+		 * time it took us to reach this point. try the cycle again. */
+		libusb_unlock_event_waiters(ctx);
+		usbi_dbg("event handler was active but went away, retrying");
+		goto retry;
+	}
+
+	usbi_dbg("another thread is doing event handling");
+	r = libusb_wait_for_event(ctx, &poll_timeout);
+
+already_done:
+	libusb_unlock_event_waiters(ctx);
+
+	if (r < 0)
+		return r;
+	else if (r == 1)
+		return handle_timeouts(ctx);
+	else
+		return 0;
+}
+
 /** \ingroup poll
  * Handle any pending events.
  *
@@ -2125,10 +3018,55 @@ int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
 	struct timeval *tv, int *completed)
 {
 	int r;
-	struct timeval poll_timeout;
 
 	USBI_GET_CONTEXT(ctx);
-	r = get_next_timeout(ctx, tv, &poll_timeout);
+	add_completion_waiter(ctx);
+	r = handle_events_completed(ctx, tv, completed);
+	remove_completion_waiter(ctx);
+	return r;
+}
+
+void usbi_sync_waiter_init(struct usbi_sync_waiter *waiter)
+{
+	waiter->completed = 0;
+	usbi_cond_init(&waiter->cond, NULL);
+	list_init(&waiter->list);
+}
+
+void usbi_sync_waiter_destroy(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter)
+{
+	/* the completion callback may still be on its way out of
+	 * usbi_signal_sync_waiter() */
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+	usbi_cond_destroy(&waiter->cond);
+}
+
+/* Mark a synchronous waiter as completed and wake up its thread, if it is
+ * sleeping. Called from the transfer completion callback. */
+void usbi_signal_sync_waiter(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter)
+{
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	waiter->completed = 1;
+	if (!list_empty(&waiter->list)) {
+		list_del(&waiter->list);
+		list_init(&waiter->list);
+	}
+	usbi_cond_signal(&waiter->cond);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+}
+
+static int handle_events_sync_waiter(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter)
+{
+	struct timeval tv, poll_timeout;
+	int r;
+
+	tv.tv_sec = 60;
+	tv.tv_usec = 0;
+	r = get_next_timeout(ctx, &tv, &poll_timeout);
 	if (r) {
 		/* timeout already expired */
 		return handle_timeouts(ctx);
@@ -2136,7 +3074,7 @@ int API_EXPORTED libusb_handle_events_timeout_completed(libusb_context *ctx,
 
 retry:
 	if (libusb_try_lock_events(ctx) == 0) {
-		if (completed == NULL || !*completed) {
+		if (!waiter->completed) {
 			/* we obtained the event lock: do our own event handling */
 			usbi_dbg("doing our own event handling");
 			r = handle_events(ctx, &poll_timeout);
@@ -2145,26 +3083,31 @@ retry:
 		return r;
 	}
 
-	/* another thread is doing event handling. wait for thread events that
-	 * notify event completion. */
-	libusb_lock_event_waiters(ctx);
+	usbi_mutex_lock(&ctx->event_waiters_lock);
 
-	if (completed && *completed)
-		goto already_done;
+	if (waiter->completed) {
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
+		return 0;
+	}
 
 	if (!libusb_event_handler_active(ctx)) {
-		/* we hit a race: whoever was event handling earlier finished in the
-		 * time it took us to reach this point. try the cycle again. */
-		libusb_unlock_event_waiters(ctx);
+		/* whoever was event handling earlier finished in the time it took
+		 * us to reach this point. try the cycle again. */
+		usbi_mutex_unlock(&ctx->event_waiters_lock);
 		usbi_dbg("event handler was active but went away, retrying");
 		goto retry;
 	}
 
 	usbi_dbg("another thread is doing event handling");
-	r = libusb_wait_for_event(ctx, &poll_timeout);
+	list_add_tail(&waiter->list, &ctx->sync_waiters);
+	r = wait_for_event_cond(ctx, &waiter->cond, &poll_timeout);
+	if (!list_empty(&waiter->list)) {
+		/* woken by the timeout rather than a handover or completion */
+		list_del(&waiter->list);
+		list_init(&waiter->list);
+	}
 
-already_done:
-	libusb_unlock_event_waiters(ctx);
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
 
 	if (r < 0)
 		return r;
@@ -2174,6 +3117,22 @@ already_done:
 		return 0;
 }
 
+/* Like libusb_handle_events_completed(), but for a thread waiting on a
+ * synchronous transfer. Rather than sleeping on event_waiters_cond, which is
+ * broadcast every time the events lock is released, the thread sleeps on its
+ * own condition and is woken only when its transfer completes or when event
+ * handling is handed over to it by libusb_unlock_events(). */
+int usbi_handle_events_sync_waiter(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter)
+{
+	int r;
+
+	add_completion_waiter(ctx);
+	r = handle_events_sync_waiter(ctx, waiter);
+	remove_completion_waiter(ctx);
+	return r;
+}
+
 /** \ingroup poll
  * Handle any pending events
  *
@@ -2271,7 +3230,10 @@ int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
 		return handle_timeouts(ctx);
 	}
 
-	return handle_events(ctx, &poll_timeout);
+	add_completion_waiter(ctx);
+	r = handle_events(ctx, &poll_timeout);
+	remove_completion_waiter(ctx);
+	return r;
 }
 
 /** \ingroup poll
@@ -2349,9 +3311,9 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	if (usbi_using_timer(ctx))
 		return 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_lock_flying_transfers(ctx);
 	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_unlock_flying_transfers(ctx);
 		usbi_dbg("no URBs, no timeout!");
 		return 0;
 	}
@@ -2368,7 +3330,7 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 		next_timeout = transfer->timeout;
 		break;
 	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_unlock_flying_transfers(ctx);
 
 	if (!timerisset(&next_timeout)) {
 		usbi_dbg("no URB with timeout or all handled by OS; no timeout!");
@@ -2422,12 +3384,31 @@ static void usbi_event_source_notification(struct libusb_context *ctx)
 {
 	int pending_events;
 
-	/* Record that there is a new event source.
+	/* Record that an event source was added or removed.
 	 * Only signal an event if there are no prior pending events. */
 	pending_events = usbi_pending_events(ctx);
 	ctx->event_sources_modified = 1;
 	if (!pending_events)
-		usbi_signal_event(&ctx->event);
+		usbi_signal_context_event(ctx);
+}
+
+/* Make room for one more event slot. Callers must hold the event_data_lock. */
+static int grow_event_slots(struct libusb_context *ctx)
+{
+	struct usbi_event_source **slots;
+	unsigned int size;
+
+	if (ctx->event_sources_cnt < ctx->event_slots_size)
+		return 0;
+
+	size = ctx->event_slots_size ? 2 * ctx->event_slots_size : 8;
+	slots = realloc(ctx->event_slots, size * sizeof(*slots));
+	if (!slots)
+		return LIBUSB_ERROR_NO_MEM;
+
+	ctx->event_slots = slots;
+	ctx->event_slots_size = size;
+	return 0;
 }
 
 /* Add an event source to the list of event sources to be monitored.
@@ -2436,17 +3417,29 @@ static void usbi_event_source_notification(struct libusb_context *ctx)
 int usbi_add_event_source(struct libusb_context *ctx, libusb_os_handle source, short events)
 {
 	struct usbi_event_source *event_source = malloc(sizeof(*event_source));
+	int r;
+
 	if (!event_source)
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_dbg("add " USBI_OS_HANDLE_DESC " " USBI_OS_HANDLE_FORMAT_SPECIFIER " events %d", source, events);
 	event_source->pollfd.fd = source;
 	event_source->pollfd.events = events;
-	usbi_mutex_lock(&ctx->event_data_lock);
+	usbi_lock_event_data(ctx);
+	r = grow_event_slots(ctx);
+	if (!r && ctx->event_fd != -1)
+		r = usbi_event_fd_add_source(ctx, source, events);
+	if (r) {
+		usbi_unlock_event_data(ctx);
+		free(event_source);
+		return r;
+	}
 	list_add_tail(&event_source->list, &ctx->event_sources);
-	ctx->event_sources_cnt++;
+	event_source->slot = ctx->event_sources_cnt++;
+	ctx->event_slots[event_source->slot] = event_source;
+	ctx->event_sources_generation++;
 	usbi_event_source_notification(ctx);
-	usbi_mutex_unlock(&ctx->event_data_lock);
+	usbi_unlock_event_data(ctx);
 
 	if (ctx->event_source_added_cb)
 		ctx->event_source_added_cb(source, events, ctx->event_source_cb_user_data);
@@ -2456,11 +3449,11 @@ int usbi_add_event_source(struct libusb_context *ctx, libusb_os_handle source, s
 /* Remove an event source from the list of event sources to be monitored. */
 void usbi_remove_event_source(struct libusb_context *ctx, libusb_os_handle source)
 {
-	struct usbi_event_source *event_source;
+	struct usbi_event_source *event_source, *last;
 	int found = 0;
 
 	usbi_dbg("remove " USBI_OS_HANDLE_DESC " " USBI_OS_HANDLE_FORMAT_SPECIFIER, source);
-	usbi_mutex_lock(&ctx->event_data_lock);
+	usbi_lock_event_data(ctx);
 	list_for_each_entry(event_source, &ctx->event_sources, list, struct usbi_event_source)
 		if (event_source->pollfd.fd == source) {
 			found = 1;
@@ -2469,14 +3462,20 @@ void usbi_remove_event_source(struct libusb_context *ctx, libusb_os_handle sourc
 
 	if (!found) {
 		usbi_dbg("couldn't find " USBI_OS_HANDLE_DESC " " USBI_OS_HANDLE_FORMAT_SPECIFIER " to remove", source);
-		usbi_mutex_unlock(&ctx->event_data_lock);
+		usbi_unlock_event_data(ctx);
 		return;
 	}
 
 	list_del(&event_source->list);
-	ctx->event_sources_cnt--;
+	last = ctx->event_slots[--ctx->event_sources_cnt];
+	ctx->event_slots[event_source->slot] = last;
+	last->slot = event_source->slot;
+	ctx->event_sources_generation++;
+	if (ctx->event_fd != -1)
+		usbi_event_fd_remove_source(ctx, source);
+
 	usbi_event_source_notification(ctx);
-	usbi_mutex_unlock(&ctx->event_data_lock);
+	usbi_unlock_event_data(ctx);
 	free(event_source);
 	if (ctx->event_source_removed_cb)
 		ctx->event_source_removed_cb(source, ctx->event_source_cb_user_data);
@@ -2503,7 +3502,7 @@ const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 	size_t i = 0;
 	USBI_GET_CONTEXT(ctx);
 
-	usbi_mutex_lock(&ctx->event_data_lock);
+	usbi_lock_event_data(ctx);
 
 	ret = calloc(ctx->event_sources_cnt + 1, sizeof(struct libusb_pollfd *));
 	if (!ret)
@@ -2514,7 +3513,7 @@ const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 	ret[ctx->event_sources_cnt] = NULL;
 
 out:
-	usbi_mutex_unlock(&ctx->event_data_lock);
+	usbi_unlock_event_data(ctx);
 	return (const struct libusb_pollfd **) ret;
 }
 
@@ -2530,7 +3529,7 @@ int usbi_handle_event_trigger(struct libusb_context *ctx)
 	usbi_dbg("event triggered");
 
 	/* take the the event data lock while processing events */
-	usbi_mutex_lock(&ctx->event_data_lock);
+	usbi_lock_event_data(ctx);
 
 	/* check if someone modified the event sources */
 	if (ctx->event_sources_modified)
@@ -2553,18 +3552,18 @@ int usbi_handle_event_trigger(struct libusb_context *ctx)
 		struct usbi_transfer *itransfer =
 			list_first_entry(&ctx->completed_transfers, struct usbi_transfer, completed_list);
 		list_del(&itransfer->completed_list);
-		usbi_mutex_unlock(&ctx->event_data_lock);
+		usbi_unlock_event_data(ctx);
 		r = usbi_backend->handle_transfer_completion(itransfer);
 		if (r)
 			usbi_err(ctx, "backend handle_transfer_completion failed with error %d", r);
-		usbi_mutex_lock(&ctx->event_data_lock);
+		usbi_lock_event_data(ctx);
 	}
 
 	/* if no further pending events, clear the event */
 	if (!usbi_pending_events(ctx))
-		usbi_clear_event(&ctx->event);
+		usbi_clear_context_event(ctx);
 
-	usbi_mutex_unlock(&ctx->event_data_lock);
+	usbi_unlock_event_data(ctx);
 
 	/* process the hotplug message, if any */
 	if (message) {
@@ -2574,7 +3573,7 @@ int usbi_handle_event_trigger(struct libusb_context *ctx)
 		if (LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT == message->event)
 			libusb_unref_device(message->device);
 
-		free(message);
+		usbi_hotplug_msg_release(ctx, message);
 	}
 
 	if (r)
@@ -2592,7 +3591,11 @@ int usbi_handle_timer_trigger(struct libusb_context *ctx)
 
 	usbi_dbg("timer triggered");
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_lock_flying_transfers(ctx);
+
+	/* the timer has expired, so it must be set again whatever the next
+	 * timeout is */
+	timerclear(&ctx->timer_expiry);
 
 	/* process the timeout that just happened */
 	r = handle_timeouts_locked(ctx);
@@ -2603,7 +3606,7 @@ int usbi_handle_timer_trigger(struct libusb_context *ctx)
 	r = arm_timer_for_next_timeout(ctx);
 
 out:
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_unlock_flying_transfers(ctx);
 	return r;
 }
 
@@ -2626,9 +3629,1021 @@ void API_EXPORTED libusb_free_pollfds(const struct libusb_pollfd **pollfds)
 	free((void *)pollfds);
 }
 
+/** \ingroup poll
+ * Get a single file descriptor which becomes readable whenever libusb has
+ * events to handle, as an alternative to libusb_get_pollfds(). It aggregates
+ * all of libusb's event sources, which are added and removed as devices are
+ * opened and closed, so the application only needs to monitor this one
+ * descriptor for readability and need not set pollfd notifiers. When it is
+ * readable, call libusb_handle_events_ready().
+ *
+ * If libusb_pollfds_handle_timeouts() returns 1, the descriptor also becomes
+ * readable when a transfer times out, and libusb_get_next_timeout() need
+ * not be called. Otherwise the application must still handle timeouts as
+ * described in \ref pollmain "polling and timing".
+ *
+ * The descriptor is owned by the context and closed by libusb_exit(). It
+ * is an epoll descriptor and is only supported on Linux.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the file descriptor on success
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if not supported on this platform
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_get_event_fd(libusb_context *ctx)
+{
+	int r = 0;
+
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_lock_event_data(ctx);
+	if (ctx->event_fd == -1)
+		r = usbi_create_event_fd(ctx);
+	if (r == 0)
+		r = ctx->event_fd;
+	usbi_unlock_event_data(ctx);
+
+	return r;
+}
+
+/** \ingroup poll
+ * Handle any pending events without blocking, typically after the
+ * descriptor returned by libusb_get_event_fd() became readable. If
+ * another thread is handling events, this function returns right away.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success, or a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_handle_events_ready(libusb_context *ctx)
+{
+	struct timeval tv = { 0, 0 };
+
+	return libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+}
+
+/** \ingroup poll
+ * Set the timer slack of a context. Transfer timeouts are then rounded up
+ * to a multiple of the slack, so that a timeout may expire up to the slack
+ * late. In exchange, the timer used to detect timeouts only needs to be set
+ * again when the rounded timeout of the next transfer to time out changes.
+ * When many transfers with the same timeout are in flight, this saves a
+ * system call for most submissions and completions.
+ *
+ * The default slack is 0, meaning that timeouts are not rounded. The slack
+ * only has an effect on platforms where libusb uses a timer for timeouts
+ * (e.g. Linux with timerfd).
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param slack_us the slack in microseconds
+ */
+void API_EXPORTED libusb_set_timer_slack(libusb_context *ctx,
+	unsigned int slack_us)
+{
+	USBI_GET_CONTEXT(ctx);
+	usbi_lock_flying_transfers(ctx);
+	ctx->timer_slack_us = slack_us;
+	usbi_unlock_flying_transfers(ctx);
+}
+
+/** \ingroup poll
+ * Get counters of the work done by the event handling loop of a context,
+ * such as how often it woke up without any device I/O to handle, or rearmed
+ * its timer. This helps to find out whether event handling overhead is
+ * significant for an application.
+ *
+ * Counters which change while this function runs may be slightly
+ * inconsistent with each other.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param counters output location for the counters
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if counters is NULL
+ */
+int API_EXPORTED libusb_get_event_counters(libusb_context *ctx,
+	struct libusb_event_counters *counters)
+{
+	USBI_GET_CONTEXT(ctx);
+
+	if (!counters)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	*counters = ctx->counters;
+
+	/* take the locks protecting the other counters for a consistent copy */
+	usbi_lock_event_data(ctx);
+	counters->event_signals = ctx->counters.event_signals;
+	counters->event_clears = ctx->counters.event_clears;
+	counters->event_data_reallocs = ctx->counters.event_data_reallocs;
+	counters->hotplug_msgs_dropped = ctx->hotplug_msgs_dropped;
+	counters->bulk_urb_enomem = ctx->counters.bulk_urb_enomem;
+	counters->bulk_urb_limit_hits = ctx->counters.bulk_urb_limit_hits;
+	counters->event_data_lock_acquisitions = ctx->event_data_lock_counters.acquisitions;
+	counters->event_data_lock_contended = ctx->event_data_lock_counters.contended;
+	counters->event_data_lock_held_ns = ctx->event_data_lock_counters.held_ns;
+	counters->events_lock_contended = ctx->counters.events_lock_contended;
+	usbi_unlock_event_data(ctx);
+
+	usbi_lock_flying_transfers(ctx);
+	counters->timer_arms = ctx->counters.timer_arms;
+	counters->timer_arms_skipped = ctx->counters.timer_arms_skipped;
+	counters->timer_disarms = ctx->counters.timer_disarms;
+	counters->flying_transfers_lock_acquisitions =
+		ctx->flying_transfers_lock_counters.acquisitions;
+	counters->flying_transfers_lock_contended =
+		ctx->flying_transfers_lock_counters.contended;
+	counters->flying_transfers_lock_held_ns =
+		ctx->flying_transfers_lock_counters.held_ns;
+	usbi_unlock_flying_transfers(ctx);
+
+	usbi_mutex_lock(&ctx->event_waiters_lock);
+	counters->events_lock_waits = ctx->counters.events_lock_waits;
+	usbi_mutex_unlock(&ctx->event_waiters_lock);
+
+	return 0;
+}
+
+#if defined(PLATFORM_POSIX)
+/* Passed to a starting event thread, which reports whether applying the
+ * options succeeded before it starts handling events. */
+struct event_thread_start {
+	struct libusb_context *ctx;
+	const struct libusb_event_thread_options *opts;
+	struct usbi_event_shard *shard;
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	int done;
+	int r;
+};
+
+/* Create a thread running fn and wait until it has reported the result of
+ * applying its options with thread_started(). Returns an errno value. */
+static int start_thread(pthread_t *thread, void *(*fn)(void *),
+	struct event_thread_start *start)
+{
+	int r;
+
+	start->done = 0;
+	start->r = 0;
+	usbi_mutex_init(&start->lock, NULL);
+	usbi_cond_init(&start->cond, NULL);
+
+	/* the thread cannot report back before *thread has been stored, so
+	 * that it can recognize itself, see libusb_stop_event_thread() */
+	usbi_mutex_lock(&start->lock);
+	r = pthread_create(thread, NULL, fn, start);
+	if (r == 0) {
+		while (!start->done)
+			usbi_cond_wait(&start->cond, &start->lock);
+	}
+	usbi_mutex_unlock(&start->lock);
+
+	if (r == 0) {
+		r = start->r;
+		if (r)
+			pthread_join(*thread, NULL);
+	}
+
+	usbi_cond_destroy(&start->cond);
+	usbi_mutex_destroy(&start->lock);
+	return r;
+}
+
+static void thread_started(struct event_thread_start *start, int r)
+{
+	usbi_mutex_lock(&start->lock);
+	start->r = r;
+	start->done = 1;
+	usbi_cond_signal(&start->cond);
+	usbi_mutex_unlock(&start->lock);
+	/* start is gone from here on */
+}
+
+static void *event_thread_main(void *arg)
+{
+	struct event_thread_start *start = arg;
+	struct libusb_context *ctx = start->ctx;
+	const struct libusb_event_thread_options *opts = start->opts;
+	struct timeval tv;
+	int r, stop;
+
+	r = usbi_thread_setup(opts->cpus, opts->num_cpus, opts->priority,
+		opts->name ? opts->name : "libusb-events");
+	thread_started(start, r);
+	if (r)
+		return NULL;
+
+	usbi_dbg("event thread running");
+	for (;;) {
+		usbi_lock_event_data(ctx);
+		stop = ctx->event_thread_stop;
+		usbi_unlock_event_data(ctx);
+		if (stop)
+			break;
+
+		/* the thread does not wait for any transfer in particular, so
+		 * it is not counted as a completion waiter */
+		tv.tv_sec = 60;
+		tv.tv_usec = 0;
+		r = handle_events_completed(ctx, &tv, NULL);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			usbi_err(ctx, "event handling failed with error %d", r);
+	}
+	usbi_dbg("event thread exiting");
+
+	return NULL;
+}
+
+static int thread_error(int err)
+{
+	switch (err) {
+	case EPERM:
+		return LIBUSB_ERROR_ACCESS;
+	case EINVAL:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	case ENOSYS:
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	case EAGAIN:
+	case ENOMEM:
+		return LIBUSB_ERROR_NO_MEM;
+	default:
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+#endif
+
+/** \ingroup poll
+ * Start a thread which handles the events of a context until
+ * libusb_stop_event_thread() is called, as described in
+ * \ref eventthread "Using an event handling thread". Transfer and hotplug
+ * callbacks are then invoked from this thread.
+ *
+ * The options are applied by the thread itself before it handles any
+ * event, and an error applying them is returned by this function.
+ *
+ * This function is only supported on POSIX platforms.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param opts options of the thread, or NULL for the defaults
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_BUSY if an event thread is already running
+ * \returns LIBUSB_ERROR_ACCESS if the priority can't be set for lack of
+ * privileges
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a CPU or the priority is invalid
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if CPUs are given but this platform
+ * does not support setting the affinity, or on non-POSIX platforms
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_start_event_thread(libusb_context *ctx,
+	const struct libusb_event_thread_options *opts)
+{
+#if defined(PLATFORM_POSIX)
+	static const struct libusb_event_thread_options default_opts;
+	struct event_thread_start start;
+	int r;
+
+	USBI_GET_CONTEXT(ctx);
+
+	if (!opts)
+		opts = &default_opts;
+	if (opts->num_cpus < 0 || (opts->num_cpus && !opts->cpus))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_lock_event_data(ctx);
+	if (ctx->event_thread_started) {
+		usbi_unlock_event_data(ctx);
+		return LIBUSB_ERROR_BUSY;
+	}
+	ctx->event_thread_started = 1;
+	ctx->event_thread_stop = 0;
+	usbi_unlock_event_data(ctx);
+
+	start.ctx = ctx;
+	start.opts = opts;
+	start.shard = NULL;
+	r = start_thread(&ctx->event_thread, event_thread_main, &start);
+	if (r) {
+		usbi_err(ctx, "failed to start event thread, errno=%d", r);
+		usbi_lock_event_data(ctx);
+		ctx->event_thread_started = 0;
+		usbi_unlock_event_data(ctx);
+		return thread_error(r);
+	}
+
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(ctx);
+	UNUSED(opts);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup poll
+ * Stop the event handling thread started with libusb_start_event_thread().
+ * The thread is woken up and this function returns once it has exited.
+ * It cannot be stopped from a transfer or hotplug callback, as these run
+ * in the event handling thread itself.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if no event thread is running
+ * \returns LIBUSB_ERROR_BUSY if called from the event handling thread
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on non-POSIX platforms
+ */
+int API_EXPORTED libusb_stop_event_thread(libusb_context *ctx)
+{
+#if defined(PLATFORM_POSIX)
+	int pending_events;
+
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_lock_event_data(ctx);
+	if (!ctx->event_thread_started || ctx->event_thread_stop) {
+		usbi_unlock_event_data(ctx);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	/* the thread cannot wait for itself to exit */
+	if (pthread_equal(pthread_self(), ctx->event_thread)) {
+		usbi_unlock_event_data(ctx);
+		return LIBUSB_ERROR_BUSY;
+	}
+	ctx->event_thread_stop = 1;
+
+	/* wake up the thread if it is waiting for events */
+	pending_events = usbi_pending_events(ctx);
+	if (!pending_events)
+		usbi_signal_context_event(ctx);
+	usbi_unlock_event_data(ctx);
+
+	pthread_join(ctx->event_thread, NULL);
+
+	usbi_lock_event_data(ctx);
+	ctx->event_thread_started = 0;
+	ctx->event_thread_stop = 0;
+	usbi_unlock_event_data(ctx);
+
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+#if defined(PLATFORM_POSIX)
+/* The event source of a device handle handled by an event shard */
+struct usbi_shard_source {
+	struct libusb_device_handle *dev_handle;
+	struct pollfd pollfd;
+};
+
+/* A partition of the open device handles of a context, whose events are
+ * handled by a thread of its own, see libusb_start_event_shards(). */
+struct usbi_event_shard {
+	struct libusb_context *ctx;
+	int index;
+	pthread_t thread;
+
+	/* held by the thread while it hands events to the backend, and by
+	 * libusb_close() while it closes a handle of the shard. Recursive, as
+	 * the backend removes the event source of a disconnected handle. */
+	usbi_mutex_t lock;
+
+	/* wakes up the thread when a source is added or removed or it is
+	 * stopped */
+	usbi_event_t event;
+
+	/* the event sources, appended and removed by moving the last one into
+	 * the vacated entry, with generation bumped on every change, and the
+	 * flag telling the thread to exit. Protected by sources_lock, which is
+	 * never held while taking another lock. */
+	usbi_mutex_t sources_lock;
+	struct usbi_shard_source *sources;
+	unsigned int num_sources;
+	unsigned int sources_size;
+	unsigned int generation;
+	int stop;
+
+	/* the array the thread polls, with the event first, and the generation
+	 * of the sources it was filled from. Only used by the thread. */
+	struct pollfd *fds;
+	unsigned int num_fds;
+	unsigned int fds_size;
+	unsigned int fds_generation;
+};
+
+/* Refill the array the shard thread polls if the sources have changed.
+ * Callers must hold the sources_lock. */
+static int update_shard_fds(struct usbi_event_shard *shard)
+{
+	struct pollfd *fds = shard->fds;
+	unsigned int i;
+
+	if (shard->fds_generation == shard->generation)
+		return 0;
+
+	if (shard->fds_size < shard->num_sources + 1) {
+		unsigned int size = shard->sources_size + 1;
+
+		fds = realloc(shard->fds, size * sizeof(*fds));
+		if (!fds)
+			return LIBUSB_ERROR_NO_MEM;
+		shard->fds = fds;
+		shard->fds_size = size;
+	}
+
+	for (i = 0; i < shard->num_sources; i++) {
+		fds[i + 1] = shard->sources[i].pollfd;
+		fds[i + 1].revents = 0;
+	}
+	shard->num_fds = shard->num_sources + 1;
+	shard->fds_generation = shard->generation;
+	return 0;
+}
+
+static void *shard_thread_main(void *arg)
+{
+	struct event_thread_start *start = arg;
+	struct usbi_event_shard *shard = start->shard;
+	const struct libusb_event_thread_options *opts = start->opts;
+	struct libusb_context *ctx = shard->ctx;
+	int cpu, r, stale, stop;
+
+	/* spread the shards over the CPUs given, one each */
+	if (opts->num_cpus) {
+		cpu = opts->cpus[shard->index % opts->num_cpus];
+		r = usbi_thread_setup(&cpu, 1, opts->priority,
+			opts->name ? opts->name : "libusb-shard");
+	} else {
+		r = usbi_thread_setup(NULL, 0, opts->priority,
+			opts->name ? opts->name : "libusb-shard");
+	}
+	thread_started(start, r);
+	if (r)
+		return NULL;
+
+	usbi_dbg("event shard %d running", shard->index);
+	for (;;) {
+		usbi_mutex_lock(&shard->sources_lock);
+		stop = shard->stop;
+		if (!stop && update_shard_fds(shard))
+			usbi_err(ctx, "failed to update event shard %d", shard->index);
+		usbi_mutex_unlock(&shard->sources_lock);
+		if (stop)
+			break;
+
+		r = poll(shard->fds, (POLL_NFDS_TYPE)shard->num_fds, -1);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			usbi_err(ctx, "poll failed %d err=%d", r, errno);
+			break;
+		}
+
+		if (shard->fds[0].revents) {
+			usbi_clear_event(&shard->event);
+			r--;
+		}
+		if (r == 0)
+			continue;
+
+		/* a source removed while polling may have had its fd reused
+		 * by another, so throw away the events of a poll on sources
+		 * that have since changed and poll again */
+		usbi_mutex_lock(&shard->lock);
+		usbi_mutex_lock(&shard->sources_lock);
+		stale = shard->fds_generation != shard->generation;
+		usbi_mutex_unlock(&shard->sources_lock);
+		if (!stale) {
+			r = usbi_backend->handle_events(ctx, shard->fds + 1,
+				shard->num_fds - 1, r);
+			if (r)
+				usbi_err(ctx, "backend handle_events failed with error %d", r);
+
+			/* wake up the event handler if a thread is waiting
+			 * for a transfer to complete, so that it returns from
+			 * libusb_handle_events() and friends and the caller
+			 * notices the completions, or releases the events
+			 * lock and thereby wakes up libusb_wait_for_event() */
+			usbi_lock_event_data(ctx);
+			if (ctx->completion_waiters && !usbi_pending_events(ctx))
+				usbi_signal_context_event(ctx);
+			usbi_unlock_event_data(ctx);
+		}
+		usbi_mutex_unlock(&shard->lock);
+	}
+	usbi_dbg("event shard %d exiting", shard->index);
+
+	return NULL;
+}
+
+static int shard_init(struct usbi_event_shard *shard,
+	struct libusb_context *ctx, int index)
+{
+	shard->ctx = ctx;
+	shard->index = index;
+
+	shard->fds = calloc(1, sizeof(*shard->fds));
+	if (!shard->fds)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (usbi_create_event(&shard->event)) {
+		free(shard->fds);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	shard->fds[0].fd = USBI_EVENT_GET_SOURCE(shard->event);
+	shard->fds[0].events = USBI_EVENT_MASK;
+	shard->num_fds = 1;
+	shard->fds_size = 1;
+	usbi_mutex_init_recursive(&shard->lock, NULL);
+	usbi_mutex_init(&shard->sources_lock, NULL);
+	return 0;
+}
+
+static void shard_destroy(struct usbi_event_shard *shard)
+{
+	usbi_mutex_destroy(&shard->sources_lock);
+	usbi_mutex_destroy(&shard->lock);
+	usbi_destroy_event(&shard->event);
+	free(shard->sources);
+	free(shard->fds);
+}
+
+/* Stop the threads of the first num_shards shards */
+static void stop_shard_threads(struct usbi_event_shard *shards, int num_shards)
+{
+	int i;
+
+	for (i = 0; i < num_shards; i++) {
+		usbi_mutex_lock(&shards[i].sources_lock);
+		shards[i].stop = 1;
+		usbi_mutex_unlock(&shards[i].sources_lock);
+		usbi_signal_event(&shards[i].event);
+	}
+	for (i = 0; i < num_shards; i++)
+		pthread_join(shards[i].thread, NULL);
+}
+
+static void shards_destroy(struct usbi_event_shard *shards, int num_shards)
+{
+	int i;
+
+	stop_shard_threads(shards, num_shards);
+	for (i = 0; i < num_shards; i++)
+		shard_destroy(&shards[i]);
+	free(shards);
+}
+
+static int shard_add_source(struct usbi_event_shard *shard,
+	struct libusb_device_handle *dev_handle, int fd, short events)
+{
+	struct usbi_shard_source *source;
+
+	usbi_mutex_lock(&shard->sources_lock);
+	if (shard->num_sources == shard->sources_size) {
+		unsigned int size = shard->sources_size ? 2 * shard->sources_size : 8;
+
+		source = realloc(shard->sources, size * sizeof(*source));
+		if (!source) {
+			usbi_mutex_unlock(&shard->sources_lock);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		shard->sources = source;
+		shard->sources_size = size;
+	}
+
+	source = &shard->sources[shard->num_sources++];
+	source->dev_handle = dev_handle;
+	source->pollfd.fd = fd;
+	source->pollfd.events = events;
+	source->pollfd.revents = 0;
+	shard->generation++;
+	usbi_mutex_unlock(&shard->sources_lock);
+
+	/* the thread has to poll the new source */
+	usbi_signal_event(&shard->event);
+	return 0;
+}
+
+static void shard_remove_source(struct usbi_event_shard *shard, int fd)
+{
+	unsigned int i;
+
+	usbi_mutex_lock(&shard->sources_lock);
+	for (i = 0; i < shard->num_sources; i++)
+		if (shard->sources[i].pollfd.fd == fd)
+			break;
+
+	if (i == shard->num_sources) {
+		usbi_mutex_unlock(&shard->sources_lock);
+		usbi_dbg("couldn't find fd %d to remove from event shard %d",
+			fd, shard->index);
+		return;
+	}
+
+	shard->sources[i] = shard->sources[--shard->num_sources];
+	shard->generation++;
+	usbi_mutex_unlock(&shard->sources_lock);
+
+	/* the thread must stop polling the removed source */
+	usbi_signal_event(&shard->event);
+}
+#endif
+
+/* Add the event source of a device handle. While event shards are running
+ * it goes to the one with the fewest sources, otherwise to the context. */
+int usbi_add_handle_event_source(struct libusb_device_handle *dev_handle,
+	libusb_os_handle source, short events)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+#if defined(PLATFORM_POSIX)
+	struct usbi_event_shard *shard = NULL;
+	unsigned int num_sources, fewest = UINT_MAX;
+	int i, r = 0;
+
+	usbi_lock_event_data(ctx);
+	for (i = 0; i < ctx->num_shards; i++) {
+		usbi_mutex_lock(&ctx->shards[i].sources_lock);
+		num_sources = ctx->shards[i].num_sources;
+		usbi_mutex_unlock(&ctx->shards[i].sources_lock);
+		if (num_sources < fewest) {
+			shard = &ctx->shards[i];
+			fewest = num_sources;
+		}
+	}
+	if (shard) {
+		r = shard_add_source(shard, dev_handle, source, events);
+		if (r == 0)
+			dev_handle->shard = shard;
+	}
+	usbi_unlock_event_data(ctx);
+
+	if (shard) {
+		usbi_dbg("add fd %d to event shard %d", source, shard->index);
+		return r;
+	}
+#endif
+	return usbi_add_event_source(ctx, source, events);
+}
+
+void usbi_remove_handle_event_source(struct libusb_device_handle *dev_handle,
+	libusb_os_handle source)
+{
+#if defined(PLATFORM_POSIX)
+	if (dev_handle->shard) {
+		shard_remove_source(dev_handle->shard, source);
+		return;
+	}
+#endif
+	usbi_remove_event_source(HANDLE_CTX(dev_handle), source);
+}
+
+struct usbi_event_shard *usbi_lock_event_shard(struct libusb_device_handle *dev_handle)
+{
+#if defined(PLATFORM_POSIX)
+	struct usbi_event_shard *shard = dev_handle->shard;
+
+	if (shard)
+		usbi_mutex_lock(&shard->lock);
+	return shard;
+#else
+	UNUSED(dev_handle);
+	return NULL;
+#endif
+}
+
+void usbi_unlock_event_shard(struct usbi_event_shard *shard)
+{
+#if defined(PLATFORM_POSIX)
+	if (shard)
+		usbi_mutex_unlock(&shard->lock);
+#else
+	UNUSED(shard);
+#endif
+}
+
+/** \ingroup poll
+ * Start event shards, which partition the device handles of a context
+ * opened from now on, as described in \ref eventthread
+ * "Using an event handling thread". Each shard has a thread of its own
+ * reaping the transfers of its handles, so that the event handling of a
+ * context with many busy devices is spread over several CPUs. A handle is
+ * assigned to the shard with the fewest handles when it is opened, and the
+ * callbacks of its transfers are invoked by that shard's thread.
+ *
+ * The shards only handle the device handles. Timeouts, hotplug events and
+ * handles opened before the shards were started are still handled by
+ * libusb_handle_events() and friends, which the application must keep
+ * calling, e.g. from a thread started with libusb_start_event_thread().
+ * Handles assigned to a shard aren't among the file descriptors returned by
+ * libusb_get_pollfds().
+ *
+ * A thread blocked in libusb_handle_events() and friends, or in a
+ * synchronous transfer, returns when a shard completes a transfer, so that
+ * it can check whether the transfer it waits for is done. A flag checked
+ * before calling libusb_handle_events() may still be set just before the
+ * call, so wait with libusb_handle_events_completed() to avoid sleeping
+ * until the timeout, as described in \ref mtasync.
+ *
+ * If CPUs are given in the options, each thread is pinned to one of them in
+ * turn. The other options apply to all threads, the default name being
+ * "libusb-shard".
+ *
+ * This function is only supported on POSIX platforms, and handles are only
+ * assigned to shards by backends which poll a file descriptor per handle,
+ * currently Linux.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param num_shards number of shards to start
+ * \param opts options of the threads, or NULL for the defaults
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_shards is less than 1, or a CPU
+ * or the priority is invalid
+ * \returns LIBUSB_ERROR_BUSY if event shards are already running
+ * \returns LIBUSB_ERROR_ACCESS if the priority can't be set for lack of
+ * privileges
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED if CPUs are given but this platform
+ * does not support setting the affinity, or on non-POSIX platforms
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_start_event_shards(libusb_context *ctx,
+	int num_shards, const struct libusb_event_thread_options *opts)
+{
+#if defined(PLATFORM_POSIX)
+	static const struct libusb_event_thread_options default_opts;
+	struct usbi_event_shard *shards;
+	struct event_thread_start start;
+	int i, r = 0;
+
+	USBI_GET_CONTEXT(ctx);
+
+	if (!opts)
+		opts = &default_opts;
+	if (num_shards < 1 || opts->num_cpus < 0 || (opts->num_cpus && !opts->cpus))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	shards = calloc((size_t)num_shards, sizeof(*shards));
+	if (!shards)
+		return LIBUSB_ERROR_NO_MEM;
+
+	start.ctx = ctx;
+	start.opts = opts;
+	for (i = 0; i < num_shards; i++) {
+		r = shard_init(&shards[i], ctx, i);
+		if (r)
+			break;
+
+		start.shard = &shards[i];
+		r = start_thread(&shards[i].thread, shard_thread_main, &start);
+		if (r) {
+			usbi_err(ctx, "failed to start event shard, errno=%d", r);
+			shard_destroy(&shards[i]);
+			r = thread_error(r);
+			break;
+		}
+	}
+	if (r) {
+		shards_destroy(shards, i);
+		return r;
+	}
+
+	usbi_lock_event_data(ctx);
+	if (ctx->shards) {
+		usbi_unlock_event_data(ctx);
+		shards_destroy(shards, num_shards);
+		return LIBUSB_ERROR_BUSY;
+	}
+	ctx->shards = shards;
+	ctx->num_shards = num_shards;
+	usbi_unlock_event_data(ctx);
+
+	usbi_dbg("started %d event shards", num_shards);
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(ctx);
+	UNUSED(num_shards);
+	UNUSED(opts);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup poll
+ * Stop the event shards started with libusb_start_event_shards(). The
+ * device handles assigned to them are handled with the events of the
+ * context again. Must not be called from a transfer callback.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if no event shards are running
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on non-POSIX platforms
+ */
+int API_EXPORTED libusb_stop_event_shards(libusb_context *ctx)
+{
+#if defined(PLATFORM_POSIX)
+	struct usbi_event_shard *shards;
+	struct libusb_device_handle *dev_handle;
+	struct usbi_shard_source *source;
+	unsigned int j;
+	int i, num_shards, pending_events;
+
+	USBI_GET_CONTEXT(ctx);
+
+	/* Like libusb_close(), interrupt the event handler and take the event
+	 * handling lock, so that no handle is closed while its event source
+	 * moves back to the context. */
+	usbi_lock_event_data(ctx);
+	shards = ctx->shards;
+	num_shards = ctx->num_shards;
+	if (!shards) {
+		usbi_unlock_event_data(ctx);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	ctx->shards = NULL;
+	ctx->num_shards = 0;
+	pending_events = usbi_pending_events(ctx);
+	ctx->device_close++;
+	if (!pending_events)
+		usbi_signal_context_event(ctx);
+	usbi_unlock_event_data(ctx);
+
+	libusb_lock_events(ctx);
+
+	stop_shard_threads(shards, num_shards);
+	for (i = 0; i < num_shards; i++) {
+		for (j = 0; j < shards[i].num_sources; j++) {
+			source = &shards[i].sources[j];
+			source->dev_handle->shard = NULL;
+			if (usbi_add_event_source(ctx, source->pollfd.fd, source->pollfd.events))
+				usbi_err(ctx, "failed to move fd %d back to the context",
+					source->pollfd.fd);
+		}
+	}
+
+	/* handles whose source the backend already removed */
+	usbi_mutex_lock(&ctx->open_devs_lock);
+	list_for_each_entry(dev_handle, &ctx->open_devs, list, struct libusb_device_handle)
+		dev_handle->shard = NULL;
+	usbi_mutex_unlock(&ctx->open_devs_lock);
+
+	for (i = 0; i < num_shards; i++)
+		shard_destroy(&shards[i]);
+	free(shards);
+
+	usbi_lock_event_data(ctx);
+	ctx->device_close--;
+	pending_events = usbi_pending_events(ctx);
+	if (!pending_events)
+		usbi_clear_context_event(ctx);
+	usbi_unlock_event_data(ctx);
+
+	libusb_unlock_events(ctx);
+
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup asyncio
+ * Start a pool of threads which invoke the callbacks of completed
+ * asynchronous transfers, instead of the thread handling events. A slow
+ * callback then doesn't hold up the handling of other completions, so
+ * transfers can be reaped and resubmitted while the application is busy.
+ *
+ * The callbacks of the transfers of a device are always invoked by the
+ * same thread, in the order the transfers completed. Callbacks of
+ * different devices may run concurrently and must be threadsafe.
+ * Synchronous transfers and hotplug callbacks are not affected.
+ *
+ * The event handler is woken up once a thread has run out of callbacks
+ * to invoke, so that libusb_handle_events_completed() notices a
+ * completion flag set by a callback.
+ *
+ * This function is only supported on POSIX platforms.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param num_threads the number of threads to start
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_INVALID_PARAM if num_threads is not positive
+ * \returns LIBUSB_ERROR_BUSY if an executor is already running
+ * \returns LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on non-POSIX platforms
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_start_callback_executor(libusb_context *ctx,
+	int num_threads)
+{
+#if defined(PLATFORM_POSIX)
+	struct usbi_executor *executor;
+	struct usbi_executor_worker *worker;
+	int i, r = 0;
+
+	USBI_GET_CONTEXT(ctx);
+
+	if (num_threads <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	executor = calloc(1, sizeof(*executor) + num_threads * sizeof(*worker));
+	if (!executor)
+		return LIBUSB_ERROR_NO_MEM;
+	executor->num_workers = num_threads;
+	executor->workers = (struct usbi_executor_worker *)(executor + 1);
+	for (i = 0; i < num_threads; i++) {
+		worker = &executor->workers[i];
+		worker->ctx = ctx;
+		usbi_mutex_init(&worker->lock, NULL);
+		usbi_cond_init(&worker->cond, NULL);
+		list_init(&worker->queue);
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		worker = &executor->workers[i];
+		r = pthread_create(&worker->thread, NULL, executor_worker_main, worker);
+		if (r)
+			break;
+	}
+	if (r) {
+		usbi_err(ctx, "failed to start callback thread, errno=%d", r);
+		executor_destroy(executor, i);
+		return thread_error(r);
+	}
+
+	usbi_lock_event_data(ctx);
+	if (ctx->executor) {
+		usbi_unlock_event_data(ctx);
+		executor_destroy(executor, num_threads);
+		return LIBUSB_ERROR_BUSY;
+	}
+	ctx->executor = executor;
+	usbi_unlock_event_data(ctx);
+
+	usbi_dbg("started callback executor with %d threads", num_threads);
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(ctx);
+	UNUSED(num_threads);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/** \ingroup asyncio
+ * Stop the callback executor started with libusb_start_callback_executor().
+ * Callbacks already handed to it are invoked before this function returns,
+ * afterwards callbacks are invoked by the thread handling events again.
+ * Must not be called from a transfer callback.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns 0 on success
+ * \returns LIBUSB_ERROR_NOT_FOUND if no executor is running
+ * \returns LIBUSB_ERROR_NOT_SUPPORTED on non-POSIX platforms
+ */
+int API_EXPORTED libusb_stop_callback_executor(libusb_context *ctx)
+{
+#if defined(PLATFORM_POSIX)
+	struct usbi_executor *executor;
+
+	USBI_GET_CONTEXT(ctx);
+
+	usbi_lock_event_data(ctx);
+	executor = ctx->executor;
+	ctx->executor = NULL;
+	usbi_unlock_event_data(ctx);
+
+	if (!executor)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	executor_destroy(executor, executor->num_workers);
+	return LIBUSB_SUCCESS;
+#else
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
 /* Backends may call this from handle_events to report disconnection of a
  * device. This function ensures transfers get cancelled appropriately.
- * Callers of this function must hold the events_lock.
+ * Callers of this function must hold the events_lock, or the lock of the
+ * event shard handling the device.
  */
 void usbi_handle_disconnect(struct libusb_device_handle *handle)
 {
@@ -2652,7 +4667,7 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 
 	while (1) {
 		to_cancel = NULL;
-		usbi_mutex_lock(&HANDLE_CTX(handle)->flying_transfers_lock);
+		usbi_lock_flying_transfers(HANDLE_CTX(handle));
 		list_for_each_entry(cur, &HANDLE_CTX(handle)->flying_transfers, list, struct usbi_transfer)
 			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == handle) {
 				usbi_mutex_lock(&cur->flags_lock);
@@ -2665,7 +4680,7 @@ void usbi_handle_disconnect(struct libusb_device_handle *handle)
 				if (to_cancel)
 					break;
 			}
-		usbi_mutex_unlock(&HANDLE_CTX(handle)->flying_transfers_lock);
+		usbi_unlock_flying_transfers(HANDLE_CTX(handle));
 
 		if (!to_cancel)
 			break;
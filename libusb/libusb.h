@@ -142,7 +142,7 @@ typedef unsigned __int32  uint32_t;
  * Internally, LIBUSB_API_VERSION is defined as follows:
  * (libusb major << 24) | (libusb minor << 16) | (16 bit incremental)
  */
-#define LIBUSB_API_VERSION 0x01000104
+#define LIBUSB_API_VERSION 0x01000105
 
 /* The following is kept for compatibility, but will be deprecated in the future */
 #define LIBUSBX_API_VERSION LIBUSB_API_VERSION
@@ -1186,6 +1186,37 @@ struct libusb_iso_packet_descriptor {
 	enum libusb_transfer_status status;
 };
 
+/** \ingroup asyncio
+ * A segment of a scatter-gather bulk transfer, see
+ * libusb_transfer_set_iovec() and libusb_bulk_transfer_iovec(). */
+struct libusb_iovec {
+	/** Start of the segment */
+	unsigned char *iov_base;
+
+	/** Length of the segment in bytes */
+	int iov_len;
+};
+
+/** \ingroup asyncio
+ * Value for libusb_transfer_set_iso_start_frame() to have an isochronous
+ * transfer start as soon as possible, which is the default. */
+#define LIBUSB_ISO_START_ASAP -1
+
+/** \ingroup asyncio
+ * Timing of a completed isochronous transfer, see
+ * libusb_transfer_get_iso_timing(). */
+struct libusb_iso_timing {
+	/** Number of the frame (microframe on some high speed host
+	 * controllers) the first packet of the transfer was scheduled in.
+	 * Frame numbers are specific to the host controller and wrap around. */
+	int start_frame;
+
+	/** Time at which libusb reaped the last packets of the transfer from
+	 * the operating system, in nanoseconds of the monotonic clock used for
+	 * timeouts (CLOCK_MONOTONIC on Linux) */
+	uint64_t reaped_ns;
+};
+
 struct libusb_transfer;
 
 /** \ingroup asyncio
@@ -1246,7 +1277,8 @@ struct libusb_transfer {
 	/** User context data to pass to the callback function. */
 	void *user_data;
 
-	/** Data buffer */
+	/** Data buffer. Not used for transfers which have scatter-gather
+	 * segments set with libusb_transfer_set_iovec(). */
 	unsigned char *buffer;
 
 	/** Number of isochronous packets. Only used for I/O with isochronous
@@ -1263,6 +1295,87 @@ struct libusb_transfer {
 	;
 };
 
+/** \ingroup asyncio
+ * Number of buckets in a \ref libusb_stats_histogram. */
+#define LIBUSB_STATS_HISTOGRAM_BUCKETS 304
+
+/** \ingroup asyncio
+ * A histogram of latencies in nanoseconds. Values below 8 have a bucket
+ * each. Above that, each power of 2 is divided into 8 buckets of equal
+ * width, so that a value is known to within 12.5%. Use
+ * libusb_stats_histogram_percentile() to read percentiles from it.
+ */
+struct libusb_stats_histogram {
+	/** Number of values recorded */
+	uint64_t count;
+
+	/** Sum of the values recorded */
+	uint64_t total_ns;
+
+	/** Largest value recorded */
+	uint64_t max_ns;
+
+	/** Number of values recorded in each bucket */
+	uint64_t buckets[LIBUSB_STATS_HISTOGRAM_BUCKETS];
+};
+
+/** \ingroup asyncio
+ * Statistics for the transfers completed on one endpoint of a device while
+ * statistics were enabled. Control transfers count towards endpoint 0.
+ */
+struct libusb_endpoint_stats {
+	/** Number of the bus the device is connected to */
+	uint8_t bus_number;
+
+	/** Address of the device on the bus */
+	uint8_t device_address;
+
+	/** Address of the endpoint */
+	unsigned char endpoint;
+
+	/** Type of the last transfer completed on the endpoint, see
+	 * \ref libusb_transfer_type */
+	unsigned char transfer_type;
+
+	/** Number of transfers completed, including failed ones */
+	uint64_t transfers;
+
+	/** Number of bytes transferred */
+	uint64_t bytes;
+
+	/** Number of transfers which timed out */
+	uint64_t timeouts;
+
+	/** Number of transfers which were cancelled */
+	uint64_t cancellations;
+
+	/** Number of transfers which failed for other reasons */
+	uint64_t errors;
+
+	/** Time from libusb_submit_transfer() being called to the transfer
+	 * having been handed to the operating system */
+	struct libusb_stats_histogram submit_latency;
+
+	/** Time from libusb_submit_transfer() being called to libusb
+	 * learning that the transfer completed */
+	struct libusb_stats_histogram transfer_latency;
+
+	/** Time from libusb learning that the transfer completed to the
+	 * transfer callback returning */
+	struct libusb_stats_histogram callback_latency;
+};
+
+/** \ingroup asyncio
+ * Statistics of a context, as returned by libusb_get_stats(). */
+struct libusb_stats {
+	/** Number of elements in endpoints */
+	int num_endpoints;
+
+	/** Statistics for each endpoint of a connected device a transfer has
+	 * completed on */
+	struct libusb_endpoint_stats *endpoints;
+};
+
 /** \ingroup misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1309,6 +1422,7 @@ int LIBUSB_CALL libusb_has_capability(uint32_t capability);
 const char * LIBUSB_CALL libusb_error_name(int errcode);
 int LIBUSB_CALL libusb_setlocale(const char *locale);
 const char * LIBUSB_CALL libusb_strerror(enum libusb_error errcode);
+int LIBUSB_CALL libusb_trace_dump(const char *path);
 
 ssize_t LIBUSB_CALL libusb_get_device_list(libusb_context *ctx,
 	libusb_device ***list);
@@ -1401,6 +1515,8 @@ int LIBUSB_CALL libusb_attach_kernel_driver(libusb_device_handle *dev,
 	int interface_number);
 int LIBUSB_CALL libusb_set_auto_detach_kernel_driver(
 	libusb_device_handle *dev, int enable);
+int LIBUSB_CALL libusb_set_direct_sync_transfers(
+	libusb_device_handle *dev, int enable);
 
 /* async I/O */
 
@@ -1483,6 +1599,19 @@ void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
 	struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_transfer_set_iovec(struct libusb_transfer *transfer,
+	const struct libusb_iovec *iov, int iovcnt);
+void LIBUSB_CALL libusb_transfer_set_iso_start_frame(
+	struct libusb_transfer *transfer, int start_frame);
+int LIBUSB_CALL libusb_transfer_get_iso_timing(
+	struct libusb_transfer *transfer, struct libusb_iso_timing *timing);
+void LIBUSB_CALL libusb_set_stats_enabled(libusb_context *ctx,
+	int enabled);
+int LIBUSB_CALL libusb_get_stats(libusb_context *ctx,
+	struct libusb_stats **stats);
+void LIBUSB_CALL libusb_free_stats(struct libusb_stats *stats);
+uint64_t LIBUSB_CALL libusb_stats_histogram_percentile(
+	const struct libusb_stats_histogram *histogram, double percentile);
 
 /** \ingroup asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -1746,6 +1875,10 @@ int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
 
+int LIBUSB_CALL libusb_bulk_transfer_iovec(libusb_device_handle *dev_handle,
+	unsigned char endpoint, const struct libusb_iovec *iov, int iovcnt,
+	int *actual_length, unsigned int timeout);
+
 int LIBUSB_CALL libusb_interrupt_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
@@ -1876,12 +2009,153 @@ typedef void (LIBUSB_CALL *libusb_pollfd_added_cb)(libusb_os_handle handle, shor
  */
 typedef void (LIBUSB_CALL *libusb_pollfd_removed_cb)(libusb_os_handle handle, void *user_data);
 
+/** \ingroup poll
+ * Counters of the work done by the event handling loop of a context, as
+ * returned by libusb_get_event_counters(). All counters start at zero when
+ * the context is created and are never reset; take the difference between
+ * two calls to get them for an interval.
+ */
+struct libusb_event_counters {
+	/** Number of times the event handler waited for events, i.e. called
+	 * poll() or WaitForMultipleObjects() */
+	uint64_t waits;
+
+	/** Number of waits that returned because an event source was ready,
+	 * rather than because of a timeout or an error */
+	uint64_t wakeups;
+
+	/** Number of wakeups in which none of the event sources of the
+	 * backend were ready, only the internal event or timer */
+	uint64_t empty_wakeups;
+
+	/** Number of times the event handler immediately waited again after
+	 * handling an internal event or timer expiry. Included in waits. */
+	uint64_t repolls;
+
+	/** Number of times the internal event was signalled to interrupt the
+	 * event handler */
+	uint64_t event_signals;
+
+	/** Number of times the internal event was cleared */
+	uint64_t event_clears;
+
+	/** Number of times the timeout timer was armed */
+	uint64_t timer_arms;
+
+	/** Number of times the timeout timer did not need to be armed because
+	 * it was already set to expire at the right time, see
+	 * libusb_set_timer_slack() */
+	uint64_t timer_arms_skipped;
+
+	/** Number of times the timeout timer was disarmed */
+	uint64_t timer_disarms;
+
+	/** Number of times the event source data was reallocated to make room
+	 * for more event sources */
+	uint64_t event_data_reallocs;
+
+	/** Number of times the event handling lock was taken */
+	uint64_t events_lock_acquisitions;
+
+	/** Total time the event handling lock was held, in nanoseconds */
+	uint64_t events_lock_held_ns;
+
+	/** Number of times libusb_lock_events() had to wait for another
+	 * thread to release the event handling lock, or
+	 * libusb_try_lock_events() failed because another thread held it */
+	uint64_t events_lock_contended;
+
+	/** Number of times a thread waited for the thread holding the event
+	 * handling lock to handle events, in libusb_wait_for_event() or while
+	 * completing a synchronous transfer */
+	uint64_t events_lock_waits;
+
+	/** Number of times the lock protecting the list of transfers in
+	 * flight was taken */
+	uint64_t flying_transfers_lock_acquisitions;
+
+	/** Number of times the lock protecting the list of transfers in
+	 * flight had to be waited for */
+	uint64_t flying_transfers_lock_contended;
+
+	/** Total time the lock protecting the list of transfers in flight was
+	 * held, in nanoseconds. Only measured while statistics are enabled
+	 * with libusb_set_stats_enabled(). */
+	uint64_t flying_transfers_lock_held_ns;
+
+	/** Number of times the lock protecting the internal event data was
+	 * taken */
+	uint64_t event_data_lock_acquisitions;
+
+	/** Number of times the lock protecting the internal event data had to
+	 * be waited for */
+	uint64_t event_data_lock_contended;
+
+	/** Total time the lock protecting the internal event data was held, in
+	 * nanoseconds. Only measured while statistics are enabled with
+	 * libusb_set_stats_enabled(). */
+	uint64_t event_data_lock_held_ns;
+
+	/** Number of hotplug notifications dropped because no memory was
+	 * available to queue them */
+	uint64_t hotplug_msgs_dropped;
+
+	/** Number of bulk URB submissions that failed because the kernel could
+	 * not allocate memory for them. Only counted on Linux. */
+	uint64_t bulk_urb_enomem;
+
+	/** Number of bulk transfers submitted while URBs were kept smaller
+	 * than usual because an earlier submission ran out of memory. Only
+	 * counted on Linux. */
+	uint64_t bulk_urb_limit_hits;
+};
+
 const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 	libusb_context *ctx);
 void LIBUSB_CALL libusb_free_pollfds(const struct libusb_pollfd **pollfds);
 void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
 	void *user_data);
+void LIBUSB_CALL libusb_set_timer_slack(libusb_context *ctx,
+	unsigned int slack_us);
+int LIBUSB_CALL libusb_get_event_fd(libusb_context *ctx);
+int LIBUSB_CALL libusb_handle_events_ready(libusb_context *ctx);
+int LIBUSB_CALL libusb_get_event_counters(libusb_context *ctx,
+	struct libusb_event_counters *counters);
+
+/** \ingroup poll
+ * Options for the event handling thread started by
+ * libusb_start_event_thread(), or the threads started by
+ * libusb_start_event_shards(). Zero all fields to get a thread with the
+ * default scheduling of the process.
+ */
+struct libusb_event_thread_options {
+	/** Array of the CPUs the thread is allowed to run on, or NULL to not
+	 * restrict it. Only supported on Linux. */
+	const int *cpus;
+
+	/** Number of entries in the cpus array */
+	int num_cpus;
+
+	/** If non-zero, the thread is run with the SCHED_FIFO policy at this
+	 * priority. This usually requires privileges. */
+	int priority;
+
+	/** Name of the thread, or NULL for the default name "libusb-events".
+	 * The name may be truncated by the system. */
+	const char *name;
+};
+
+int LIBUSB_CALL libusb_start_event_thread(libusb_context *ctx,
+	const struct libusb_event_thread_options *opts);
+int LIBUSB_CALL libusb_stop_event_thread(libusb_context *ctx);
+int LIBUSB_CALL libusb_start_event_shards(libusb_context *ctx,
+	int num_shards, const struct libusb_event_thread_options *opts);
+int LIBUSB_CALL libusb_stop_event_shards(libusb_context *ctx);
+
+int LIBUSB_CALL libusb_start_callback_executor(libusb_context *ctx,
+	int num_threads);
+int LIBUSB_CALL libusb_stop_callback_executor(libusb_context *ctx);
 
 /** \ingroup hotplug
  * Callback handle.
@@ -58,6 +58,8 @@ extern "C" {
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS					0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
+#define USBI_CAP_SUPPORTS_BULK_IOVEC			0x00040000
+#define USBI_CAP_SUPPORTS_ISO_START_FRAME		0x00080000
 
 /* Maximum number of bytes in a log line */
 #define USBI_MAX_LOG_LEN	1024
@@ -227,6 +229,69 @@ static inline void usbi_dbg(const char *format, ...)
 
 #endif /* !defined(_MSC_VER) || _MSC_VER >= 1400 */
 
+/* Binary tracing. When the LIBUSB_TRACE environment variable is set, each
+ * trace point hit is recorded with a timestamp and the thread ID in a ring
+ * buffer private to the thread, to be written out by libusb_trace_dump().
+ * Unlike debug logging, this is cheap enough to leave on in the hot path.
+ * While tracing is off, a trace point costs a load and a branch.
+ *
+ * When built with USDT support, every trace point is also a static probe
+ * in the "libusb" provider, named as in usbi_trace_point_names, so that
+ * perf, bpftrace or SystemTap can attach to a release build. A probe is a
+ * single nop until a tracer attaches to it.
+ *
+ * The comments give the two arguments recorded by each trace point. New
+ * points must be added at the end, named in usbi_trace_point_names and
+ * given a USBI_PROBE_ definition below. */
+enum usbi_trace_point {
+	USBI_TRACE_SUBMIT,		/* transfer, length */
+	USBI_TRACE_CANCEL,		/* transfer, 0 */
+	USBI_TRACE_TIMEOUT,		/* transfer, 0 */
+	USBI_TRACE_COMPLETE,		/* transfer, status */
+	USBI_TRACE_CALLBACK_DONE,	/* transfer, 0 */
+	USBI_TRACE_EVENTS_WAIT,		/* timeout in ms, number of event sources */
+	USBI_TRACE_EVENTS_DONE,		/* result, 0 */
+	USBI_TRACE_HOTPLUG_ARRIVED,	/* device, bus number << 8 | address */
+	USBI_TRACE_HOTPLUG_LEFT,	/* device, bus number << 8 | address */
+	USBI_TRACE_URB_SUBMIT,		/* urb, length */
+	USBI_TRACE_URB_REAP,		/* urb, actual length */
+	USBI_TRACE_POINT_COUNT
+};
+
+extern int usbi_trace_enabled;
+
+void usbi_trace_event(enum usbi_trace_point point, uint64_t arg0,
+	uint64_t arg1);
+
+#ifdef USE_USDT
+#include <sys/sdt.h>
+#define USBI_PROBE(name, arg0, arg1)	DTRACE_PROBE2(libusb, name, arg0, arg1)
+#else
+#define USBI_PROBE(name, arg0, arg1)	do { } while (0)
+#endif
+
+#define USBI_PROBE_SUBMIT(arg0, arg1)		USBI_PROBE(submit, arg0, arg1)
+#define USBI_PROBE_CANCEL(arg0, arg1)		USBI_PROBE(cancel, arg0, arg1)
+#define USBI_PROBE_TIMEOUT(arg0, arg1)		USBI_PROBE(timeout, arg0, arg1)
+#define USBI_PROBE_COMPLETE(arg0, arg1)		USBI_PROBE(complete, arg0, arg1)
+#define USBI_PROBE_CALLBACK_DONE(arg0, arg1)	USBI_PROBE(callback_done, arg0, arg1)
+#define USBI_PROBE_EVENTS_WAIT(arg0, arg1)	USBI_PROBE(events_wait, arg0, arg1)
+#define USBI_PROBE_EVENTS_DONE(arg0, arg1)	USBI_PROBE(events_done, arg0, arg1)
+#define USBI_PROBE_HOTPLUG_ARRIVED(arg0, arg1)	USBI_PROBE(hotplug_arrived, arg0, arg1)
+#define USBI_PROBE_HOTPLUG_LEFT(arg0, arg1)	USBI_PROBE(hotplug_left, arg0, arg1)
+#define USBI_PROBE_URB_SUBMIT(arg0, arg1)	USBI_PROBE(urb_submit, arg0, arg1)
+#define USBI_PROBE_URB_REAP(arg0, arg1)		USBI_PROBE(urb_reap, arg0, arg1)
+
+/* point is the trace point name without the USBI_TRACE_ prefix */
+#define usbi_trace(point, arg0, arg1)					\
+	do {								\
+		USBI_PROBE_##point(arg0, arg1);				\
+		if (usbi_trace_enabled)					\
+			usbi_trace_event(USBI_TRACE_##point,		\
+				(uint64_t)(uintptr_t)(arg0),		\
+				(uint64_t)(uintptr_t)(arg1));		\
+	} while (0)
+
 #define USBI_GET_CONTEXT(ctx) if (!(ctx)) (ctx) = usbi_default_context
 #define DEVICE_CTX(dev) ((dev)->ctx)
 #define HANDLE_CTX(handle) (DEVICE_CTX((handle)->dev))
@@ -250,6 +315,15 @@ static inline void usbi_dbg(const char *format, ...)
 
 extern struct libusb_context *usbi_default_context;
 
+/* Counters of a context lock, protected by the lock itself. See
+ * usbi_mutex_lock_counted(). */
+struct usbi_lock_counters {
+	uint64_t acquisitions;
+	uint64_t contended;
+	uint64_t held_ns;
+	uint64_t locked_at;
+};
+
 struct libusb_context {
 	int debug;
 	int debug_fixed;
@@ -279,6 +353,13 @@ struct libusb_context {
 	 * infinite timeout are always placed at the very end. */
 	struct list_head flying_transfers;
 	usbi_mutex_t flying_transfers_lock;
+	struct usbi_lock_counters flying_transfers_lock_counters;
+
+	/* the granularity timeouts are rounded up to, and the time the timer
+	 * was last armed to expire at, cleared when it is not known to be
+	 * armed. Protected by flying_transfers_lock. */
+	unsigned int timer_slack_us;
+	struct timeval timer_expiry;
 
 	/* user callbacks for event source changes */
 	libusb_pollfd_added_cb event_source_added_cb;
@@ -296,29 +377,108 @@ struct libusb_context {
 	usbi_mutex_t event_waiters_lock;
 	usbi_cond_t event_waiters_cond;
 
+	/* threads blocked in synchronous transfers while another thread is
+	 * handling events, each waiting on its own condition. Protected by
+	 * event_waiters_lock. */
+	struct list_head sync_waiters;
+
 	/* A lock to protect internal context event data. */
 	usbi_mutex_t event_data_lock;
+	struct usbi_lock_counters event_data_lock_counters;
 
 	/* A counter that is set when we want to interrupt and prevent event handling,
 	 * in order to safely close a device. Protected by event_data_lock. */
 	unsigned int device_close;
 
+	/* The event handling thread started by libusb_start_event_thread(),
+	 * whether one was started and whether it was asked to stop.
+	 * Protected by event_data_lock. */
+#if defined(PLATFORM_POSIX)
+	pthread_t event_thread;
+#endif
+	int event_thread_started;
+	int event_thread_stop;
+
+	/* The pool of threads transfer callbacks are handed to, see
+	 * libusb_start_callback_executor(), or NULL to invoke them from the
+	 * event handler. Protected by event_data_lock. */
+	struct usbi_executor *executor;
+
+	/* The event shards started by libusb_start_event_shards(), or NULL.
+	 * Protected by event_data_lock. */
+	struct usbi_event_shard *shards;
+	int num_shards;
+
 	/* list and count of event sources and a pointer to event source data
 	 * that the event abstraction will (re)allocate as necessary prior to
-	 * waiting for an event to occur, and a flag to indicate when the list
-	 * of event sources has changed since the last wait.
+	 * waiting for an event to occur, and a flag to indicate when an event
+	 * source has been added or removed since the last wait.
 	 * Protected by event_data_lock. */
 	struct list_head event_sources;
 	unsigned int event_sources_cnt;
 	unsigned int event_sources_modified;
 	void *event_data;
 
+	/* The event sources in the order they are waited on. Sources are
+	 * appended and removed by moving the last slot into the vacated one,
+	 * and every change bumps event_sources_generation. event_data_size is
+	 * the number of slots event_data has room for and event_data_generation
+	 * the generation it was last filled from. The internal event (and
+	 * timer, if used) always occupy the first slots.
+	 * Protected by event_data_lock. */
+	struct usbi_event_source **event_slots;
+	unsigned int event_slots_size;
+	unsigned int event_sources_generation;
+	unsigned int event_data_size;
+	unsigned int event_data_generation;
+
+	/* A file descriptor aggregating all event sources, created by
+	 * libusb_get_event_fd(), or -1. Protected by event_data_lock. */
+	int event_fd;
+
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
+	/* A pool of unused hotplug messages, the number of messages allocated
+	 * for this context and the number of notifications that were dropped
+	 * because the pool could not be grown. Messages are recycled into the
+	 * pool once they have been processed and are only freed when the
+	 * context is destroyed. Protected by event_data_lock. */
+	struct list_head hotplug_msgs_free;
+	unsigned int hotplug_msgs_allocated;
+	unsigned int hotplug_msgs_dropped;
+
 	/* A list of pending completed transfers. Protected by event_data_lock. */
 	struct list_head completed_transfers;
 
+	/* The number of threads waiting for a transfer to complete, in
+	 * libusb_handle_events() and friends, synchronous transfers or
+	 * libusb_wait_for_event(), which event shards have to wake up when
+	 * they complete transfers. The event thread is not counted, as it
+	 * waits for nothing in particular. Protected by
+	 * event_data_lock, which may be taken while holding
+	 * event_waiters_lock. */
+	unsigned int completion_waiters;
+
+	/* Whether statistics of completed transfers are collected, see
+	 * libusb_set_stats_enabled(). Read without locking. */
+	int stats_enabled;
+
+	/* Event loop counters, see libusb_get_event_counters(). The wait,
+	 * wakeup and events_lock acquisition and hold time counters are only
+	 * written by the thread holding events_lock, events_lock_waits under
+	 * event_waiters_lock, events_lock_contended, the event signal, clear,
+	 * reallocation and bulk URB counters under event_data_lock and the
+	 * timer counters under flying_transfers_lock. hotplug_msgs_dropped is
+	 * only filled in when the counters are read. */
+	struct libusb_event_counters counters;
+
+	/* Nesting depth of events_lock, which is recursive, and the time it
+	 * was taken at the outermost level. Only accessed by the thread
+	 * holding events_lock. */
+	unsigned int events_lock_depth;
+	uint64_t events_lock_time;
+
 	struct list_head list;
 };
 
@@ -329,9 +489,13 @@ struct libusb_context {
 
 #define usbi_using_timer(ctx) ((ctx)->timer != USBI_INVALID_TIMER)
 
+/* Number of endpoint statistics kept per device, one for each endpoint
+ * number and direction */
+#define USBI_ENDPOINT_STATS_SLOTS	32
+
 struct libusb_device {
-	/* lock protects refcnt, everything else is finalized at initialization
-	 * time */
+	/* lock protects refcnt and endpoint_stats, everything else is
+	 * finalized at initialization time */
 	usbi_mutex_t lock;
 	int refcnt;
 
@@ -350,6 +514,10 @@ struct libusb_device {
 	struct libusb_device_descriptor device_descriptor;
 	int attached;
 
+	/* statistics of the transfers completed on each endpoint, allocated
+	 * when the first one completes while statistics are enabled */
+	struct libusb_endpoint_stats *endpoint_stats[USBI_ENDPOINT_STATS_SLOTS];
+
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -367,6 +535,31 @@ struct libusb_device_handle {
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
+	int direct_sync_transfers;
+
+	/* a transfer and a control setup/data buffer kept for reuse by the
+	 * synchronous I/O functions. protected by lock */
+	struct libusb_transfer *sync_transfer;
+	unsigned char *sync_buffer;
+	int sync_buffer_len;
+
+	/* the event shard handling the events of this handle, or NULL if
+	 * they are handled with those of the context. Set when the backend
+	 * adds the event source of the handle, see
+	 * usbi_add_handle_event_source() */
+	struct usbi_event_shard *shard;
+
+	/* the number of completed transfers of this handle queued to the
+	 * callback executor or having their callback invoked by it, and the
+	 * worker invoking one, if any. libusb_close() sets closing and waits
+	 * on callbacks_cond for the count to drop to 0, after which no more
+	 * transfers are queued. protected by lock, which may be taken while
+	 * holding event_data_lock */
+	unsigned int queued_callbacks;
+	struct usbi_executor_worker *callback_worker;
+	usbi_cond_t callbacks_cond;
+	int closing;
+
 	unsigned char os_priv
 #if defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 199901L)
 	[] /* valid C99 code */
@@ -403,6 +596,32 @@ struct usbi_transfer {
 	uint32_t stream_id;
 	uint8_t flags;
 
+	/* scatter-gather segments set with libusb_transfer_set_iovec(). If the
+	 * backend cannot transfer from them directly, the core copies them to
+	 * iov_bounce and points transfer->buffer to it for the duration of the
+	 * transfer, saving the original buffer pointer in iov_saved_buffer. */
+	const struct libusb_iovec *iov;
+	int iovcnt;
+	unsigned char *iov_bounce;
+	unsigned char *iov_saved_buffer;
+
+	/* monotonic time in ns at which the transfer was submitted, at which
+	 * the backend had submitted it and at which it completed, for the
+	 * endpoint statistics */
+	uint64_t submit_time;
+	uint64_t in_flight_time;
+	uint64_t completed_time;
+
+	/* the frame an isochronous transfer is to start in, if iso_scheduled
+	 * is set by libusb_transfer_set_iso_start_frame(), for the next
+	 * submission only. Backends setting USBI_CAP_SUPPORTS_ISO_START_FRAME
+	 * report the frame the transfer actually started in and the monotonic
+	 * time in ns its last packets were reaped at, which is 0 otherwise. */
+	int iso_scheduled;
+	int iso_start_frame;
+	int iso_actual_start_frame;
+	uint64_t iso_reaped_time;
+
 	/* this lock is held during libusb_submit_transfer() and
 	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
 	 * cancellation, submission-during-cancellation, etc). the OS backend
@@ -450,6 +669,15 @@ enum usbi_transfer_flags {
 	((struct usbi_transfer *)(((unsigned char *)(transfer)) \
 		- sizeof(struct usbi_transfer)))
 
+/* scatter-gather segments that the backend should transfer from directly,
+ * or NULL if it should use transfer->buffer. Only set for backends with
+ * USBI_CAP_SUPPORTS_BULK_IOVEC. */
+static inline const struct libusb_iovec *usbi_transfer_get_iovec(
+	struct usbi_transfer *transfer)
+{
+	return transfer->iov_bounce ? NULL : transfer->iov;
+}
+
 static inline void *usbi_transfer_get_os_priv(struct usbi_transfer *transfer)
 {
 	return ((unsigned char *)transfer) + sizeof(struct usbi_transfer)
@@ -478,10 +706,30 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 int usbi_sanitize_device(struct libusb_device *dev);
 void usbi_handle_disconnect(struct libusb_device_handle *handle);
 
+/* A thread waiting for a synchronous transfer to complete. The completion
+ * callback signals the waiter directly, so that threads waiting on other
+ * transfers are not woken up. */
+struct usbi_sync_waiter {
+	int completed;
+	usbi_cond_t cond;
+	struct list_head list;
+};
+
+void usbi_sync_waiter_init(struct usbi_sync_waiter *waiter);
+void usbi_sync_waiter_destroy(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter);
+void usbi_signal_sync_waiter(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter);
+int usbi_handle_events_sync_waiter(struct libusb_context *ctx,
+	struct usbi_sync_waiter *waiter);
+void LIBUSB_CALL usbi_sync_transfer_cb(struct libusb_transfer *transfer);
+
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *transfer);
 void usbi_signal_transfer_completion(struct usbi_transfer *transfer);
+void usbi_free_endpoint_stats(struct libusb_device *dev);
+void usbi_drain_transfer_callbacks(struct libusb_device_handle *dev_handle);
 
 int usbi_parse_descriptor(const unsigned char *source, const char *descriptor,
 	void *dest, int host_endian);
@@ -510,11 +758,26 @@ struct usbi_event_source {
 	struct libusb_pollfd pollfd;
 
 	struct list_head list;
+
+	/* index into the context's event_slots */
+	unsigned int slot;
 };
 
 int usbi_add_event_source(struct libusb_context *ctx, libusb_os_handle source, short events);
 void usbi_remove_event_source(struct libusb_context *ctx, libusb_os_handle source);
 
+/* Like the above, for the event source of a device handle, which goes to an
+ * event shard if any are running. */
+int usbi_add_handle_event_source(struct libusb_device_handle *dev_handle,
+	libusb_os_handle source, short events);
+void usbi_remove_handle_event_source(struct libusb_device_handle *dev_handle,
+	libusb_os_handle source);
+
+/* Keep the event shard of a device handle, if any, from handling its events
+ * while the handle is closed. Callers must hold the events_lock. */
+struct usbi_event_shard *usbi_lock_event_shard(struct libusb_device_handle *dev_handle);
+void usbi_unlock_event_shard(struct usbi_event_shard *shard);
+
 int usbi_handle_event_trigger(struct libusb_context *ctx);
 int usbi_handle_timer_trigger(struct libusb_context *ctx);
 
@@ -523,16 +786,40 @@ int usbi_signal_event(usbi_event_t *event);
 int usbi_clear_event(usbi_event_t *event);
 int usbi_destroy_event(usbi_event_t *event);
 
+/* Signal or clear the internal event of a context, counting it in the
+ * context's event counters. Callers must hold the event_data_lock. */
+static inline int usbi_signal_context_event(struct libusb_context *ctx)
+{
+	ctx->counters.event_signals++;
+	return usbi_signal_event(&ctx->event);
+}
+
+static inline int usbi_clear_context_event(struct libusb_context *ctx)
+{
+	ctx->counters.event_clears++;
+	return usbi_clear_event(&ctx->event);
+}
+
 usbi_timer_t usbi_create_timer(void);
 int usbi_arm_timer(usbi_timer_t timer, struct timeval *tv);
 int usbi_disarm_timer(usbi_timer_t timer);
 int usbi_destroy_timer(usbi_timer_t timer);
 
-/* OS event abstraction implements the following functions */
+/* OS event abstraction implements the following functions. usbi_alloc_event_data()
+ * refills event_data from the event slots, growing it only when it is too
+ * small, and is called with event_data_lock held. */
 int usbi_alloc_event_data(struct libusb_context *ctx);
 int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned int cnt,
 	unsigned int internal_cnt, int timeout_ms);
 
+/* The aggregated event fd returned by libusb_get_event_fd(). Except for
+ * usbi_destroy_event_fd(), these are called with event_data_lock held. */
+int usbi_create_event_fd(struct libusb_context *ctx);
+int usbi_event_fd_add_source(struct libusb_context *ctx, libusb_os_handle source,
+	short events);
+void usbi_event_fd_remove_source(struct libusb_context *ctx, libusb_os_handle source);
+void usbi_destroy_event_fd(struct libusb_context *ctx);
+
 /* device discovery */
 
 /* we traverse usbfs without knowing how many devices we are going to find.
@@ -973,6 +1260,11 @@ struct usbi_os_backend {
 	 *
 	 * This function gets called with the flying_transfers_lock locked!
 	 *
+	 * If your backend sets USBI_CAP_SUPPORTS_BULK_IOVEC, bulk transfers for
+	 * which usbi_transfer_get_iovec() returns non-NULL must be submitted
+	 * from those segments. Return LIBUSB_ERROR_NOT_SUPPORTED if that is not
+	 * possible, and the core will retry with a bounce buffer.
+	 *
 	 * Return:
 	 * - 0 on success
 	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
@@ -1085,10 +1377,103 @@ struct usbi_os_backend {
 	 * usbi_transfer_get_os_priv() on the appropriate usbi_transfer instance.
 	 */
 	size_t transfer_priv_size;
+
+	/* The operations below are optional and are placed last, so that
+	 * backends which do not provide them can leave them out of their
+	 * (positional) initializers. */
+
+	/* Perform a control transfer, blocking until it has completed. Optional.
+	 *
+	 * This is used by libusb_control_transfer() on handles for which
+	 * libusb_set_direct_sync_transfers() has been enabled, bypassing the
+	 * asynchronous transfer machinery and the event loop. The setup packet
+	 * fields are given in host-endian byte order.
+	 *
+	 * Return:
+	 * - the number of bytes transferred on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if this particular request cannot be
+	 *   performed this way, in which case the library falls back to an
+	 *   asynchronous transfer
+	 * - LIBUSB_ERROR_TIMEOUT if the transfer timed out
+	 * - LIBUSB_ERROR_PIPE if the control request was not supported by the
+	 *   device
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*sync_control_transfer)(struct libusb_device_handle *handle,
+		uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout);
+
+	/* Perform a bulk or interrupt transfer, blocking until it has
+	 * completed. Optional.
+	 *
+	 * This is used by libusb_bulk_transfer() and libusb_interrupt_transfer()
+	 * on handles for which libusb_set_direct_sync_transfers() has been
+	 * enabled. The direction is given by the endpoint address.
+	 *
+	 * Return:
+	 * - 0 on success, with transferred populated
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if this particular request cannot be
+	 *   performed this way, in which case the library falls back to an
+	 *   asynchronous transfer
+	 * - LIBUSB_ERROR_TIMEOUT if the transfer timed out
+	 * - LIBUSB_ERROR_PIPE if the endpoint halted
+	 * - LIBUSB_ERROR_OVERFLOW if the device offered more data
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*sync_bulk_transfer)(struct libusb_device_handle *handle,
+		unsigned char endpoint, unsigned char *data, int length,
+		int *transferred, unsigned int timeout);
 };
 
 extern const struct usbi_os_backend * const usbi_backend;
 
+static inline uint64_t usbi_get_monotonic_ns(void)
+{
+	struct timespec now;
+
+	if (usbi_backend->clock_gettime(USBI_CLOCK_MONOTONIC, &now))
+		return 0;
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* Lock and unlock a context lock, counting how often it is taken and how
+ * often it had to be waited for. Reading the clock twice per acquisition
+ * is too costly to always do, so the time the lock is held is only added
+ * up when timed, i.e. while statistics are enabled for the context. */
+static inline void usbi_mutex_lock_counted(usbi_mutex_t *mutex,
+	struct usbi_lock_counters *counters, int timed)
+{
+	if (usbi_mutex_trylock(mutex)) {
+		usbi_mutex_lock(mutex);
+		counters->contended++;
+	}
+	counters->acquisitions++;
+	counters->locked_at = timed ? usbi_get_monotonic_ns() : 0;
+}
+
+static inline void usbi_mutex_unlock_counted(usbi_mutex_t *mutex,
+	struct usbi_lock_counters *counters)
+{
+	if (counters->locked_at)
+		counters->held_ns += usbi_get_monotonic_ns() - counters->locked_at;
+	usbi_mutex_unlock(mutex);
+}
+
+#define usbi_lock_event_data(ctx)	\
+	usbi_mutex_lock_counted(&(ctx)->event_data_lock, \
+		&(ctx)->event_data_lock_counters, (ctx)->stats_enabled)
+#define usbi_unlock_event_data(ctx)	\
+	usbi_mutex_unlock_counted(&(ctx)->event_data_lock, &(ctx)->event_data_lock_counters)
+#define usbi_lock_flying_transfers(ctx)	\
+	usbi_mutex_lock_counted(&(ctx)->flying_transfers_lock, \
+		&(ctx)->flying_transfers_lock_counters, (ctx)->stats_enabled)
+#define usbi_unlock_flying_transfers(ctx)	\
+	usbi_mutex_unlock_counted(&(ctx)->flying_transfers_lock, \
+		&(ctx)->flying_transfers_lock_counters)
+
 extern const struct usbi_os_backend linux_usbfs_backend;
 extern const struct usbi_os_backend darwin_backend;
 extern const struct usbi_os_backend openbsd_backend;
@@ -22,6 +22,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <unistd.h>
 #ifdef USBI_USING_EVENTFD
 #include <sys/eventfd.h>
@@ -29,6 +30,9 @@
 #ifdef USBI_USING_TIMERFD
 #include <sys/timerfd.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "libusbi.h"
 
@@ -219,29 +223,113 @@ int usbi_destroy_timer(usbi_timer_t timer)
 #endif
 }
 
-int usbi_alloc_event_data(struct libusb_context *ctx)
+#ifdef HAVE_SYS_EPOLL_H
+static int event_fd_ctl(struct libusb_context *ctx, int op, int source,
+	short events)
 {
-	struct usbi_event_source *event_source;
-	struct pollfd *fds;
-	int i = 0;
+	struct epoll_event ev;
 
-	if (ctx->event_data) {
-		free(ctx->event_data);
-		ctx->event_data = NULL;
+	memset(&ev, 0, sizeof(ev));
+	if (events & POLLIN)
+		ev.events |= EPOLLIN;
+	if (events & POLLOUT)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = source;
+
+	if (epoll_ctl(ctx->event_fd, op, source, &ev) == -1) {
+		usbi_warn(ctx, "epoll_ctl failed for fd %d: %d", source, errno);
+		return LIBUSB_ERROR_OTHER;
 	}
 
-	fds = calloc(ctx->event_sources_cnt, sizeof(struct pollfd));
-	if (!fds)
-		return LIBUSB_ERROR_NO_MEM;
+	return 0;
+}
+#endif
+
+int usbi_create_event_fd(struct libusb_context *ctx)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct usbi_event_source *event_source;
+	int r;
+
+	ctx->event_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (ctx->event_fd == -1) {
+		usbi_err(ctx, "failed to create epoll fd: %d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
 
 	list_for_each_entry(event_source, &ctx->event_sources, list, struct usbi_event_source) {
-		struct libusb_pollfd *pollfd = &event_source->pollfd;
+		r = event_fd_ctl(ctx, EPOLL_CTL_ADD, event_source->pollfd.fd,
+			event_source->pollfd.events);
+		if (r) {
+			usbi_destroy_event_fd(ctx);
+			return r;
+		}
+	}
+
+	return 0;
+#else
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+int usbi_event_fd_add_source(struct libusb_context *ctx, int source,
+	short events)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	return event_fd_ctl(ctx, EPOLL_CTL_ADD, source, events);
+#else
+	UNUSED(ctx);
+	UNUSED(source);
+	UNUSED(events);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+void usbi_event_fd_remove_source(struct libusb_context *ctx, int source)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	event_fd_ctl(ctx, EPOLL_CTL_DEL, source, 0);
+#else
+	UNUSED(ctx);
+	UNUSED(source);
+#endif
+}
+
+void usbi_destroy_event_fd(struct libusb_context *ctx)
+{
+	if (ctx->event_fd == -1)
+		return;
+
+	if (close(ctx->event_fd) == -1)
+		usbi_warn(ctx, "failed to close epoll fd: %d", errno);
+	ctx->event_fd = -1;
+}
+
+int usbi_alloc_event_data(struct libusb_context *ctx)
+{
+	struct pollfd *fds = (struct pollfd *)ctx->event_data;
+	unsigned int i;
+
+	if (ctx->event_data_size < ctx->event_sources_cnt) {
+		unsigned int size = MAX(ctx->event_slots_size, ctx->event_sources_cnt);
+
+		fds = realloc(ctx->event_data, size * sizeof(struct pollfd));
+		if (!fds)
+			return LIBUSB_ERROR_NO_MEM;
+
+		ctx->event_data = fds;
+		ctx->event_data_size = size;
+		ctx->counters.event_data_reallocs++;
+	}
+
+	for (i = 0; i < ctx->event_sources_cnt; i++) {
+		struct libusb_pollfd *pollfd = &ctx->event_slots[i]->pollfd;
 		fds[i].fd = pollfd->fd;
 		fds[i].events = pollfd->events;
-		i++;
+		fds[i].revents = 0;
 	}
 
-	ctx->event_data = fds;
 	return 0;
 }
 
@@ -255,6 +343,7 @@ int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned in
 
 redo_poll:
 	usbi_dbg("poll() %u fds with timeout in %dms", cnt, timeout_ms);
+	ctx->counters.waits++;
 	r = poll(fds, nfds, timeout_ms);
 	usbi_dbg("poll() returned %d", r);
 	if (r == 0)
@@ -266,6 +355,7 @@ redo_poll:
 		return LIBUSB_ERROR_IO;
 	}
 
+	ctx->counters.wakeups++;
 	special_event = 0;
 
 	/* fds[0] is always the event */
@@ -282,7 +372,7 @@ redo_poll:
 		}
 
 		if (0 == --r)
-			goto handled;
+			goto no_backend_events;
 	}
 
 	/* on timer configurations, fds[1] is the timer */
@@ -298,15 +388,19 @@ redo_poll:
 		special_event = 1;
 
 		if (0 == --r)
-			goto handled;
+			goto no_backend_events;
 	}
 
 	r = usbi_backend->handle_events(ctx, fds + internal_cnt, cnt - internal_cnt, r);
 	if (r)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
+	goto handled;
 
+no_backend_events:
+	ctx->counters.empty_wakeups++;
 handled:
 	if (r == 0 && special_event) {
+		ctx->counters.repolls++;
 		timeout_ms = 0;
 		goto redo_poll;
 	}
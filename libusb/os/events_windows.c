@@ -140,11 +140,38 @@ int usbi_destroy_timer(usbi_timer_t timer)
 #endif
 }
 
+/* There is no Windows object which could be waited on in place of all
+ * others, so libusb_get_event_fd() is not supported. */
+int usbi_create_event_fd(struct libusb_context *ctx)
+{
+	UNUSED(ctx);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int usbi_event_fd_add_source(struct libusb_context *ctx, HANDLE source,
+	short events)
+{
+	UNUSED(ctx);
+	UNUSED(source);
+	UNUSED(events);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void usbi_event_fd_remove_source(struct libusb_context *ctx, HANDLE source)
+{
+	UNUSED(ctx);
+	UNUSED(source);
+}
+
+void usbi_destroy_event_fd(struct libusb_context *ctx)
+{
+	UNUSED(ctx);
+}
+
 int usbi_alloc_event_data(struct libusb_context *ctx)
 {
-	struct usbi_event_source *event_source;
 	HANDLE *handles = (HANDLE *)ctx->event_data;
-	int i = 0;
+	unsigned int i;
 
 	/* Windows is fundamentally different from other platforms in that it imposes a
 	 * rather small limit on the number of HANDLEs you can wait for. Since the Windows
@@ -157,14 +184,16 @@ int usbi_alloc_event_data(struct libusb_context *ctx)
 		if (!handles)
 			return LIBUSB_ERROR_NO_MEM;
 		ctx->event_data = handles;
+		ctx->event_data_size = MAXIMUM_WAIT_OBJECTS;
+		ctx->counters.event_data_reallocs++;
 	}
 
-	list_for_each_entry(event_source, &ctx->event_sources, list, struct usbi_event_source) {
+	for (i = 0; i < ctx->event_sources_cnt; i++) {
 		if (i == MAXIMUM_WAIT_OBJECTS) {
 			usbi_warn(ctx, "too many HANDLEs to wait on, some will be ignored!");
 			break;
 		}
-		handles[i++] = event_source->pollfd.fd;
+		handles[i] = ctx->event_slots[i]->pollfd.fd;
 	}
 
 	return 0;
@@ -182,6 +211,7 @@ int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned in
 	assert(internal_cnt <= cnt);
 
 	usbi_dbg("WaitForMultipleObjects() for %u HANDLEs with timeout in %dms", cnt, timeout_ms);
+	ctx->counters.waits++;
 	result = WaitForMultipleObjects((DWORD)cnt, handles, FALSE, (DWORD)timeout_ms);
 	usbi_dbg("WaitForMultipleObjects() returned %d", result);
 	if (result == WAIT_TIMEOUT)
@@ -192,6 +222,9 @@ int usbi_handle_events(struct libusb_context *ctx, void *event_data, unsigned in
 	}
 
 	result -= WAIT_OBJECT_0;
+	ctx->counters.wakeups++;
+	if (result < internal_cnt)
+		ctx->counters.empty_wakeups++;
 
 	/* handles[0] is always the event */
 	if (result == 0) {
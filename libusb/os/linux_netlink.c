@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #ifdef HAVE_ASM_TYPES_H
 #include <asm/types.h>
@@ -55,12 +56,38 @@
 
 #define KERNEL 1
 
+/* Maximum number of uevents read from the socket in one go */
+#define NETLINK_BATCH_SIZE	16
+
+/* Size of a uevent buffer (UEVENT_BUFFER_SIZE in the kernel) */
+#define NETLINK_MESSAGE_SIZE	2048
+
+/* Maximum number of entries in the LIBUSB_HOTPLUG_ALLOWLIST */
+#define NETLINK_ALLOWLIST_SIZE	16
+
+/* Longest "action@devpath" uevent header the socket filter looks through
+ * before giving up and leaving the message to be checked in user space */
+#define NETLINK_FILTER_MAX_HEADER	320
+
 static int linux_netlink_socket = -1;
 static usbi_event_t netlink_control_event = USBI_INVALID_EVENT;
 static pthread_t libusb_linux_event_thread;
 
 static void *linux_netlink_event_thread_main(void *arg);
 
+/* receive buffers for a batch of uevents. the parsed events point into these
+ * buffers, so they remain valid until the next batch is read.
+ * protected by linux_hotplug_lock */
+static char netlink_buffers[NETLINK_BATCH_SIZE][NETLINK_MESSAGE_SIZE + 1];
+
+/* optional list of vendor/product IDs whose arrival should be reported,
+ * read from the environment when the monitor is started */
+static struct {
+	uint16_t vendor_id;
+	uint16_t product_id;
+} netlink_allowlist[NETLINK_ALLOWLIST_SIZE];
+static int netlink_allowlist_len;
+
 struct sockaddr_nl snl = { .nl_family=AF_NETLINK, .nl_groups=KERNEL };
 
 static int set_fd_cloexec_nb (int fd)
@@ -90,6 +117,302 @@ static int set_fd_cloexec_nb (int fd)
 	return 0;
 }
 
+/* Parse LIBUSB_HOTPLUG_ALLOWLIST, a comma separated list of hexadecimal
+ * "vid:pid" pairs. When set, arrivals of devices that are not listed are
+ * ignored by the hotplug monitor. Departures are always reported. */
+static void linux_netlink_parse_allowlist(void)
+{
+	const char *env = getenv("LIBUSB_HOTPLUG_ALLOWLIST");
+	unsigned long vid, pid;
+	char *end;
+
+	netlink_allowlist_len = 0;
+	if (NULL == env)
+		return;
+
+	while ('\0' != *env) {
+		vid = strtoul(env, &end, 16);
+		if (end == env || ':' != *end)
+			break;
+		env = end + 1;
+		pid = strtoul(env, &end, 16);
+		if (end == env || vid > 0xffff || pid > 0xffff)
+			break;
+
+		if (netlink_allowlist_len == NETLINK_ALLOWLIST_SIZE) {
+			usbi_warn(NULL, "too many LIBUSB_HOTPLUG_ALLOWLIST entries, only using the first %d",
+				  NETLINK_ALLOWLIST_SIZE);
+			return;
+		}
+		netlink_allowlist[netlink_allowlist_len].vendor_id = (uint16_t) vid;
+		netlink_allowlist[netlink_allowlist_len].product_id = (uint16_t) pid;
+		netlink_allowlist_len++;
+
+		env = end;
+		if (',' == *env)
+			env++;
+		else if ('\0' != *env)
+			break;
+	}
+
+	if ('\0' != *env) {
+		usbi_warn(NULL, "malformed LIBUSB_HOTPLUG_ALLOWLIST, ignoring it");
+		netlink_allowlist_len = 0;
+	}
+}
+
+static int linux_netlink_allowed(uint16_t vendor_id, uint16_t product_id)
+{
+	int i;
+
+	if (0 == netlink_allowlist_len)
+		return 1;
+
+	for (i = 0 ; i < netlink_allowlist_len ; i++) {
+		if (netlink_allowlist[i].vendor_id == vendor_id &&
+		    netlink_allowlist[i].product_id == product_id)
+			return 1;
+	}
+
+	return 0;
+}
+
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+/* A small assembler for the classic BPF socket filter. Jumps to labels are
+ * emitted as BPF_JA instructions that are patched when the label is placed,
+ * so a label may be reused once it has been placed. */
+enum netlink_filter_label {
+	NETLINK_FILTER_ACCEPT,
+	NETLINK_FILTER_REJECT,
+	NETLINK_FILTER_SCAN,
+	NETLINK_FILTER_FOUND,
+	NETLINK_FILTER_DEVICE,
+	NETLINK_FILTER_DEVNAME,
+	NETLINK_FILTER_NEXT,
+};
+
+#define NETLINK_FILTER_PENDING	0xff
+
+struct netlink_filter {
+	struct sock_filter *insns;
+	unsigned int len;
+};
+
+static void netlink_filter_stmt(struct netlink_filter *f, unsigned short code,
+	unsigned int k)
+{
+	struct sock_filter insn = BPF_STMT(code, k);
+
+	f->insns[f->len++] = insn;
+}
+
+static void netlink_filter_jump(struct netlink_filter *f, unsigned short code,
+	unsigned int k, unsigned char jt, unsigned char jf)
+{
+	struct sock_filter insn = BPF_JUMP(code, k, jt, jf);
+
+	f->insns[f->len++] = insn;
+}
+
+static void netlink_filter_goto(struct netlink_filter *f,
+	enum netlink_filter_label label)
+{
+	netlink_filter_jump(f, BPF_JMP | BPF_JA, label, NETLINK_FILTER_PENDING, 0);
+}
+
+static void netlink_filter_label(struct netlink_filter *f,
+	enum netlink_filter_label label)
+{
+	unsigned int i;
+
+	for (i = 0 ; i < f->len ; i++) {
+		struct sock_filter *insn = &f->insns[i];
+
+		if (insn->code == (BPF_JMP | BPF_JA) && insn->jt == NETLINK_FILTER_PENDING &&
+		    insn->k == (unsigned int) label) {
+			insn->k = f->len - i - 1;
+			insn->jt = 0;
+		}
+	}
+}
+
+/* Emit a check that the message extends to at least X + end, accepting it
+ * otherwise. A load past the end of the message would abort the filter and
+ * drop the message, so every indirect load is guarded by one of these. X is
+ * preserved through scratch memory */
+static void netlink_filter_need(struct netlink_filter *f, unsigned int end)
+{
+	netlink_filter_stmt(f, BPF_STX, 0);
+	netlink_filter_stmt(f, BPF_MISC | BPF_TXA, 0);
+	netlink_filter_stmt(f, BPF_ALU | BPF_ADD | BPF_K, end);
+	netlink_filter_stmt(f, BPF_MISC | BPF_TAX, 0);
+	netlink_filter_stmt(f, BPF_LD | BPF_W | BPF_LEN, 0);
+	netlink_filter_jump(f, BPF_JMP | BPF_JGE | BPF_X, 0, 1, 0);
+	netlink_filter_goto(f, NETLINK_FILTER_ACCEPT);
+	netlink_filter_stmt(f, BPF_LDX | BPF_MEM, 0);
+}
+
+/* Emit a comparison of len bytes of the message at X + offset against str,
+ * jumping to label on mismatch */
+static void netlink_filter_expect(struct netlink_filter *f, unsigned int offset,
+	const char *str, unsigned int len, enum netlink_filter_label label)
+{
+	unsigned int size, value, i;
+
+	netlink_filter_need(f, offset + len);
+	while (len) {
+		size = len >= 4 ? 4 : (len >= 2 ? 2 : 1);
+		for (value = 0, i = 0 ; i < size ; i++)
+			value = (value << 8) | (unsigned char) str[i];
+
+		netlink_filter_stmt(f, BPF_LD | BPF_IND |
+			(size == 4 ? BPF_W : (size == 2 ? BPF_H : BPF_B)), offset);
+		netlink_filter_jump(f, BPF_JMP | BPF_JEQ | BPF_K, value, 1, 0);
+		netlink_filter_goto(f, label);
+
+		offset += size;
+		str += size;
+		len -= size;
+	}
+}
+
+#define NETLINK_FILTER_EXPECT(f, offset, str, label) \
+	netlink_filter_expect(f, offset, str, sizeof(str) - 1, label)
+
+/* Attach a socket filter that only lets through the uevents the hotplug code
+ * acts upon: "add" and "remove" of devices in the usb subsystem that have a
+ * device node, i.e. DEVTYPE=usb_device (interfaces and endpoints do not).
+ *
+ * The kernel formats uevents as "action@devpath\0ACTION=action\0
+ * DEVPATH=devpath\0SUBSYSTEM=subsystem\0..." so once the length h of the
+ * header is known, SUBSYSTEM= is found at offset 2 * h + 17. For arrivals,
+ * the PRODUCT= key is also located so that the allowlist can be applied.
+ *
+ * The filter only rejects messages it has positively identified. Anything
+ * with an unexpected layout, including messages too short for one of the
+ * checks, is passed on to be checked in user space. */
+static void linux_netlink_attach_filter(void)
+{
+	struct netlink_filter f;
+	struct sock_fprog prog;
+	char product[32];
+	int i, d, len;
+
+	f.len = 0;
+	f.insns = calloc(9 * NETLINK_FILTER_MAX_HEADER + 512 +
+			 NETLINK_ALLOWLIST_SIZE * 24, sizeof(*f.insns));
+	if (NULL == f.insns)
+		return;
+
+	/* only "add@..." and "remove@..." messages. X is 0 here so the
+	 * indirect loads are relative to the start of the message */
+	netlink_filter_stmt(&f, BPF_LDX | BPF_IMM, 0);
+	NETLINK_FILTER_EXPECT(&f, 0, "add@", NETLINK_FILTER_NEXT);
+	netlink_filter_goto(&f, NETLINK_FILTER_SCAN);
+	netlink_filter_label(&f, NETLINK_FILTER_NEXT);
+	NETLINK_FILTER_EXPECT(&f, 0, "remove@", NETLINK_FILTER_REJECT);
+
+	/* find the end of the header, leaving its length in X */
+	netlink_filter_label(&f, NETLINK_FILTER_SCAN);
+	netlink_filter_stmt(&f, BPF_LDX | BPF_IMM, 4);
+	for (i = 4 ; i < NETLINK_FILTER_MAX_HEADER ; i++) {
+		netlink_filter_stmt(&f, BPF_LD | BPF_W | BPF_LEN, 0);
+		netlink_filter_jump(&f, BPF_JMP | BPF_JGT | BPF_X, 0, 1, 0);
+		netlink_filter_goto(&f, NETLINK_FILTER_ACCEPT);
+		netlink_filter_stmt(&f, BPF_LD | BPF_B | BPF_IND, 0);
+		netlink_filter_jump(&f, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+		netlink_filter_goto(&f, NETLINK_FILTER_FOUND);
+		netlink_filter_stmt(&f, BPF_MISC | BPF_TXA, 0);
+		netlink_filter_stmt(&f, BPF_ALU | BPF_ADD | BPF_K, 1);
+		netlink_filter_stmt(&f, BPF_MISC | BPF_TAX, 0);
+	}
+	netlink_filter_goto(&f, NETLINK_FILTER_ACCEPT);
+
+	/* SUBSYSTEM=usb, as other subsystems are of no interest */
+	netlink_filter_label(&f, NETLINK_FILTER_FOUND);
+	netlink_filter_stmt(&f, BPF_MISC | BPF_TXA, 0);
+	netlink_filter_stmt(&f, BPF_ALU | BPF_LSH | BPF_K, 1);
+	netlink_filter_stmt(&f, BPF_ALU | BPF_ADD | BPF_K, 17);
+	netlink_filter_stmt(&f, BPF_MISC | BPF_TAX, 0);
+	NETLINK_FILTER_EXPECT(&f, 0, "SUBSYSTEM=", NETLINK_FILTER_ACCEPT);
+	NETLINK_FILTER_EXPECT(&f, 10, "usb\0", NETLINK_FILTER_REJECT);
+
+	/* usb_device follows with MAJOR=, interfaces have no device node.
+	 * Anything else, such as the SYNTH_UUID= of synthetic uevents, goes
+	 * to user space */
+	NETLINK_FILTER_EXPECT(&f, 14, "MAJOR=", NETLINK_FILTER_NEXT);
+	netlink_filter_goto(&f, NETLINK_FILTER_DEVICE);
+	netlink_filter_label(&f, NETLINK_FILTER_NEXT);
+	NETLINK_FILTER_EXPECT(&f, 14, "DEVTYPE=usb_interface\0", NETLINK_FILTER_ACCEPT);
+	netlink_filter_goto(&f, NETLINK_FILTER_REJECT);
+	netlink_filter_label(&f, NETLINK_FILTER_DEVICE);
+
+	if (0 == netlink_allowlist_len) {
+		netlink_filter_goto(&f, NETLINK_FILTER_ACCEPT);
+		goto out;
+	}
+
+	/* departures are always reported */
+	netlink_filter_stmt(&f, BPF_LD | BPF_B | BPF_ABS, 0);
+	netlink_filter_jump(&f, BPF_JMP | BPF_JEQ | BPF_K, 'r', 0, 1);
+	netlink_filter_goto(&f, NETLINK_FILTER_ACCEPT);
+
+	/* skip MAJOR=189 and MINOR=n (1 to 4 digits) */
+	NETLINK_FILTER_EXPECT(&f, 20, "189\0MINOR=", NETLINK_FILTER_ACCEPT);
+	netlink_filter_need(&f, 35);
+	for (d = 1 ; d <= 4 ; d++) {
+		netlink_filter_stmt(&f, BPF_LD | BPF_B | BPF_IND, 30 + d);
+		netlink_filter_jump(&f, BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 4);
+		netlink_filter_stmt(&f, BPF_MISC | BPF_TXA, 0);
+		netlink_filter_stmt(&f, BPF_ALU | BPF_ADD | BPF_K, 30 + d + 1);
+		netlink_filter_stmt(&f, BPF_MISC | BPF_TAX, 0);
+		netlink_filter_goto(&f, NETLINK_FILTER_DEVNAME);
+	}
+	netlink_filter_goto(&f, NETLINK_FILTER_ACCEPT);
+
+	/* DEVNAME=bus/usb/BBB/DDD, DEVTYPE=usb_device and an optional
+	 * DRIVER=usb precede PRODUCT= */
+	netlink_filter_label(&f, NETLINK_FILTER_DEVNAME);
+	NETLINK_FILTER_EXPECT(&f, 0, "DEVNAME=bus/usb/", NETLINK_FILTER_ACCEPT);
+	NETLINK_FILTER_EXPECT(&f, 23, "\0DEVTYPE=usb_device\0", NETLINK_FILTER_ACCEPT);
+	netlink_filter_stmt(&f, BPF_MISC | BPF_TXA, 0);
+	netlink_filter_stmt(&f, BPF_ALU | BPF_ADD | BPF_K, 43);
+	netlink_filter_stmt(&f, BPF_MISC | BPF_TAX, 0);
+	NETLINK_FILTER_EXPECT(&f, 0, "DRIVER=usb\0", NETLINK_FILTER_NEXT);
+	netlink_filter_stmt(&f, BPF_MISC | BPF_TXA, 0);
+	netlink_filter_stmt(&f, BPF_ALU | BPF_ADD | BPF_K, 11);
+	netlink_filter_stmt(&f, BPF_MISC | BPF_TAX, 0);
+	netlink_filter_label(&f, NETLINK_FILTER_NEXT);
+	NETLINK_FILTER_EXPECT(&f, 0, "PRODUCT=", NETLINK_FILTER_ACCEPT);
+
+	/* PRODUCT=vid/pid/bcdDevice, in lowercase hex without leading zeros */
+	for (i = 0 ; i < netlink_allowlist_len ; i++) {
+		len = snprintf(product, sizeof(product), "%x/%x/",
+			       netlink_allowlist[i].vendor_id,
+			       netlink_allowlist[i].product_id);
+		netlink_filter_expect(&f, 8, product, len, NETLINK_FILTER_NEXT);
+		netlink_filter_goto(&f, NETLINK_FILTER_ACCEPT);
+		netlink_filter_label(&f, NETLINK_FILTER_NEXT);
+	}
+
+	/* not on the allowlist, fall through */
+out:
+	netlink_filter_label(&f, NETLINK_FILTER_REJECT);
+	netlink_filter_stmt(&f, BPF_RET | BPF_K, 0);
+	netlink_filter_label(&f, NETLINK_FILTER_ACCEPT);
+	netlink_filter_stmt(&f, BPF_RET | BPF_K, 0xffffffff);
+
+	prog.len = f.len;
+	prog.filter = f.insns;
+	if (setsockopt(linux_netlink_socket, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)))
+		usbi_dbg("failed to attach netlink socket filter (%d)", errno);
+	else
+		usbi_dbg("attached %u instruction netlink socket filter", f.len);
+
+	free(f.insns);
+}
+#endif
+
 int linux_netlink_start_event_monitor(void)
 {
 	int socktype = SOCK_RAW;
@@ -129,6 +452,11 @@ int linux_netlink_start_event_monitor(void)
 	/* TODO -- add authentication */
 	/* setsockopt(linux_netlink_socket, SOL_SOCKET, SO_PASSCRED, &one, sizeof(one)); */
 
+	linux_netlink_parse_allowlist();
+#if defined(HAVE_LINUX_FILTER_H) && defined(SO_ATTACH_FILTER)
+	linux_netlink_attach_filter();
+#endif
+
 	ret = usbi_create_event(&netlink_control_event);
 	if (ret) {
 		usbi_err(NULL, "could not create netlink control event");
@@ -172,151 +500,236 @@ int linux_netlink_stop_event_monitor(void)
 	return LIBUSB_SUCCESS;
 }
 
-static const char *netlink_message_parse (const char *buffer, size_t len, const char *key)
+#define NETLINK_KEY_IS(name) \
+	(keylen == sizeof(name) - 1 && 0 == memcmp(key, name, keylen))
+
+/* parse parts of netlink message common to both libudev and the kernel.
+ * all the keys of interest are picked up in a single pass over the message */
+static int linux_netlink_parse(const char *buffer, size_t len,
+			       struct linux_hotplug_event *event)
 {
-	size_t keylen = strlen(key);
-	size_t offset;
+	const char *action = NULL, *subsystem = NULL, *busnum = NULL;
+	const char *devnum = NULL, *device = NULL, *devpath = NULL;
+	const char *devtype = NULL, *product = NULL;
+	const char *key, *value, *slash;
+	unsigned long tmp;
+	size_t offset, keylen;
+	char *end;
+
+	event->sys_name = NULL;
+	event->detached = 0;
+	event->busnum   = 0;
+	event->devaddr  = 0;
 
 	for (offset = 0 ; offset < len && '\0' != buffer[offset] ; offset += strlen(buffer + offset) + 1) {
-		if (0 == strncmp(buffer + offset, key, keylen) &&
-		    '=' == buffer[offset + keylen]) {
-			return buffer + offset + keylen + 1;
-		}
+		key = buffer + offset;
+		value = strchr(key, '=');
+		if (NULL == value)
+			continue;
+
+		keylen = value++ - key;
+		if (NETLINK_KEY_IS("ACTION"))
+			action = value;
+		else if (NETLINK_KEY_IS("SUBSYSTEM"))
+			subsystem = value;
+		else if (NETLINK_KEY_IS("BUSNUM"))
+			busnum = value;
+		else if (NETLINK_KEY_IS("DEVNUM"))
+			devnum = value;
+		else if (NETLINK_KEY_IS("DEVICE"))
+			device = value;
+		else if (NETLINK_KEY_IS("DEVPATH"))
+			devpath = value;
+		else if (NETLINK_KEY_IS("DEVTYPE"))
+			devtype = value;
+		else if (NETLINK_KEY_IS("PRODUCT"))
+			product = value;
 	}
 
-	return NULL;
-}
-
-/* parse parts of netlink message common to both libudev and the kernel */
-static int linux_netlink_parse(char *buffer, size_t len, int *detached, const char **sys_name,
-			       uint8_t *busnum, uint8_t *devaddr) {
-	const char *tmp;
-	int i;
-
-	errno = 0;
-
-	*sys_name = NULL;
-	*detached = 0;
-	*busnum   = 0;
-	*devaddr  = 0;
-
-	tmp = netlink_message_parse((const char *) buffer, len, "ACTION");
-	if (tmp == NULL)
+	if (NULL == action)
 		return -1;
-	if (0 == strcmp(tmp, "remove")) {
-		*detached = 1;
-	} else if (0 != strcmp(tmp, "add")) {
-		usbi_dbg("unknown device action %s", tmp);
+	if (0 == strcmp(action, "remove")) {
+		event->detached = 1;
+	} else if (0 != strcmp(action, "add")) {
+		usbi_dbg("unknown device action %s", action);
 		return -1;
 	}
 
 	/* check that this is a usb message */
-	tmp = netlink_message_parse(buffer, len, "SUBSYSTEM");
-	if (NULL == tmp || 0 != strcmp(tmp, "usb")) {
+	if (NULL == subsystem || 0 != strcmp(subsystem, "usb")) {
 		/* not usb. ignore */
 		return -1;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "BUSNUM");
-	if (NULL == tmp) {
+	/* interfaces and endpoints are of no interest */
+	if (NULL != devtype && 0 != strcmp(devtype, "usb_device"))
+		return -1;
+
+	/* in case the socket filter could not apply the allowlist */
+	if (!event->detached && NULL != product && netlink_allowlist_len) {
+		unsigned long vid, pid;
+
+		vid = strtoul(product, &end, 16);
+		if ('/' == *end) {
+			pid = strtoul(end + 1, &end, 16);
+			if ('/' == *end && !linux_netlink_allowed((uint16_t) vid, (uint16_t) pid)) {
+				usbi_dbg("ignoring arrival of %04lx:%04lx", vid, pid);
+				return -1;
+			}
+		}
+	}
+
+	if (NULL == busnum) {
 		/* no bus number. try "DEVICE" */
-		tmp = netlink_message_parse(buffer, len, "DEVICE");
-		if (NULL == tmp) {
+		if (NULL == device) {
 			/* not usb. ignore */
 			return -1;
 		}
-		
+
 		/* Parse a device path such as /dev/bus/usb/003/004 */
-		char *pLastSlash = (char*)strrchr(tmp,'/');
-		if(NULL == pLastSlash) {
+		slash = strrchr(device, '/');
+		if (NULL == slash || slash - device < 3) {
 			return -1;
 		}
 
-		*devaddr = strtoul(pLastSlash + 1, NULL, 10);
-		if (errno) {
-			errno = 0;
+		tmp = strtoul(slash + 1, &end, 10);
+		if (end == slash + 1 || tmp > 255)
 			return -1;
-		}
-		
-		*busnum = strtoul(pLastSlash - 3, NULL, 10);
-		if (errno) {
-			errno = 0;
+		event->devaddr = (uint8_t) tmp;
+
+		tmp = strtoul(slash - 3, &end, 10);
+		if (end != slash || tmp > 255)
 			return -1;
-		}
-		
+		event->busnum = (uint8_t) tmp;
+
 		return 0;
 	}
 
-	*busnum = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
-	if (errno) {
-		errno = 0;
+	tmp = strtoul(busnum, &end, 10);
+	if (end == busnum)
 		return -1;
-	}
+	event->busnum = (uint8_t)(tmp & 0xff);
 
-	tmp = netlink_message_parse(buffer, len, "DEVNUM");
-	if (NULL == tmp) {
+	if (NULL == devnum) {
 		return -1;
 	}
 
-	*devaddr = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
-	if (errno) {
-		errno = 0;
+	tmp = strtoul(devnum, &end, 10);
+	if (end == devnum)
 		return -1;
-	}
+	event->devaddr = (uint8_t)(tmp & 0xff);
 
-	tmp = netlink_message_parse(buffer, len, "DEVPATH");
-	if (NULL == tmp) {
+	if (NULL == devpath) {
 		return -1;
 	}
 
-	for (i = strlen(tmp) - 1 ; i ; --i) {
-		if ('/' ==tmp[i]) {
-			*sys_name = tmp + i + 1;
-			break;
-		}
-	}
+	slash = strrchr(devpath, '/');
+	if (NULL != slash && slash != devpath)
+		event->sys_name = slash + 1;
 
 	/* found a usb device */
 	return 0;
 }
 
-static int linux_netlink_read_message(void)
+/* read up to NETLINK_BATCH_SIZE uevents from the socket. returns the number
+ * of messages received, or -1 if there was nothing to read */
+static int linux_netlink_receive(struct sockaddr_nl *sources, size_t *lengths)
 {
-	unsigned char buffer[1024];
-	struct iovec iov = {.iov_base = buffer, .iov_len = sizeof(buffer)};
-	struct msghdr meh = { .msg_iov=&iov, .msg_iovlen=1,
-			     .msg_name=&snl, .msg_namelen=sizeof(snl) };
-	const char *sys_name = NULL;
-	uint8_t busnum, devaddr;
-	int detached, r;
-	size_t len;
-
-	/* read netlink message */
-	memset(buffer, 0, sizeof(buffer));
-	len = recvmsg(linux_netlink_socket, &meh, 0);
-	if (len < 32) {
+	struct iovec iov[NETLINK_BATCH_SIZE];
+	int count;
+#if defined(HAVE_RECVMMSG)
+	struct mmsghdr msgs[NETLINK_BATCH_SIZE];
+	int i;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0 ; i < NETLINK_BATCH_SIZE ; i++) {
+		iov[i].iov_base = netlink_buffers[i];
+		iov[i].iov_len = NETLINK_MESSAGE_SIZE;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &sources[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+	}
+
+	count = recvmmsg(linux_netlink_socket, msgs, NETLINK_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (count <= 0) {
+		if (errno != EAGAIN)
+			usbi_dbg("error receiving message from netlink (%d)", errno);
+		return -1;
+	}
+
+	for (i = 0 ; i < count ; i++)
+		lengths[i] = msgs[i].msg_len;
+#else
+	struct msghdr msg;
+	ssize_t len;
+
+	/* no recvmmsg(), drain the socket one message at a time instead */
+	for (count = 0 ; count < NETLINK_BATCH_SIZE ; count++) {
+		iov[count].iov_base = netlink_buffers[count];
+		iov[count].iov_len = NETLINK_MESSAGE_SIZE;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov[count];
+		msg.msg_iovlen = 1;
+		msg.msg_name = &sources[count];
+		msg.msg_namelen = sizeof(sources[count]);
+
+		len = recvmsg(linux_netlink_socket, &msg, MSG_DONTWAIT);
+		if (len < 0)
+			break;
+		lengths[count] = (size_t) len;
+	}
+
+	if (0 == count) {
 		if (errno != EAGAIN)
-			usbi_dbg("error recieving message from netlink");
+			usbi_dbg("error receiving message from netlink (%d)", errno);
 		return -1;
 	}
+#endif
 
-	/* TODO -- authenticate this message is from the kernel or udevd */
+	return count;
+}
 
-	r = linux_netlink_parse(buffer, len, &detached, &sys_name,
-				&busnum, &devaddr);
-	if (r)
-		return r;
+/* read a batch of messages and hand all the usb device events found in it
+ * to the contexts in one go. returns the number of messages read, or -1
+ * if there was nothing to read */
+static int linux_netlink_read_messages(void)
+{
+	struct sockaddr_nl sources[NETLINK_BATCH_SIZE];
+	struct linux_hotplug_event events[NETLINK_BATCH_SIZE];
+	size_t lengths[NETLINK_BATCH_SIZE];
+	int i, count, num_events = 0;
 
-	usbi_dbg("netlink hotplug found device busnum: %hhu, devaddr: %hhu, sys_name: %s, removed: %s",
-		 busnum, devaddr, sys_name, detached ? "yes" : "no");
+	count = linux_netlink_receive(sources, lengths);
+	if (count < 0)
+		return -1;
 
-	/* signal device is available (or not) to all contexts */
-	if (detached)
-		linux_device_disconnected(busnum, devaddr, sys_name);
-	else
-		linux_hotplug_enumerate(busnum, devaddr, sys_name);
+	for (i = 0 ; i < count ; i++) {
+		struct linux_hotplug_event *event = &events[num_events];
 
-	return 0;
+		if (lengths[i] < 32) {
+			usbi_dbg("ignoring short netlink message (%d bytes)", (int) lengths[i]);
+			continue;
+		}
+
+		/* TODO -- authenticate this message is from the kernel or udevd */
+
+		/* make sure the message is terminated, even if it was truncated */
+		netlink_buffers[i][lengths[i]] = '\0';
+		if (linux_netlink_parse(netlink_buffers[i], lengths[i], event))
+			continue;
+
+		usbi_dbg("netlink hotplug found device busnum: %hhu, devaddr: %hhu, sys_name: %s, removed: %s",
+			 event->busnum, event->devaddr, event->sys_name,
+			 event->detached ? "yes" : "no");
+		num_events++;
+	}
+
+	/* signal devices are available (or not) to all contexts */
+	if (num_events)
+		linux_hotplug_apply_events(events, num_events);
+
+	return count;
 }
 
 static void *linux_netlink_event_thread_main(void *arg)
@@ -343,7 +756,7 @@ static void *linux_netlink_event_thread_main(void *arg)
 		}
 		if (fds[1].revents & POLLIN) {
         		usbi_mutex_static_lock(&linux_hotplug_lock);
-	        	linux_netlink_read_message();
+	        	linux_netlink_read_messages();
 	        	usbi_mutex_static_unlock(&linux_hotplug_lock);
 		}
 	}
@@ -357,7 +770,7 @@ void linux_netlink_hotplug_poll(void)
 
 	usbi_mutex_static_lock(&linux_hotplug_lock);
 	do {
-		r = linux_netlink_read_message();
-	} while (r == 0);
+		r = linux_netlink_read_messages();
+	} while (r > 0);
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
 }
@@ -37,6 +37,9 @@
 #include <sys/types.h>
 #include <sys/utsname.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
 
 #include "libusbi.h"
 #include "linux_usbfs.h"
@@ -135,18 +138,64 @@ static int detach_kernel_driver_and_claim(struct libusb_device_handle *, int);
 static int linux_default_scan_devices (struct libusb_context *ctx);
 #endif
 
+/* Process-wide registry of enumerated devices.
+ *
+ * Every context gets its own libusb_device for each device, but what was
+ * read from sysfs or usbfs when the device was enumerated does not change
+ * until it is disconnected. It is read only once, into an entry of the
+ * registry, and the devices of all contexts share the entry. While the
+ * hotplug monitor is running the registry is kept up to date, so contexts
+ * created after the first one are populated from it without scanning the
+ * buses again. */
+struct linux_device_entry {
+	struct list_head list;
+	int refcnt;
+	int listed;
+	uint8_t busnum;
+	uint8_t devaddr;
+	char *sysfs_dir;
+	enum libusb_speed speed;
+	unsigned char *descriptors;
+	int descriptors_len;
+	struct timespec enumerated;
+};
+
+static struct list_head linux_device_registry = {
+	&linux_device_registry, &linux_device_registry
+};
+/* Protects the registry list and the reference counts of its entries */
+static usbi_mutex_static_t linux_device_registry_lock = USBI_MUTEX_INITIALIZER;
+
+static void linux_device_entry_unref(struct linux_device_entry *entry);
+static void linux_registry_flush(void);
+
 struct linux_device_priv {
+	struct linux_device_entry *entry;
+	/* the following point into or are copied from the entry */
 	char *sysfs_dir;
 	unsigned char *descriptors;
 	int descriptors_len;
+	struct timespec enumerated; /* when the device was initialized */
 	int active_config; /* cache val for !sysfs_can_relate_devices  */
 };
 
 struct linux_device_handle_priv {
 	int fd;
 	uint32_t caps;
+
+	/* Largest bulk URB the kernel could allocate, learned from ENOMEM
+	 * failures (0 if none so far), the number of successful submissions
+	 * since, and the number of ENOMEM failures. These are only hints for
+	 * sizing URBs, so concurrent submissions racing on them is harmless. */
+	int bulk_urb_limit;
+	unsigned int bulk_urb_limit_hits;
+	unsigned int bulk_urb_enomem;
 };
 
+/* After this many submissions with a lowered bulk URB limit, try larger
+ * URBs again in case the memory pressure has gone. */
+#define BULK_URB_LIMIT_RESET	1024
+
 enum reap_action {
 	NORMAL = 0,
 	/* submission failed after the first URB, so await cancellation/completion
@@ -176,14 +225,114 @@ struct linux_transfer_priv {
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* storage for the URB of single-URB transfers, so that control and
+	 * small bulk/interrupt transfers do not need to allocate one */
+	struct usbfs_urb single_urb;
+
+	/* alignment chunks of a scatter-gather write, see alloc_iovec_urbs() */
+	unsigned char *iov_bounce;
 };
 
+/* How long to wait for udev to create a device node, or to set up its
+ * permissions for a device that has just been enumerated */
+#define USBFS_NODE_WAIT_MS	200
+
+static int _usbfs_elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+
+	if (clock_gettime(monotonic_clkid, &now))
+		return 0;
+
+	return (int)((now.tv_sec - since->tv_sec) * 1000 +
+		     (now.tv_nsec - since->tv_nsec) / 1000000);
+}
+
+/* Keep trying to open a device node until it can be opened, the error is
+ * one that is not worth waiting for, or timeout_ms has passed. udev creates
+ * the node and then fixes up its ownership and mode, so the node may be
+ * missing at first and then inaccessible for a while; watch the directory
+ * for both. Returns the fd or -1 with errno set. */
+static int _wait_for_usbfs_node(const char *path, mode_t mode, int timeout_ms)
+{
+	struct timespec start;
+	int fd, remaining;
+#ifdef HAVE_SYS_INOTIFY_H
+	char dir[PATH_MAX];
+	char events[1024];
+	struct pollfd pollfd;
+	char *slash;
+	int saved_errno;
+
+	if (clock_gettime(monotonic_clkid, &start))
+		memset(&start, 0, sizeof(start));
+
+	pollfd.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (pollfd.fd < 0)
+		goto fallback;
+	pollfd.events = POLLIN;
+
+	/* watch the bus directory, or the usbfs root while the directory of a
+	 * new bus does not exist yet */
+	snprintf(dir, sizeof(dir), "%s", path);
+	slash = strrchr(dir, '/');
+	if (slash)
+		*slash = '\0';
+	if (inotify_add_watch(pollfd.fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0 &&
+	    inotify_add_watch(pollfd.fd, usbfs_path, IN_CREATE | IN_MOVED_TO) < 0) {
+		close(pollfd.fd);
+		goto fallback;
+	}
+
+	for (;;) {
+		/* (re)try only after the watch is in place so no change is missed */
+		fd = open(path, mode);
+		if (fd != -1 || (errno != ENOENT && errno != EACCES))
+			break;
+
+		remaining = timeout_ms - _usbfs_elapsed_ms(&start);
+		if (remaining <= 0 || poll(&pollfd, 1, remaining) <= 0) {
+			/* one last attempt before giving up */
+			fd = open(path, mode);
+			break;
+		}
+
+		/* drain the queued events, we only care that something changed */
+		while (read(pollfd.fd, events, sizeof(events)) > 0)
+			;
+		inotify_add_watch(pollfd.fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+	}
+
+	saved_errno = errno;
+	close(pollfd.fd);
+	errno = saved_errno;
+	return fd;
+
+fallback:
+#endif
+	/* no inotify, poll for the node every 10ms instead */
+	if (clock_gettime(monotonic_clkid, &start))
+		memset(&start, 0, sizeof(start));
+
+	for (;;) {
+		fd = open(path, mode);
+		if (fd != -1 || (errno != ENOENT && errno != EACCES))
+			return fd;
+
+		remaining = timeout_ms - _usbfs_elapsed_ms(&start);
+		if (remaining <= 0)
+			return fd;
+		usleep(MIN(remaining, 10) * 1000);
+	}
+}
+
 static int _get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct linux_device_priv *priv = (struct linux_device_priv *) dev->os_priv;
 	char path[PATH_MAX];
-	int fd;
-	int delay = 10000;
+	int fd, wait_ms;
 
 	if (usbdev_names)
 		snprintf(path, PATH_MAX, "%s/usbdev%d.%d",
@@ -196,18 +345,20 @@ static int _get_usbfs_fd(struct libusb_device *dev, mode_t mode, int silent)
 	if (fd != -1)
 		return fd; /* Success */
 
-	if (errno == ENOENT) {
-		if (!silent) 
-			usbi_err(ctx, "File doesn't exist, wait %d ms and try again", delay/1000);
-   
-		/* Wait 10ms for USB device path creation.*/
-		usleep(delay);
+	/* a node that is missing, or that is not accessible yet right after
+	 * the device was enumerated, is most likely still being set up by udev.
+	 * Once the device has been around for a while it is not going to
+	 * appear, so only wait for what is left of the window */
+	wait_ms = USBFS_NODE_WAIT_MS - _usbfs_elapsed_ms(&priv->enumerated);
+	if (!silent && wait_ms > 0 && (errno == ENOENT || errno == EACCES)) {
+		usbi_dbg("%s not ready (%s), waiting up to %d ms", path,
+			 strerror(errno), wait_ms);
 
-		fd = open(path, mode);
+		fd = _wait_for_usbfs_node(path, mode, wait_ms);
 		if (fd != -1)
 			return fd; /* Success */
 	}
-	
+
 	if (!silent) {
 		usbi_err(ctx, "libusb couldn't open USB device %s: %s",
 			 path, strerror(errno));
@@ -452,8 +603,10 @@ static int op_init(struct libusb_context *ctx)
 		r = linux_scan_devices(ctx);
 		if (r == LIBUSB_SUCCESS)
 			init_count++;
-		else if (init_count == 0)
+		else if (init_count == 0) {
 			linux_stop_event_monitor();
+			linux_registry_flush();
+		}
 	} else
 		usbi_err(ctx, "error starting hotplug event monitor");
 	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
@@ -468,6 +621,8 @@ static void op_exit(void)
 	if (!--init_count) {
 		/* tear down event handler */
 		(void)linux_stop_event_monitor();
+		/* without the monitor the registry can't be kept up to date */
+		linux_registry_flush();
 	}
 	usbi_mutex_static_unlock(&linux_hotplug_startstop_lock);
 }
@@ -490,16 +645,62 @@ static int linux_stop_event_monitor(void)
 #endif
 }
 
+/* Populates a context with the devices in the registry. Called with
+ * linux_hotplug_lock held, so no hotplug events are applied meanwhile. */
+static int linux_registry_scan_devices(struct libusb_context *ctx)
+{
+	struct linux_device_entry *entry, **entries;
+	int i, count = 0;
+
+	usbi_mutex_static_lock(&linux_device_registry_lock);
+	list_for_each_entry(entry, &linux_device_registry, list, struct linux_device_entry)
+		count++;
+	if (!count) {
+		usbi_mutex_static_unlock(&linux_device_registry_lock);
+		return LIBUSB_SUCCESS;
+	}
+	entries = malloc(count * sizeof(*entries));
+	if (!entries) {
+		usbi_mutex_static_unlock(&linux_device_registry_lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	/* parents are listed before their children */
+	i = 0;
+	list_for_each_entry(entry, &linux_device_registry, list, struct linux_device_entry) {
+		entry->refcnt++;
+		entries[i++] = entry;
+	}
+	usbi_mutex_static_unlock(&linux_device_registry_lock);
+
+	usbi_dbg("populating context from %d registered devices", count);
+	for (i = 0; i < count; i++) {
+		entry = entries[i];
+		if (linux_enumerate_device(ctx, entry->busnum, entry->devaddr,
+				entry->sysfs_dir))
+			usbi_dbg("failed to add registered device %d/%d",
+				 entry->busnum, entry->devaddr);
+		linux_device_entry_unref(entry);
+	}
+	free(entries);
+
+	return LIBUSB_SUCCESS;
+}
+
 static int linux_scan_devices(struct libusb_context *ctx)
 {
 	int ret;
 
 	usbi_mutex_static_lock(&linux_hotplug_lock);
 
+	/* once a context exists the hotplug monitor keeps the registry in
+	 * sync with the devices present */
+	if (init_count > 0)
+		ret = linux_registry_scan_devices(ctx);
+	else
 #if defined(USE_UDEV)
-	ret = linux_udev_scan_devices(ctx);
+		ret = linux_udev_scan_devices(ctx);
 #else
-	ret = linux_default_scan_devices(ctx);
+		ret = linux_default_scan_devices(ctx);
 #endif
 
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
@@ -869,33 +1070,161 @@ static int usbfs_get_active_config(struct libusb_device *dev, int fd)
 	return active_config;
 }
 
-static int initialize_device(struct libusb_device *dev, uint8_t busnum,
+static void linux_device_entry_unref(struct linux_device_entry *entry)
+{
+	int refcnt;
+
+	usbi_mutex_static_lock(&linux_device_registry_lock);
+	refcnt = --entry->refcnt;
+	usbi_mutex_static_unlock(&linux_device_registry_lock);
+
+	if (refcnt)
+		return;
+
+	free(entry->descriptors);
+	free(entry->sysfs_dir);
+	free(entry);
+}
+
+static int linux_device_entry_matches(struct linux_device_entry *entry,
+	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir)
+{
+	if (entry->busnum != busnum || entry->devaddr != devaddr)
+		return 0;
+	if (!entry->sysfs_dir || !sysfs_dir)
+		return !entry->sysfs_dir && !sysfs_dir;
+	return !strcmp(entry->sysfs_dir, sysfs_dir);
+}
+
+/* Returns a referenced registry entry for the device, or NULL if it has
+ * not been enumerated yet */
+static struct linux_device_entry *linux_registry_lookup(uint8_t busnum,
 	uint8_t devaddr, const char *sysfs_dir)
+{
+	struct linux_device_entry *entry, *found = NULL;
+
+	usbi_mutex_static_lock(&linux_device_registry_lock);
+	list_for_each_entry(entry, &linux_device_registry, list, struct linux_device_entry) {
+		if (linux_device_entry_matches(entry, busnum, devaddr, sysfs_dir)) {
+			entry->refcnt++;
+			found = entry;
+			break;
+		}
+	}
+	usbi_mutex_static_unlock(&linux_device_registry_lock);
+
+	return found;
+}
+
+/* Lists a newly read entry, once the device it was read for has been
+ * completely enumerated */
+static void linux_registry_add(struct linux_device_entry *entry)
+{
+	struct linux_device_entry *it;
+
+	usbi_mutex_static_lock(&linux_device_registry_lock);
+	if (!entry->listed) {
+		list_for_each_entry(it, &linux_device_registry, list, struct linux_device_entry) {
+			if (linux_device_entry_matches(it, entry->busnum,
+					entry->devaddr, entry->sysfs_dir))
+				goto out;
+		}
+		entry->refcnt++;
+		entry->listed = 1;
+		list_add_tail(&entry->list, &linux_device_registry);
+	}
+out:
+	usbi_mutex_static_unlock(&linux_device_registry_lock);
+}
+
+static void linux_registry_remove(uint8_t busnum, uint8_t devaddr)
+{
+	struct linux_device_entry *entry, *found = NULL;
+
+	usbi_mutex_static_lock(&linux_device_registry_lock);
+	list_for_each_entry(entry, &linux_device_registry, list, struct linux_device_entry) {
+		if (entry->busnum == busnum && entry->devaddr == devaddr) {
+			list_del(&entry->list);
+			entry->listed = 0;
+			found = entry;
+			break;
+		}
+	}
+	usbi_mutex_static_unlock(&linux_device_registry_lock);
+
+	if (found)
+		linux_device_entry_unref(found);
+}
+
+static void linux_registry_flush(void)
+{
+	struct linux_device_entry *entry;
+
+	usbi_mutex_static_lock(&linux_device_registry_lock);
+	while (!list_empty(&linux_device_registry)) {
+		entry = list_first_entry(&linux_device_registry,
+			struct linux_device_entry, list);
+		list_del(&entry->list);
+		entry->listed = 0;
+		usbi_mutex_static_unlock(&linux_device_registry_lock);
+		linux_device_entry_unref(entry);
+		usbi_mutex_static_lock(&linux_device_registry_lock);
+	}
+	usbi_mutex_static_unlock(&linux_device_registry_lock);
+}
+
+static void linux_device_attach_entry(struct libusb_device *dev,
+	struct linux_device_entry *entry)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+
+	priv->entry = entry;
+	priv->sysfs_dir = entry->sysfs_dir;
+	priv->descriptors = entry->descriptors;
+	priv->descriptors_len = entry->descriptors_len;
+	priv->enumerated = entry->enumerated;
+	dev->speed = entry->speed;
+}
+
+/* Reads the speed and descriptors of a device which is not in the
+ * registry yet into a new entry, and attaches it to the device */
+static int read_device_entry(struct libusb_device *dev, const char *sysfs_dir)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
 	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct linux_device_entry *entry;
 	int descriptors_size = 512; /* Begin with a 1024 byte alloc */
 	int fd, speed;
 	ssize_t r;
 
-	dev->bus_number = busnum;
-	dev->device_address = devaddr;
+	entry = calloc(1, sizeof(*entry));
+	if (!entry)
+		return LIBUSB_ERROR_NO_MEM;
+	entry->refcnt = 1;
+	entry->busnum = dev->bus_number;
+	entry->devaddr = dev->device_address;
+	clock_gettime(monotonic_clkid, &entry->enumerated);
+
+	/* the device owns the entry from here on, and needs the sysfs
+	 * directory and enumeration time to read the descriptors */
+	linux_device_attach_entry(dev, entry);
 
 	if (sysfs_dir) {
-		priv->sysfs_dir = malloc(strlen(sysfs_dir) + 1);
-		if (!priv->sysfs_dir)
+		entry->sysfs_dir = malloc(strlen(sysfs_dir) + 1);
+		if (!entry->sysfs_dir)
 			return LIBUSB_ERROR_NO_MEM;
-		strcpy(priv->sysfs_dir, sysfs_dir);
+		strcpy(entry->sysfs_dir, sysfs_dir);
+		priv->sysfs_dir = entry->sysfs_dir;
 
 		/* Note speed can contain 1.5, in this case __read_sysfs_attr
 		   will stop parsing at the '.' and return 1 */
 		speed = __read_sysfs_attr(DEVICE_CTX(dev), sysfs_dir, "speed");
 		if (speed >= 0) {
 			switch (speed) {
-			case     1: dev->speed = LIBUSB_SPEED_LOW; break;
-			case    12: dev->speed = LIBUSB_SPEED_FULL; break;
-			case   480: dev->speed = LIBUSB_SPEED_HIGH; break;
-			case  5000: dev->speed = LIBUSB_SPEED_SUPER; break;
+			case     1: entry->speed = LIBUSB_SPEED_LOW; break;
+			case    12: entry->speed = LIBUSB_SPEED_FULL; break;
+			case   480: entry->speed = LIBUSB_SPEED_HIGH; break;
+			case  5000: entry->speed = LIBUSB_SPEED_SUPER; break;
 			default:
 				usbi_warn(DEVICE_CTX(dev), "Unknown device speed: %d Mbps", speed);
 			}
@@ -912,36 +1241,61 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 
 	do {
 		descriptors_size *= 2;
-		priv->descriptors = usbi_reallocf(priv->descriptors,
-						  descriptors_size);
-		if (!priv->descriptors) {
+		entry->descriptors = usbi_reallocf(entry->descriptors,
+						   descriptors_size);
+		if (!entry->descriptors) {
 			close(fd);
 			return LIBUSB_ERROR_NO_MEM;
 		}
 		/* usbfs has holes in the file */
 		if (!sysfs_has_descriptors) {
-			memset(priv->descriptors + priv->descriptors_len,
-			       0, descriptors_size - priv->descriptors_len);
+			memset(entry->descriptors + entry->descriptors_len,
+			       0, descriptors_size - entry->descriptors_len);
 		}
-		r = read(fd, priv->descriptors + priv->descriptors_len,
-			 descriptors_size - priv->descriptors_len);
+		r = read(fd, entry->descriptors + entry->descriptors_len,
+			 descriptors_size - entry->descriptors_len);
 		if (r < 0) {
 			usbi_err(ctx, "read descriptor failed ret=%d errno=%d",
 				 fd, errno);
 			close(fd);
 			return LIBUSB_ERROR_IO;
 		}
-		priv->descriptors_len += r;
-	} while (priv->descriptors_len == descriptors_size);
+		entry->descriptors_len += r;
+	} while (entry->descriptors_len == descriptors_size);
 
 	close(fd);
 
-	if (priv->descriptors_len < DEVICE_DESC_LENGTH) {
+	if (entry->descriptors_len < DEVICE_DESC_LENGTH) {
 		usbi_err(ctx, "short descriptor read (%d)",
-			 priv->descriptors_len);
+			 entry->descriptors_len);
 		return LIBUSB_ERROR_IO;
 	}
 
+	linux_device_attach_entry(dev, entry);
+	return LIBUSB_SUCCESS;
+}
+
+static int initialize_device(struct libusb_device *dev, uint8_t busnum,
+	uint8_t devaddr, const char *sysfs_dir)
+{
+	struct linux_device_priv *priv = _device_priv(dev);
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+	struct linux_device_entry *entry;
+	int fd;
+	ssize_t r;
+
+	dev->bus_number = busnum;
+	dev->device_address = devaddr;
+
+	entry = linux_registry_lookup(busnum, devaddr, sysfs_dir);
+	if (entry) {
+		linux_device_attach_entry(dev, entry);
+	} else {
+		r = read_device_entry(dev, sysfs_dir);
+		if (r < 0)
+			return r;
+	}
+
 	if (sysfs_can_relate_devices)
 		return LIBUSB_SUCCESS;
 
@@ -1095,6 +1449,8 @@ int linux_enumerate_device(struct libusb_context *ctx,
 	r = linux_get_parent_info(dev, sysfs_dir);
 	if (r < 0)
 		goto out;
+
+	linux_registry_add(_device_priv(dev)->entry);
 out:
 	if (r < 0)
 		libusb_unref_device(dev);
@@ -1115,20 +1471,51 @@ void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_na
 	usbi_mutex_static_unlock(&active_contexts_lock);
 }
 
-void linux_device_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys_name)
+static void linux_disconnect_device(struct libusb_context *ctx,
+	uint8_t busnum, uint8_t devaddr)
 {
-	struct libusb_context *ctx;
 	struct libusb_device *dev;
 	unsigned long session_id = busnum << 8 | devaddr;
 
+	dev = usbi_get_device_by_session_id (ctx, session_id);
+	if (NULL != dev) {
+		usbi_disconnect_device (dev);
+		libusb_unref_device(dev);
+	} else {
+		usbi_dbg("device not found for session %x", session_id);
+	}
+}
+
+void linux_device_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys_name)
+{
+	struct libusb_context *ctx;
+
+	linux_registry_remove(busnum, devaddr);
+
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
-		dev = usbi_get_device_by_session_id (ctx, session_id);
-		if (NULL != dev) {
-			usbi_disconnect_device (dev);
-			libusb_unref_device(dev);
-		} else {
-			usbi_dbg("device not found for session %x", session_id);
+		linux_disconnect_device(ctx, busnum, devaddr);
+	}
+	usbi_mutex_static_unlock(&active_contexts_lock);
+}
+
+/* Apply a batch of hotplug events, in order, to all contexts while holding
+ * the context list lock only once */
+void linux_hotplug_apply_events(const struct linux_hotplug_event *events, int count)
+{
+	struct libusb_context *ctx;
+	int i;
+
+	usbi_mutex_static_lock(&active_contexts_lock);
+	for (i = 0; i < count; i++) {
+		if (events[i].detached)
+			linux_registry_remove(events[i].busnum, events[i].devaddr);
+		list_for_each_entry(ctx, &active_contexts_list, list, struct libusb_context) {
+			if (events[i].detached)
+				linux_disconnect_device(ctx, events[i].busnum, events[i].devaddr);
+			else
+				linux_enumerate_device(ctx, events[i].busnum,
+					events[i].devaddr, events[i].sys_name);
 		}
 	}
 	usbi_mutex_static_unlock(&active_contexts_lock);
@@ -1319,13 +1706,22 @@ static int op_open(struct libusb_device_handle *handle)
 			hpriv->caps |= USBFS_CAP_BULK_CONTINUATION;
 	}
 
-	return usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	hpriv->bulk_urb_limit = 0;
+	hpriv->bulk_urb_limit_hits = 0;
+	hpriv->bulk_urb_enomem = 0;
+
+	return usbi_add_handle_event_source(handle, hpriv->fd, POLLOUT);
 }
 
 static void op_close(struct libusb_device_handle *dev_handle)
 {
-	int fd = _device_handle_priv(dev_handle)->fd;
-	usbi_remove_event_source(HANDLE_CTX(dev_handle), fd);
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(dev_handle);
+	int fd = hpriv->fd;
+
+	if (hpriv->bulk_urb_enomem)
+		usbi_dbg("bulk URBs limited to %d bytes after %u ENOMEM failures",
+			hpriv->bulk_urb_limit, hpriv->bulk_urb_enomem);
+	usbi_remove_handle_event_source(dev_handle, fd);
 	close(fd);
 }
 
@@ -1705,10 +2101,27 @@ static int op_release_interface(struct libusb_device_handle *handle, int iface)
 static void op_destroy_device(struct libusb_device *dev)
 {
 	struct linux_device_priv *priv = _device_priv(dev);
-	if (priv->descriptors)
-		free(priv->descriptors);
-	if (priv->sysfs_dir)
-		free(priv->sysfs_dir);
+	if (priv->entry)
+		linux_device_entry_unref(priv->entry);
+}
+
+static struct usbfs_urb *alloc_urbs(struct linux_transfer_priv *tpriv, int num_urbs)
+{
+	if (num_urbs == 1) {
+		memset(&tpriv->single_urb, 0, sizeof(tpriv->single_urb));
+		return &tpriv->single_urb;
+	}
+
+	return calloc(num_urbs, sizeof(struct usbfs_urb));
+}
+
+static void free_urbs(struct linux_transfer_priv *tpriv)
+{
+	if (tpriv->urbs != &tpriv->single_urb)
+		free(tpriv->urbs);
+	tpriv->urbs = NULL;
+	free(tpriv->iov_bounce);
+	tpriv->iov_bounce = NULL;
 }
 
 /* URBs are discarded in reverse order of submission to avoid races. */
@@ -1762,17 +2175,189 @@ static void free_iso_urbs(struct linux_transfer_priv *tpriv)
 	tpriv->iso_urbs = NULL;
 }
 
+/* Size of the URBs to split a bulk transfer into when the kernel needs
+ * them split (no scatter-gather) or contiguous memory for each of them. */
+static int bulk_urb_length(struct libusb_device_handle *handle)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+
+	if (!(hpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM))
+		return MAX_BULK_BUFFER_LENGTH;
+	if (hpriv->bulk_urb_limit)
+		return hpriv->bulk_urb_limit;
+
+	/* SuperSpeed endpoints move up to 16 bursts of 1024 byte packets per
+	 * service interval, which 16k URBs keep barely busy */
+	if (handle->dev->speed >= LIBUSB_SPEED_SUPER)
+		return MAX_BULK_URB_LENGTH_SS;
+	return MAX_BULK_URB_LENGTH_HS;
+}
+
+/* Record that the kernel could not allocate a bulk URB of the given length.
+ * Returns 1 if URBs for this handle will be smaller from now on, or 0 if
+ * they are already as small as they get or must not be made smaller. */
+static int lower_bulk_urb_limit(struct libusb_device_handle *handle,
+	int failed_length, int is_out)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	int limit;
+
+	hpriv->bulk_urb_enomem++;
+	usbi_lock_event_data(ctx);
+	ctx->counters.bulk_urb_enomem++;
+	usbi_unlock_event_data(ctx);
+
+	/* without bulk continuation, an IN transfer split into several URBs
+	 * does not end at a short packet, so keep those in one piece */
+	if (!is_out && !(hpriv->caps & USBFS_CAP_BULK_CONTINUATION))
+		return 0;
+
+	/* halve, keeping URBs multiples of every bulk max packet size */
+	limit = (failed_length / 2) & ~(MAX_BULK_BUFFER_LENGTH - 1);
+	if (limit < MAX_BULK_BUFFER_LENGTH)
+		return 0;
+	if (hpriv->bulk_urb_limit && limit >= hpriv->bulk_urb_limit)
+		return 1;
+
+	hpriv->bulk_urb_limit = limit;
+	hpriv->bulk_urb_limit_hits = 0;
+	return 1;
+}
+
+/* Every URB of a scatter-gather write but the last must be a multiple of
+ * the endpoint's max packet size, or the device would see a short packet
+ * and end the transfer early. 1024 is a multiple of every bulk max packet
+ * size, so the segments are split on multiples of it. The bytes that do
+ * not fill a multiple at the end of a segment are merged with the start of
+ * the next segment(s) into a chunk of the bounce area. */
+#define IOVEC_URB_ALIGN		1024
+
+/* Lay out the URBs of a scatter-gather transfer. Returns the number of URBs
+ * and stores the number of bounce chunks used in num_chunks. If urbs is
+ * NULL, only counts. */
+static int layout_iovec_urbs(struct usbi_transfer *itransfer,
+	int max_urb_len, struct usbfs_urb *urbs, unsigned char *bounce,
+	int *num_chunks)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	const struct libusb_iovec *iov = usbi_transfer_get_iovec(itransfer);
+	unsigned char *chunk = NULL;
+	int remaining = transfer->length;
+	int chunk_len = 0;
+	int num_urbs = 0;
+	int i;
+
+	*num_chunks = 0;
+	for (i = 0; i < itransfer->iovcnt && remaining > 0; i++) {
+		unsigned char *base = iov[i].iov_base;
+		int len = MIN(iov[i].iov_len, remaining);
+
+		remaining -= len;
+
+		if (chunk_len) {
+			int take = MIN(IOVEC_URB_ALIGN - chunk_len, len);
+
+			if (urbs)
+				memcpy(chunk + chunk_len, base, take);
+			chunk_len += take;
+			base += take;
+			len -= take;
+			if (chunk_len < IOVEC_URB_ALIGN)
+				continue;
+
+			if (urbs) {
+				urbs[num_urbs].buffer = chunk;
+				urbs[num_urbs].buffer_length = chunk_len;
+			}
+			num_urbs++;
+			chunk_len = 0;
+		}
+
+		while (len >= IOVEC_URB_ALIGN) {
+			int urb_len = MIN(len, max_urb_len) & ~(IOVEC_URB_ALIGN - 1);
+
+			if (urbs) {
+				urbs[num_urbs].buffer = base;
+				urbs[num_urbs].buffer_length = urb_len;
+			}
+			num_urbs++;
+			base += urb_len;
+			len -= urb_len;
+		}
+
+		if (len) {
+			if (urbs) {
+				chunk = bounce + (*num_chunks * IOVEC_URB_ALIGN);
+				memcpy(chunk, base, len);
+			}
+			(*num_chunks)++;
+			chunk_len = len;
+		}
+	}
+
+	if (chunk_len) {
+		if (urbs) {
+			urbs[num_urbs].buffer = chunk;
+			urbs[num_urbs].buffer_length = chunk_len;
+		}
+		num_urbs++;
+	}
+
+	/* zero length transfer */
+	if (num_urbs == 0)
+		num_urbs = 1;
+
+	return num_urbs;
+}
+
+static int alloc_iovec_urbs(struct usbi_transfer *itransfer, int max_urb_len)
+{
+	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
+	struct usbfs_urb *urbs;
+	unsigned char *bounce = NULL;
+	int num_urbs, num_chunks;
+
+	num_urbs = layout_iovec_urbs(itransfer, max_urb_len, NULL, NULL,
+		&num_chunks);
+	usbi_dbg("need %d urbs and %d bounce chunks for %d segments", num_urbs,
+		num_chunks, itransfer->iovcnt);
+
+	if (num_chunks) {
+		bounce = malloc(num_chunks * IOVEC_URB_ALIGN);
+		if (!bounce)
+			return LIBUSB_ERROR_NO_MEM;
+	}
+
+	urbs = alloc_urbs(tpriv, num_urbs);
+	if (!urbs) {
+		free(bounce);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	layout_iovec_urbs(itransfer, max_urb_len, urbs, bounce, &num_chunks);
+	tpriv->urbs = urbs;
+	tpriv->num_urbs = num_urbs;
+	tpriv->iov_bounce = bounce;
+	return 0;
+}
+
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
 	struct linux_transfer_priv *tpriv = usbi_transfer_get_os_priv(itransfer);
 	struct linux_device_handle_priv *dpriv =
 		_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb *urbs;
 	int is_out = (transfer->endpoint & LIBUSB_ENDPOINT_DIR_MASK)
 		== LIBUSB_ENDPOINT_OUT;
+	const struct libusb_iovec *iov = usbi_transfer_get_iovec(itransfer);
 	int bulk_buffer_len, use_bulk_continuation;
+	int urb_limit;
+	int num_urbs;
 	int r;
 	int i;
 
@@ -1780,6 +2365,11 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			!(dpriv->caps & USBFS_CAP_ZERO_PACKET))
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 
+	/* reads would need the data received into the alignment chunks copied
+	 * out at completion; let the core bounce those instead */
+	if (iov && !is_out)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
 	/*
 	 * Older versions of usbfs place a 16kb limit on bulk URBs. We work
 	 * around this by splitting large transfers into 16k blocks, and then
@@ -1798,20 +2388,36 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 	 * Last, there is the issue of short-transfers when splitting, for
 	 * short split-transfers to work reliable USBFS_CAP_BULK_CONTINUATION
 	 * is needed, but this is not always available.
+	 *
+	 * Where the kernel has no URB size limit but needs contiguous memory,
+	 * the URB size is picked from the device speed and lowered for the
+	 * handle whenever a submission fails with ENOMEM (see bulk_urb_length()
+	 * and lower_bulk_urb_limit()). If the first URB fails that way, the
+	 * transfer is split again with smaller URBs and resubmitted. Without
+	 * bulk continuation, IN transfers are never split because of that.
 	 */
-	if (dpriv->caps & USBFS_CAP_BULK_SCATTER_GATHER) {
+retry:
+	urb_limit = dpriv->bulk_urb_limit;
+	if (!is_out && !(dpriv->caps & USBFS_CAP_BULK_CONTINUATION))
+		urb_limit = 0;
+
+	if ((dpriv->caps & USBFS_CAP_BULK_SCATTER_GATHER) && !urb_limit) {
 		/* Good! Just submit everything in one go */
 		bulk_buffer_len = transfer->length ? transfer->length : 1;
 		use_bulk_continuation = 0;
 	} else if (dpriv->caps & USBFS_CAP_BULK_CONTINUATION) {
 		/* Split the transfers and use bulk-continuation to
 		   avoid issues with short-transfers */
-		bulk_buffer_len = MAX_BULK_BUFFER_LENGTH;
+		bulk_buffer_len = bulk_urb_length(transfer->dev_handle);
 		use_bulk_continuation = 1;
 	} else if (dpriv->caps & USBFS_CAP_NO_PACKET_SIZE_LIM) {
 		/* Don't split, assume the kernel can alloc the buffer
-		   (otherwise the submit will fail with -ENOMEM) */
-		bulk_buffer_len = transfer->length ? transfer->length : 1;
+		   (otherwise the submit will fail with -ENOMEM and we split
+		   from then on) */
+		if (urb_limit)
+			bulk_buffer_len = urb_limit;
+		else
+			bulk_buffer_len = transfer->length ? transfer->length : 1;
 		use_bulk_continuation = 0;
 	} else {
 		/* Bad, splitting without bulk-continuation, short transfers
@@ -1822,22 +2428,32 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		use_bulk_continuation = 0;
 	}
 
-	int num_urbs = transfer->length / bulk_buffer_len;
-	int last_urb_partial = 0;
-
-	if (transfer->length == 0) {
-		num_urbs = 1;
-	} else if ((transfer->length % bulk_buffer_len) > 0) {
-		last_urb_partial = 1;
-		num_urbs++;
+	if (iov) {
+		r = alloc_iovec_urbs(itransfer, bulk_buffer_len);
+		if (r < 0)
+			return r;
+		urbs = tpriv->urbs;
+		num_urbs = tpriv->num_urbs;
+	} else {
+		num_urbs = transfer->length / bulk_buffer_len;
+		if (transfer->length == 0 || (transfer->length % bulk_buffer_len) > 0)
+			num_urbs++;
+		usbi_dbg("need %d urbs of up to %d bytes for new transfer with length %d",
+			num_urbs, bulk_buffer_len, transfer->length);
+		urbs = alloc_urbs(tpriv, num_urbs);
+		if (!urbs)
+			return LIBUSB_ERROR_NO_MEM;
+		tpriv->urbs = urbs;
+		tpriv->num_urbs = num_urbs;
+
+		for (i = 0; i < num_urbs; i++) {
+			urbs[i].buffer = transfer->buffer + (i * bulk_buffer_len);
+			if (i == num_urbs - 1)
+				urbs[i].buffer_length = transfer->length - (i * bulk_buffer_len);
+			else
+				urbs[i].buffer_length = bulk_buffer_len;
+		}
 	}
-	usbi_dbg("need %d urbs for new transfer with length %d", num_urbs,
-		transfer->length);
-	urbs = calloc(num_urbs, sizeof(struct usbfs_urb));
-	if (!urbs)
-		return LIBUSB_ERROR_NO_MEM;
-	tpriv->urbs = urbs;
-	tpriv->num_urbs = num_urbs;
 	tpriv->num_retired = 0;
 	tpriv->reap_action = NORMAL;
 	tpriv->reap_status = LIBUSB_TRANSFER_COMPLETED;
@@ -1859,16 +2475,9 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			break;
 		}
 		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
 		/* don't set the short not ok flag for the last URB */
 		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
 			urb->flags = USBFS_URB_SHORT_NOT_OK;
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
 
 		if (i > 0 && use_bulk_continuation)
 			urb->flags |= USBFS_URB_BULK_CONTINUATION;
@@ -1878,12 +2487,22 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		    transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET)
 			urb->flags |= USBFS_URB_ZERO_PACKET;
 
+		usbi_trace(URB_SUBMIT, urb, urb->buffer_length);
 		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 		if (r < 0) {
+			if (errno == ENOMEM &&
+			    lower_bulk_urb_limit(transfer->dev_handle, urb->buffer_length, is_out) &&
+			    i == 0) {
+				usbi_dbg("no memory for %d byte URB, retrying with %d",
+					urb->buffer_length, dpriv->bulk_urb_limit);
+				free_urbs(tpriv);
+				goto retry;
+			}
+
 			if (errno == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
 			} else {
-				usbi_err(TRANSFER_CTX(transfer),
+				usbi_err(ctx,
 					"submiturb failed error %d errno=%d", r, errno);
 				r = LIBUSB_ERROR_IO;
 			}
@@ -1892,8 +2511,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			 * return failure immediately. */
 			if (i == 0) {
 				usbi_dbg("first URB failed, easy peasy");
-				free(urbs);
-				tpriv->urbs = NULL;
+				free_urbs(tpriv);
 				return r;
 			}
 
@@ -1931,6 +2549,19 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		}
 	}
 
+	if (urb_limit) {
+		/* only the case under memory pressure, so the lock is affordable */
+		usbi_lock_event_data(ctx);
+		ctx->counters.bulk_urb_limit_hits++;
+		usbi_unlock_event_data(ctx);
+
+		if (++dpriv->bulk_urb_limit_hits >= BULK_URB_LIMIT_RESET) {
+			usbi_dbg("trying bulk URBs larger than %d bytes again",
+				dpriv->bulk_urb_limit);
+			dpriv->bulk_urb_limit = 0;
+		}
+	}
+
 	return 0;
 }
 
@@ -2027,8 +2658,12 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 		urb->usercontext = itransfer;
 		urb->type = USBFS_URB_TYPE_ISO;
-		/* FIXME: interface for non-ASAP data? */
-		urb->flags = USBFS_URB_ISO_ASAP;
+		/* only the first URB of a scheduled transfer has a start frame,
+		 * the others are queued right after it */
+		if (i == 0 && itransfer->iso_scheduled)
+			urb->start_frame = itransfer->iso_start_frame;
+		else
+			urb->flags = USBFS_URB_ISO_ASAP;
 		urb->endpoint = transfer->endpoint;
 		urb->number_of_packets = urb_packet_offset;
 		urb->buffer = urb_buffer_orig;
@@ -2036,7 +2671,10 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
-		int r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		int r;
+
+		usbi_trace(URB_SUBMIT, urbs[i], urbs[i]->buffer_length);
+		r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
 		if (r < 0) {
 			if (errno == ENODEV) {
 				r = LIBUSB_ERROR_NO_DEVICE;
@@ -2044,6 +2682,10 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 				usbi_warn(TRANSFER_CTX(transfer),
 					"submiturb failed, transfer too large");
 				r = LIBUSB_ERROR_INVALID_PARAM;
+			} else if (errno == EXDEV || errno == EFBIG) {
+				usbi_dbg("start frame %d out of range",
+					urbs[i]->start_frame);
+				r = LIBUSB_ERROR_INVALID_PARAM;
 			} else {
 				usbi_err(TRANSFER_CTX(transfer),
 					"submiturb failed error %d errno=%d", r, errno);
@@ -2100,9 +2742,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(struct usbfs_urb));
-	if (!urb)
-		return LIBUSB_ERROR_NO_MEM;
+	urb = alloc_urbs(tpriv, 1);
 	tpriv->urbs = urb;
 	tpriv->num_urbs = 1;
 	tpriv->reap_action = NORMAL;
@@ -2113,10 +2753,10 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	urb->buffer = transfer->buffer;
 	urb->buffer_length = transfer->length;
 
+	usbi_trace(URB_SUBMIT, urb, urb->buffer_length);
 	r = ioctl(dpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
 	if (r < 0) {
-		free(urb);
-		tpriv->urbs = NULL;
+		free_urbs(tpriv);
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
 
@@ -2127,6 +2767,80 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	return 0;
 }
 
+static int sync_transfer_error(int err)
+{
+	switch (err) {
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case ENODEV:
+	case ESHUTDOWN:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case ENOMEM:
+		return LIBUSB_ERROR_NO_MEM;
+	default:
+		usbi_dbg("synchronous transfer failed, errno=%d", err);
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static int op_sync_control_transfer(struct libusb_device_handle *handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+	uint16_t wIndex, unsigned char *data, uint16_t wLength,
+	unsigned int timeout)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct usbfs_ctrltransfer ctrl;
+	int r;
+
+	if (wLength > MAX_CTRL_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	ctrl.bmRequestType = bmRequestType;
+	ctrl.bRequest = bRequest;
+	ctrl.wValue = wValue;
+	ctrl.wIndex = wIndex;
+	ctrl.wLength = wLength;
+	ctrl.timeout = timeout;
+	ctrl.data = data;
+
+	r = ioctl(hpriv->fd, IOCTL_USBFS_CONTROL, &ctrl);
+	if (r < 0)
+		return sync_transfer_error(errno);
+
+	return r;
+}
+
+static int op_sync_bulk_transfer(struct libusb_device_handle *handle,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout)
+{
+	struct linux_device_handle_priv *hpriv = _device_handle_priv(handle);
+	struct usbfs_bulktransfer bulk;
+	int r;
+
+	/* the kernel bounces the data through a buffer of its own, leave
+	 * large transfers to be split into URBs */
+	if (length < 0 || length > MAX_BULK_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	bulk.ep = endpoint;
+	bulk.len = length;
+	bulk.timeout = timeout;
+	bulk.data = data;
+
+	*transferred = 0;
+	r = ioctl(hpriv->fd, IOCTL_USBFS_BULK, &bulk);
+	if (r < 0)
+		return sync_transfer_error(errno);
+
+	*transferred = r;
+	return 0;
+}
+
 static int op_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -2188,10 +2902,8 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		if (tpriv->urbs) {
-			free(tpriv->urbs);
-			tpriv->urbs = NULL;
-		}
+		if (tpriv->urbs)
+			free_urbs(tpriv);
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
 		if (tpriv->iso_urbs) {
@@ -2333,8 +3045,7 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
-	tpriv->urbs = NULL;
+	free_urbs(tpriv);
 	usbi_mutex_unlock(&itransfer->lock);
 	return CANCELLED == tpriv->reap_action ?
 		usbi_handle_transfer_cancellation(itransfer) :
@@ -2368,6 +3079,9 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	usbi_dbg("handling completion status %d of iso urb %d/%d", urb->status,
 		urb_idx, num_urbs);
 
+	if (urb_idx == 1)
+		itransfer->iso_actual_start_frame = urb->start_frame;
+
 	/* copy isochronous results back in */
 
 	for (i = 0; i < urb->number_of_packets; i++) {
@@ -2452,6 +3166,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	/* if we're the last urb then we're done */
 	if (urb_idx == num_urbs) {
 		usbi_dbg("last URB in transfer --> complete!");
+		itransfer->iso_reaped_time = usbi_get_monotonic_ns();
 		free_iso_urbs(tpriv);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_completion(itransfer, status);
@@ -2477,8 +3192,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status != 0 && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer),
 				"cancel: unrecognised urb status %d", urb->status);
-		free(tpriv->urbs);
-		tpriv->urbs = NULL;
+		free_urbs(tpriv);
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
 	}
@@ -2518,8 +3232,7 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
-	tpriv->urbs = NULL;
+	free_urbs(tpriv);
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
 }
@@ -2549,6 +3262,7 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 
 	usbi_dbg("urb type=%d status=%d transferred=%d", urb->type, urb->status,
 		urb->actual_length);
+	usbi_trace(URB_REAP, urb, urb->actual_length);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
@@ -2573,7 +3287,6 @@ static int op_handle_events(struct libusb_context *ctx,
 	int r;
 	unsigned int i = 0;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
 	for (i = 0; i < cnt && num_ready > 0; i++) {
 		struct pollfd *pollfd = &fds[i];
 		struct libusb_device_handle *handle;
@@ -2582,12 +3295,17 @@ static int op_handle_events(struct libusb_context *ctx,
 		if (!pollfd->revents)
 			continue;
 
+		/* the lock is only needed for the lookup, the handle can't be
+		 * closed while the event handler or event shard handling it
+		 * is running */
 		num_ready--;
+		usbi_mutex_lock(&ctx->open_devs_lock);
 		list_for_each_entry(handle, &ctx->open_devs, list, struct libusb_device_handle) {
 			hpriv = _device_handle_priv(handle);
 			if (hpriv->fd == pollfd->fd)
 				break;
 		}
+		usbi_mutex_unlock(&ctx->open_devs_lock);
 
 		if (!hpriv || hpriv->fd != pollfd->fd) {
 			usbi_err(ctx, "cannot find handle for fd %d",
@@ -2596,7 +3314,7 @@ static int op_handle_events(struct libusb_context *ctx,
 		}
 
 		if (pollfd->revents & POLLERR) {
-			usbi_remove_event_source(HANDLE_CTX(handle), hpriv->fd);
+			usbi_remove_handle_event_source(handle, hpriv->fd);
 			usbi_handle_disconnect(handle);
 			/* device will still be marked as attached if hotplug monitor thread
 			 * hasn't processed remove event yet */
@@ -2614,13 +3332,10 @@ static int op_handle_events(struct libusb_context *ctx,
 		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
 			continue;
 		else if (r < 0)
-			goto out;
+			return r;
 	}
 
-	r = 0;
-out:
-	usbi_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	return 0;
 }
 
 static int op_clock_gettime(int clk_id, struct timespec *tp)
@@ -2637,7 +3352,8 @@ static int op_clock_gettime(int clk_id, struct timespec *tp)
 
 const struct usbi_os_backend linux_usbfs_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|
+		USBI_CAP_SUPPORTS_BULK_IOVEC|USBI_CAP_SUPPORTS_ISO_START_FRAME,
 	.init = op_init,
 	.exit = op_exit,
 	.get_device_list = NULL,
@@ -2678,4 +3394,7 @@ const struct usbi_os_backend linux_usbfs_backend = {
 	.device_priv_size = sizeof(struct linux_device_priv),
 	.device_handle_priv_size = sizeof(struct linux_device_handle_priv),
 	.transfer_priv_size = sizeof(struct linux_transfer_priv),
+
+	.sync_control_transfer = op_sync_control_transfer,
+	.sync_bulk_transfer = op_sync_bulk_transfer,
 };
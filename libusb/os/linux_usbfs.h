@@ -83,6 +83,12 @@ struct usbfs_iso_packet_desc {
 
 #define MAX_ISO_BUFFER_LENGTH		49152 * 128
 #define MAX_BULK_BUFFER_LENGTH		16384
+/* Default size of the URBs bulk transfers are split into when the kernel
+ * has no URB size limit (USBFS_CAP_NO_PACKET_SIZE_LIM) but cannot do
+ * scatter-gather. The kernel needs physically contiguous memory for such
+ * URBs, so this is lowered when a submission fails with ENOMEM. */
+#define MAX_BULK_URB_LENGTH_HS		(64 * 1024)
+#define MAX_BULK_URB_LENGTH_SS		(256 * 1024)
 #define MAX_CTRL_BUFFER_LENGTH		4096
 
 struct usbfs_urb {
@@ -180,8 +186,17 @@ int linux_netlink_stop_event_monitor(void);
 void linux_netlink_hotplug_poll(void);
 #endif
 
+/* A device arrival or departure reported by the hotplug monitor */
+struct linux_hotplug_event {
+	uint8_t busnum;
+	uint8_t devaddr;
+	int detached;
+	const char *sys_name;
+};
+
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name);
 void linux_device_disconnected(uint8_t busnum, uint8_t devaddr, const char *sys_name);
+void linux_hotplug_apply_events(const struct linux_hotplug_event *events, int count);
 
 int linux_get_device_address (struct libusb_context *ctx, int detached,
 	uint8_t *busnum, uint8_t *devaddr, const char *dev_node,
@@ -21,12 +21,19 @@
 
 #include <config.h>
 
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+
 #if defined(__linux__) || defined(__OpenBSD__)
 # if defined(__OpenBSD__)
 #  define _BSD_SOURCE
 # endif
 # include <unistd.h>
 # include <sys/syscall.h>
+# if defined(__linux__)
+#  include <sys/prctl.h>
+# endif
 #elif defined(__APPLE__)
 # include <mach/mach.h>
 #elif defined(__CYGWIN__)
@@ -80,3 +87,49 @@ int usbi_get_tid(void)
 /* TODO: NetBSD thread ID support */
 	return ret;
 }
+
+/* Applies CPU affinity, SCHED_FIFO priority and name to the calling thread.
+ * Setting the name is best effort. Returns 0 or an errno value. */
+int usbi_thread_setup(const int *cpus, int num_cpus, int priority,
+	const char *name)
+{
+	int err;
+
+	if (num_cpus > 0) {
+#if defined(__linux__)
+		cpu_set_t set;
+		int i;
+
+		CPU_ZERO(&set);
+		for (i = 0; i < num_cpus; i++) {
+			if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE)
+				return EINVAL;
+			CPU_SET(cpus[i], &set);
+		}
+		if (sched_setaffinity(0, sizeof(set), &set) != 0)
+			return errno;
+#else
+		return ENOSYS;
+#endif
+	}
+
+	if (priority) {
+		struct sched_param param;
+
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err != 0)
+			return err;
+	}
+
+	if (name) {
+#if defined(__linux__)
+		prctl(PR_SET_NAME, name, 0, 0, 0);
+#elif defined(__APPLE__)
+		pthread_setname_np(name);
+#endif
+	}
+
+	return 0;
+}
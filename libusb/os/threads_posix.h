@@ -47,4 +47,7 @@ extern int usbi_mutex_init_recursive(pthread_mutex_t *mutex, pthread_mutexattr_t
 
 int usbi_get_tid(void);
 
+int usbi_thread_setup(const int *cpus, int num_cpus, int priority,
+	const char *name);
+
 #endif /* LIBUSB_THREADS_POSIX_H */
@@ -737,7 +737,7 @@ static int wince_handle_events(
 	for (i = 0; i < cnt; i++) {
 		transfer_priv = NULL;
 		found = FALSE;
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
+		usbi_lock_flying_transfers(ctx);
 		list_for_each_entry(transfer, &ctx->flying_transfers, list, struct usbi_transfer) {
 			transfer_priv = usbi_transfer_get_os_priv(transfer);
 			if (transfer_priv->overlapped.hEvent == handles[i]) {
@@ -745,7 +745,7 @@ static int wince_handle_events(
 				break;
 			}
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_unlock_flying_transfers(ctx);
 
 		if (found && HasOverlappedIoCompleted(&transfer_priv->overlapped)) {
 			io_result = (DWORD)transfer_priv->overlapped.Internal;
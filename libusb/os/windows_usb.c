@@ -2312,7 +2312,7 @@ static int windows_handle_events(struct libusb_context *ctx, void *event_data, u
 	for (i = 0; i < cnt; i++) {
 		transfer_priv = NULL;
 		found = false;
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
+		usbi_lock_flying_transfers(ctx);
 		list_for_each_entry(itransfer, &ctx->flying_transfers, list, struct usbi_transfer) {
 			transfer_priv = usbi_transfer_get_os_priv(itransfer);
 			if (transfer_priv->overlapped.hEvent == handles[i]) {
@@ -2320,7 +2320,7 @@ static int windows_handle_events(struct libusb_context *ctx, void *event_data, u
 				break;
 			}
 		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+		usbi_unlock_flying_transfers(ctx);
 
 		if (found) {
 			// Handle async requests that completed synchronously first
@@ -34,21 +34,89 @@
  * may wish to consider using the \ref asyncio "asynchronous I/O API" instead.
  */
 
-static void LIBUSB_CALL sync_transfer_cb(struct libusb_transfer *transfer)
+/* Take the transfer and buffer cached by the handle for synchronous I/O.
+ * The buffer is grown to at least *buffer_len bytes and its actual size is
+ * returned in *buffer_len. Falls back to allocating when another thread is
+ * using the cached transfer. */
+static struct libusb_transfer *sync_transfer_get(
+	struct libusb_device_handle *dev_handle, unsigned char **buffer,
+	int *buffer_len)
 {
-	int *completed = transfer->user_data;
-	*completed = 1;
+	struct libusb_transfer *transfer;
+	unsigned char *cached_buffer;
+	int cached_len;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	transfer = dev_handle->sync_transfer;
+	cached_buffer = dev_handle->sync_buffer;
+	cached_len = dev_handle->sync_buffer_len;
+	dev_handle->sync_transfer = NULL;
+	dev_handle->sync_buffer = NULL;
+	dev_handle->sync_buffer_len = 0;
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (!transfer) {
+		transfer = libusb_alloc_transfer(0);
+		if (!transfer) {
+			free(cached_buffer);
+			return NULL;
+		}
+	}
+
+	if (cached_len < *buffer_len) {
+		free(cached_buffer);
+		cached_buffer = malloc(*buffer_len);
+		if (!cached_buffer) {
+			libusb_free_transfer(transfer);
+			return NULL;
+		}
+		cached_len = *buffer_len;
+	}
+
+	*buffer = cached_buffer;
+	*buffer_len = cached_len;
+	return transfer;
+}
+
+/* Return a transfer obtained with sync_transfer_get() to the cache of the
+ * handle it was used with, or free it if the cache is already populated. */
+static void sync_transfer_put(struct libusb_device_handle *dev_handle,
+	struct libusb_transfer *transfer, unsigned char *buffer, int buffer_len)
+{
+	libusb_transfer_set_iovec(transfer, NULL, 0);
+
+	usbi_mutex_lock(&dev_handle->lock);
+	if (!dev_handle->sync_transfer) {
+		dev_handle->sync_transfer = transfer;
+		dev_handle->sync_buffer = buffer;
+		dev_handle->sync_buffer_len = buffer_len;
+		transfer = NULL;
+		buffer = NULL;
+	}
+	usbi_mutex_unlock(&dev_handle->lock);
+
+	if (transfer)
+		libusb_free_transfer(transfer);
+	free(buffer);
+}
+
+void LIBUSB_CALL usbi_sync_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct usbi_sync_waiter *waiter = transfer->user_data;
 	usbi_dbg("actual_length=%d", transfer->actual_length);
-	/* caller interprets result and frees transfer */
+	/* caller interprets result and frees transfer. it may do so as soon
+	 * as it is signalled, so do not touch the transfer past this point. */
+	usbi_signal_sync_waiter(HANDLE_CTX(transfer->dev_handle), waiter);
 }
 
-static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
+static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer,
+	struct usbi_sync_waiter *waiter)
 {
-	int r, *completed = transfer->user_data;
+	int r;
 	struct libusb_context *ctx = HANDLE_CTX(transfer->dev_handle);
 
-	while (!*completed) {
-		r = libusb_handle_events_completed(ctx, completed);
+	while (!waiter->completed) {
+		r = usbi_handle_events_sync_waiter(ctx, waiter);
 		if (r < 0) {
 			if (r == LIBUSB_ERROR_INTERRUPTED)
 				continue;
@@ -92,35 +160,40 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct libusb_transfer *transfer;
 	unsigned char *buffer;
-	int completed = 0;
+	int buffer_len = LIBUSB_CONTROL_SETUP_SIZE + wLength;
+	struct usbi_sync_waiter waiter;
 	int r;
 
-	if (!transfer)
-		return LIBUSB_ERROR_NO_MEM;
+	if (dev_handle->direct_sync_transfers) {
+		r = usbi_backend->sync_control_transfer(dev_handle, bmRequestType,
+			bRequest, wValue, wIndex, data, wLength, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED)
+			return r;
+	}
 
-	buffer = (unsigned char*) malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength);
-	if (!buffer) {
-		libusb_free_transfer(transfer);
+	transfer = sync_transfer_get(dev_handle, &buffer, &buffer_len);
+	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
-	}
 
 	libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue, wIndex,
 		wLength);
 	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT)
 		memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
 
+	usbi_sync_waiter_init(&waiter);
 	libusb_fill_control_transfer(transfer, dev_handle, buffer,
-		sync_transfer_cb, &completed, timeout);
-	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		usbi_sync_transfer_cb, &waiter, timeout);
+	transfer->flags = 0;
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		usbi_sync_waiter_destroy(HANDLE_CTX(dev_handle), &waiter);
+		sync_transfer_put(dev_handle, transfer, buffer, buffer_len);
 		return r;
 	}
 
-	sync_transfer_wait_for_completion(transfer);
+	sync_transfer_wait_for_completion(transfer, &waiter);
 
 	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN)
 		memcpy(data, libusb_control_transfer_get_data(transfer),
@@ -152,32 +225,56 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	usbi_sync_waiter_destroy(HANDLE_CTX(dev_handle), &waiter);
+	sync_transfer_put(dev_handle, transfer, buffer, buffer_len);
 	return r;
 }
 
 static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
+	const struct libusb_iovec *iov, int iovcnt,
 	int *transferred, unsigned int timeout, unsigned char type)
 {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-	int completed = 0;
+	struct libusb_transfer *transfer;
+	unsigned char *cached_buffer;
+	int cached_len = 0;
+	struct usbi_sync_waiter waiter;
 	int r;
 
+	if (dev_handle->direct_sync_transfers && !iov) {
+		r = usbi_backend->sync_bulk_transfer(dev_handle, endpoint, buffer,
+			length, transferred, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED)
+			return r;
+	}
+
+	/* the cached control buffer is not needed, but stays with the transfer */
+	transfer = sync_transfer_get(dev_handle, &cached_buffer, &cached_len);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
 
+	usbi_sync_waiter_init(&waiter);
 	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, buffer, length,
-		sync_transfer_cb, &completed, timeout);
+		usbi_sync_transfer_cb, &waiter, timeout);
 	transfer->type = type;
+	transfer->flags = 0;
+	if (iov) {
+		r = libusb_transfer_set_iovec(transfer, iov, iovcnt);
+		if (r < 0) {
+			usbi_sync_waiter_destroy(HANDLE_CTX(dev_handle), &waiter);
+			sync_transfer_put(dev_handle, transfer, cached_buffer, cached_len);
+			return r;
+		}
+	}
 
 	r = libusb_submit_transfer(transfer);
 	if (r < 0) {
-		libusb_free_transfer(transfer);
+		usbi_sync_waiter_destroy(HANDLE_CTX(dev_handle), &waiter);
+		sync_transfer_put(dev_handle, transfer, cached_buffer, cached_len);
 		return r;
 	}
 
-	sync_transfer_wait_for_completion(transfer);
+	sync_transfer_wait_for_completion(transfer, &waiter);
 
 	*transferred = transfer->actual_length;
 	switch (transfer->status) {
@@ -206,7 +303,8 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 		r = LIBUSB_ERROR_OTHER;
 	}
 
-	libusb_free_transfer(transfer);
+	usbi_sync_waiter_destroy(HANDLE_CTX(dev_handle), &waiter);
+	sync_transfer_put(dev_handle, transfer, cached_buffer, cached_len);
 	return r;
 }
 
@@ -255,6 +353,45 @@ int API_EXPORTED libusb_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned int timeout)
 {
 	return do_sync_bulk_transfer(dev_handle, endpoint, data, length,
+		NULL, 0, transferred, timeout, LIBUSB_TRANSFER_TYPE_BULK);
+}
+
+/** \ingroup syncio
+ * Perform a USB bulk transfer from or to a list of buffer segments. This
+ * behaves like libusb_bulk_transfer() on a buffer holding the segments one
+ * after the other, without the segments having to be copied into such a
+ * buffer first. For writes, the segments go out as a single transfer; no
+ * short packet is sent at the segment boundaries.
+ *
+ * Where the platform can, the segments are handed to the kernel directly.
+ * Otherwise they are copied through an internal bounce buffer.
+ *
+ * Since version 1.0.21, \ref LIBUSB_API_VERSION >= 0x01000105
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param endpoint the address of a valid endpoint to communicate with
+ * \param iov array of segments to send or receive data with
+ * \param iovcnt number of segments in the array
+ * \param transferred output location for the number of bytes actually
+ * transferred.
+ * \param timeout timeout (in millseconds) that this function should wait
+ * before giving up due to no response being received. For an unlimited
+ * timeout, use value 0.
+ *
+ * \returns 0 on success (and populates <tt>transferred</tt>)
+ * \returns LIBUSB_ERROR_INVALID_PARAM if a segment length is invalid
+ * \returns another LIBUSB_ERROR code as for libusb_bulk_transfer()
+ * \see libusb_transfer_set_iovec()
+ */
+int API_EXPORTED libusb_bulk_transfer_iovec(
+	struct libusb_device_handle *dev_handle, unsigned char endpoint,
+	const struct libusb_iovec *iov, int iovcnt, int *transferred,
+	unsigned int timeout)
+{
+	if (!iov || iovcnt <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	return do_sync_bulk_transfer(dev_handle, endpoint, NULL, 0, iov, iovcnt,
 		transferred, timeout, LIBUSB_TRANSFER_TYPE_BULK);
 }
 
@@ -304,5 +441,5 @@ int API_EXPORTED libusb_interrupt_transfer(
 	unsigned char *data, int length, int *transferred, unsigned int timeout)
 {
 	return do_sync_bulk_transfer(dev_handle, endpoint, data, length,
-		transferred, timeout, LIBUSB_TRANSFER_TYPE_INTERRUPT);
+		NULL, 0, transferred, timeout, LIBUSB_TRANSFER_TYPE_INTERRUPT);
 }
@@ -0,0 +1,577 @@
+/*
+ * libusb benchmark program to time the core paths of the library
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Every measurement is written as one line of the form
+ *
+ *   bench name=<benchmark> [<parameter>=<value>] ops=<count> ns_per_op=<time>
+ *
+ * so that results can be collected with e.g. "grep ^bench" and compared
+ * between releases.
+ *
+ * The benchmarks which need a device use the one given by the
+ * LIBUSB_BENCH_DEVICE environment variable as "vid:pid" in hexadecimal, or
+ * else the first device that can be opened. flying_list_depth also needs
+ * an IN endpoint of that device which stays idle, given by
+ * LIBUSB_BENCH_ENDPOINT, e.g. "0x81". Benchmarks are skipped when what they
+ * need is not available.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+
+#define MAX_DEPTH 1024
+
+static uint64_t get_time_ns(void)
+{
+#if defined(_WIN32)
+	LARGE_INTEGER frequency, counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+
+/** Writes out one measurement. param may be NULL if the benchmark has
+ * no parameter. */
+static void report(libusb_testlib_ctx * tctx, const char * name,
+	const char * param, long value, long ops, uint64_t elapsed_ns)
+{
+	char param_str[64] = "";
+
+	if (param)
+		snprintf(param_str, sizeof(param_str), " %s=%ld", param, value);
+	libusb_testlib_logf(tctx, "bench name=%s%s ops=%ld ns_per_op=%.1f",
+		name, param_str, ops, ops ? (double)elapsed_ns / ops : 0.0);
+}
+
+/** Opens the device given by LIBUSB_BENCH_DEVICE, or the first device
+ * that can be opened. Returns NULL if there is none. */
+static libusb_device_handle * open_bench_device(libusb_context * ctx)
+{
+	libusb_device ** devs;
+	libusb_device_handle * handle = NULL;
+	const char * env = getenv("LIBUSB_BENCH_DEVICE");
+	unsigned int vid, pid;
+	ssize_t cnt, i;
+
+	if (env) {
+		if (sscanf(env, "%x:%x", &vid, &pid) != 2)
+			return NULL;
+		return libusb_open_device_with_vid_pid(ctx,
+			(uint16_t)vid, (uint16_t)pid);
+	}
+
+	cnt = libusb_get_device_list(ctx, &devs);
+	if (cnt < 0)
+		return NULL;
+	for (i = 0; i < cnt && !handle; i++) {
+		if (libusb_open(devs[i], &handle) != LIBUSB_SUCCESS)
+			handle = NULL;
+	}
+	libusb_free_device_list(devs, 1);
+	return handle;
+}
+
+/** Times allocating and freeing transfers with various numbers of
+ * isochronous packets. */
+static libusb_testlib_result test_alloc_transfer(libusb_testlib_ctx * tctx)
+{
+	static const int iso_packets[] = { 0, 8, 64 };
+	const long ops = 1000000;
+	unsigned int i;
+	long j;
+
+	for (i = 0; i < sizeof(iso_packets) / sizeof(iso_packets[0]); i++) {
+		uint64_t start = get_time_ns();
+
+		for (j = 0; j < ops; j++) {
+			struct libusb_transfer * transfer =
+				libusb_alloc_transfer(iso_packets[i]);
+			if (!transfer) {
+				libusb_testlib_logf(tctx, "Failed to allocate transfer");
+				return TEST_STATUS_ERROR;
+			}
+			libusb_free_transfer(transfer);
+		}
+		report(tctx, "alloc_transfer", "iso_packets", iso_packets[i],
+			ops, get_time_ns() - start);
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+struct round_trip {
+	int remaining;
+	uint64_t submit_ns;
+	int status;
+};
+
+static void LIBUSB_CALL round_trip_cb(struct libusb_transfer * transfer)
+{
+	struct round_trip * rt = transfer->user_data;
+	uint64_t start;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		rt->status = transfer->status;
+		rt->remaining = 0;
+		return;
+	}
+	if (--rt->remaining == 0)
+		return;
+
+	start = get_time_ns();
+	if (libusb_submit_transfer(transfer) != LIBUSB_SUCCESS) {
+		rt->status = LIBUSB_TRANSFER_ERROR;
+		rt->remaining = 0;
+	}
+	rt->submit_ns += get_time_ns() - start;
+}
+
+/** Times asynchronous GET_STATUS requests to a device, each submitted
+ * from the callback of the previous one. */
+static libusb_testlib_result test_submit_callback(libusb_testlib_ctx * tctx)
+{
+	const int ops = 10000;
+	unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + 2];
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	struct libusb_transfer * transfer;
+	struct round_trip rt;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	uint64_t start, elapsed;
+	int completed = 0;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_ERROR;
+	}
+
+	handle = open_bench_device(ctx);
+	if (!handle) {
+		libusb_testlib_logf(tctx, "No device to benchmark");
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer) {
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+	libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_STANDARD |
+		LIBUSB_RECIPIENT_DEVICE, LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+	libusb_fill_control_transfer(transfer, handle, buf, round_trip_cb, &rt, 1000);
+
+	rt.remaining = ops;
+	rt.submit_ns = 0;
+	rt.status = LIBUSB_TRANSFER_COMPLETED;
+
+	start = get_time_ns();
+	r = libusb_submit_transfer(transfer);
+	rt.submit_ns += get_time_ns() - start;
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to submit transfer: %d", r);
+		result = TEST_STATUS_ERROR;
+		goto out_free;
+	}
+	while (rt.remaining) {
+		r = libusb_handle_events_completed(ctx, &completed);
+		if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED)
+			break;
+	}
+	elapsed = get_time_ns() - start;
+
+	if (rt.status != LIBUSB_TRANSFER_COMPLETED) {
+		libusb_testlib_logf(tctx, "Transfer failed: %d", rt.status);
+		result = TEST_STATUS_FAILURE;
+		goto out_free;
+	}
+	report(tctx, "submit_transfer", NULL, 0, ops, rt.submit_ns);
+	report(tctx, "control_round_trip", NULL, 0, ops, elapsed);
+
+out_free:
+	libusb_free_transfer(transfer);
+out:
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Finds the interface of the active configuration with an endpoint, and
+ * the type of the endpoint. Returns the interface number, or -1 if the
+ * endpoint was not found. */
+static int find_endpoint(libusb_device * dev, unsigned char endpoint,
+	unsigned char * type)
+{
+	struct libusb_config_descriptor * config;
+	int i, j, k, r = -1;
+
+	if (libusb_get_active_config_descriptor(dev, &config) != LIBUSB_SUCCESS)
+		return -1;
+	for (i = 0; i < config->bNumInterfaces && r < 0; i++) {
+		const struct libusb_interface * iface = &config->interface[i];
+		for (j = 0; j < iface->num_altsetting && r < 0; j++) {
+			const struct libusb_interface_descriptor * alt = &iface->altsetting[j];
+			for (k = 0; k < alt->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor * ep = &alt->endpoint[k];
+				if (ep->bEndpointAddress == endpoint) {
+					*type = ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK;
+					r = alt->bInterfaceNumber;
+					break;
+				}
+			}
+		}
+	}
+	libusb_free_config_descriptor(config);
+	return r;
+}
+
+static void LIBUSB_CALL count_cb(struct libusb_transfer * transfer)
+{
+	int * done = transfer->user_data;
+
+	(*done)++;
+}
+
+/** Times submitting transfers with increasing timeouts to an idle endpoint,
+ * so that each one is added at the end of a growing list of transfers in
+ * flight, then cancels them. */
+static libusb_testlib_result test_flying_list_depth(libusb_testlib_ctx * tctx)
+{
+	static const int depths[] = { 1, 16, 256, MAX_DEPTH };
+	static struct libusb_transfer * transfers[MAX_DEPTH];
+	static unsigned char buffers[MAX_DEPTH][512];
+	const char * env = getenv("LIBUSB_BENCH_ENDPOINT");
+	libusb_context * ctx = NULL;
+	libusb_device_handle * handle;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	unsigned char endpoint, type = 0;
+	unsigned int d;
+	int iface, submitted, done, i, r;
+
+	if (!env) {
+		libusb_testlib_logf(tctx, "LIBUSB_BENCH_ENDPOINT not set");
+		return TEST_STATUS_SKIP;
+	}
+	endpoint = (unsigned char)strtoul(env, NULL, 0);
+	if (!(endpoint & LIBUSB_ENDPOINT_IN)) {
+		libusb_testlib_logf(tctx, "Endpoint 0x%02x is not an IN endpoint", endpoint);
+		return TEST_STATUS_ERROR;
+	}
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_ERROR;
+	}
+
+	handle = open_bench_device(ctx);
+	if (!handle) {
+		libusb_testlib_logf(tctx, "No device to benchmark");
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+
+	iface = find_endpoint(libusb_get_device(handle), endpoint, &type);
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+	if (iface < 0 || libusb_claim_interface(handle, iface) != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to claim interface of endpoint 0x%02x",
+			endpoint);
+		libusb_close(handle);
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+	if (type != LIBUSB_TRANSFER_TYPE_BULK && type != LIBUSB_TRANSFER_TYPE_INTERRUPT) {
+		libusb_testlib_logf(tctx, "Endpoint 0x%02x is not a bulk or interrupt endpoint",
+			endpoint);
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+
+	for (i = 0; i < MAX_DEPTH; i++) {
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!transfers[i]) {
+			result = TEST_STATUS_ERROR;
+			goto out;
+		}
+		libusb_fill_bulk_transfer(transfers[i], handle, endpoint,
+			buffers[i], sizeof(buffers[i]), count_cb, &done, 0);
+		transfers[i]->type = type;
+	}
+
+	for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+		uint64_t start, elapsed;
+
+		done = 0;
+		start = get_time_ns();
+		for (submitted = 0; submitted < depths[d]; submitted++) {
+			transfers[submitted]->timeout = 60000 + submitted;
+			r = libusb_submit_transfer(transfers[submitted]);
+			if (r != LIBUSB_SUCCESS) {
+				libusb_testlib_logf(tctx, "Failed to submit transfer %d: %d",
+					submitted, r);
+				result = TEST_STATUS_ERROR;
+				break;
+			}
+		}
+		elapsed = get_time_ns() - start;
+
+		for (i = 0; i < submitted; i++)
+			libusb_cancel_transfer(transfers[i]);
+		while (done < submitted) {
+			if (libusb_handle_events(ctx) < 0)
+				break;
+		}
+		if (result != TEST_STATUS_SUCCESS)
+			break;
+		report(tctx, "flying_list_submit", "depth", depths[d], depths[d], elapsed);
+	}
+
+out:
+	for (i = 0; i < MAX_DEPTH; i++)
+		libusb_free_transfer(transfers[i]);
+	libusb_release_interface(handle, iface);
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return result;
+}
+
+/** Times getting the device list, which scales with the number of devices
+ * connected. */
+static libusb_testlib_result test_get_device_list(libusb_testlib_ctx * tctx)
+{
+	const long ops = 1000;
+	libusb_context * ctx = NULL;
+	libusb_device ** devs;
+	ssize_t cnt = 0;
+	uint64_t start;
+	long i;
+	int r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_ERROR;
+	}
+
+	start = get_time_ns();
+	for (i = 0; i < ops; i++) {
+		cnt = libusb_get_device_list(ctx, &devs);
+		if (cnt < 0) {
+			libusb_testlib_logf(tctx, "Failed to get device list: %d", (int)cnt);
+			libusb_exit(ctx);
+			return TEST_STATUS_ERROR;
+		}
+		libusb_free_device_list(devs, 1);
+	}
+	report(tctx, "get_device_list", "devices", (long)cnt, ops,
+		get_time_ns() - start);
+
+	libusb_exit(ctx);
+	return TEST_STATUS_SUCCESS;
+}
+
+/** Times parsing descriptors: the configuration descriptors of all devices,
+ * and synthetic SuperSpeed endpoint companion and BOS descriptors. */
+static libusb_testlib_result test_descriptor_parse(libusb_testlib_ctx * tctx)
+{
+	static const unsigned char companion[] = {
+		LIBUSB_DT_SS_ENDPOINT_COMPANION_SIZE, LIBUSB_DT_SS_ENDPOINT_COMPANION,
+		15, 0, 0x00, 0x04
+	};
+	static const unsigned char usb_2_0_extension[] = {
+		LIBUSB_BT_USB_2_0_EXTENSION_SIZE, LIBUSB_DT_DEVICE_CAPABILITY,
+		LIBUSB_BT_USB_2_0_EXTENSION, 0x02, 0x00, 0x00, 0x00
+	};
+	const long ops = 100000;
+	libusb_context * ctx = NULL;
+	libusb_device ** devs;
+	struct libusb_endpoint_descriptor ep;
+	union {
+		struct libusb_bos_dev_capability_descriptor desc;
+		unsigned char raw[16];
+	} dev_cap;
+	ssize_t cnt, d;
+	uint64_t start;
+	long i, parsed, bytes;
+	int r;
+
+	/* the synthetic descriptors need no context */
+	memset(&ep, 0, sizeof(ep));
+	ep.extra = companion;
+	ep.extra_length = sizeof(companion);
+	start = get_time_ns();
+	for (i = 0; i < ops; i++) {
+		struct libusb_ss_endpoint_companion_descriptor * comp;
+		r = libusb_get_ss_endpoint_companion_descriptor(NULL, &ep, &comp);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to parse companion descriptor: %d", r);
+			return TEST_STATUS_FAILURE;
+		}
+		libusb_free_ss_endpoint_companion_descriptor(comp);
+	}
+	report(tctx, "parse_ss_endpoint_companion", NULL, 0, ops,
+		get_time_ns() - start);
+
+	memcpy(dev_cap.raw, usb_2_0_extension, sizeof(usb_2_0_extension));
+	start = get_time_ns();
+	for (i = 0; i < ops; i++) {
+		struct libusb_usb_2_0_extension_descriptor * ext;
+		r = libusb_get_usb_2_0_extension_descriptor(NULL, &dev_cap.desc, &ext);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to parse USB 2.0 extension: %d", r);
+			return TEST_STATUS_FAILURE;
+		}
+		libusb_free_usb_2_0_extension_descriptor(ext);
+	}
+	report(tctx, "parse_usb_2_0_extension", NULL, 0, ops,
+		get_time_ns() - start);
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_ERROR;
+	}
+
+	cnt = libusb_get_device_list(ctx, &devs);
+	if (cnt < 0) {
+		libusb_testlib_logf(tctx, "Failed to get device list: %d", (int)cnt);
+		libusb_exit(ctx);
+		return TEST_STATUS_ERROR;
+	}
+
+	parsed = bytes = 0;
+	start = get_time_ns();
+	for (i = 0; i < ops / 100; i++) {
+		for (d = 0; d < cnt; d++) {
+			struct libusb_config_descriptor * config;
+			if (libusb_get_config_descriptor(devs[d], 0, &config) != LIBUSB_SUCCESS)
+				continue;
+			bytes += config->wTotalLength;
+			parsed++;
+			libusb_free_config_descriptor(config);
+		}
+	}
+	if (parsed)
+		report(tctx, "parse_config_descriptor", "bytes",
+			bytes / parsed, parsed, get_time_ns() - start);
+
+	libusb_free_device_list(devs, 1);
+	libusb_exit(ctx);
+	return TEST_STATUS_SUCCESS;
+}
+
+static int LIBUSB_CALL hotplug_count_cb(libusb_context * ctx,
+	libusb_device * dev, libusb_hotplug_event event, void * user_data)
+{
+	long * count = user_data;
+
+	(void)ctx;
+	(void)dev;
+	(void)event;
+	(*count)++;
+	return 0;
+}
+
+/** Times the dispatch of hotplug arrival callbacks for the devices already
+ * connected, by registering callbacks with LIBUSB_HOTPLUG_ENUMERATE. */
+static libusb_testlib_result test_hotplug_dispatch(libusb_testlib_ctx * tctx)
+{
+	const long ops = 1000;
+	libusb_context * ctx = NULL;
+	libusb_hotplug_callback_handle handle;
+	long count = 0, i;
+	uint64_t start;
+	int r;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		libusb_testlib_logf(tctx, "Hotplug not supported");
+		return TEST_STATUS_SKIP;
+	}
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_ERROR;
+	}
+
+	start = get_time_ns();
+	for (i = 0; i < ops; i++) {
+		r = libusb_hotplug_register_callback(ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+			LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_count_cb, &count, &handle);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx, "Failed to register callback: %d", r);
+			libusb_exit(ctx);
+			return TEST_STATUS_ERROR;
+		}
+		libusb_hotplug_deregister_callback(ctx, handle);
+	}
+
+	if (!count) {
+		libusb_testlib_logf(tctx, "No devices connected");
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+	report(tctx, "hotplug_dispatch", "devices", count / ops, count,
+		get_time_ns() - start);
+
+	libusb_exit(ctx);
+	return TEST_STATUS_SUCCESS;
+}
+
+/* Fill in the list of tests. */
+static const libusb_testlib_test tests[] = {
+	{"alloc_transfer", &test_alloc_transfer},
+	{"submit_callback", &test_submit_callback},
+	{"flying_list_depth", &test_flying_list_depth},
+	{"get_device_list", &test_get_device_list},
+	{"descriptor_parse", &test_descriptor_parse},
+	{"hotplug_dispatch", &test_hotplug_dispatch},
+	LIBUSB_NULL_TEST
+};
+
+int main (int argc, char ** argv)
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -0,0 +1,450 @@
+/*
+ * libusb end-to-end benchmark against a Linux gadget loopback
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This program streams data to and from the source/sink function of the
+ * Linux gadget zero driver, through the whole libusb and usbfs stack. With
+ * the dummy_hcd driver providing a virtual host and device controller, this
+ * needs no USB hardware: run gadget_setup.sh as root to load both drivers.
+ *
+ * For each combination of transfer type, transfer size, queue depth and
+ * number of threads, each thread keeps its own queue of transfers in flight
+ * for the given duration and handles events. One line is printed for each
+ * combination:
+ *
+ *   bench name=gadget type=<type> size=<bytes> depth=<n> threads=<n>
+ *     ops=<transfers> mb_per_s=<throughput> p50_us=<latency> p99_us=...
+ *     p999_us=...
+ *
+ * (on a single line), where the latencies are the time from submitting a
+ * transfer to libusb learning it completed, as recorded by libusb_get_stats().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "libusb.h"
+
+#define GADGET_ZERO_VID		0x1a0a
+#define GADGET_ZERO_PID		0xbadd
+#define SOURCESINK_INTERFACE	0
+
+enum bench_type {
+	BENCH_BULK_IN,
+	BENCH_BULK_OUT,
+	BENCH_ISO_IN,
+	BENCH_ISO_OUT,
+	BENCH_TYPE_COUNT
+};
+
+static const char * const type_names[BENCH_TYPE_COUNT] = {
+	"bulk_in", "bulk_out", "iso_in", "iso_out"
+};
+
+struct bench_transfer {
+	struct libusb_transfer *transfer;
+	uint64_t bytes;
+	volatile int done;
+	int error;
+	volatile int *stop;
+};
+
+struct bench_thread {
+	pthread_t thread;
+	libusb_context *ctx;
+	struct bench_transfer *transfers;
+	int depth;
+	int error;
+};
+
+static uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* parse a comma separated list of numbers, returns the count */
+static int parse_list(const char *str, int *values, int max)
+{
+	int n = 0;
+
+	while (*str && n < max) {
+		char *end;
+		values[n++] = (int)strtol(str, &end, 0);
+		if (*end != ',')
+			break;
+		str = end + 1;
+	}
+	return n;
+}
+
+/* find the endpoint of a type and direction in the source/sink interface,
+ * returns its address or 0 */
+static unsigned char find_endpoint(libusb_device *dev, int altsetting,
+	unsigned char type, unsigned char direction)
+{
+	struct libusb_config_descriptor *config;
+	const struct libusb_interface *iface;
+	unsigned char endpoint = 0;
+	int i;
+
+	if (libusb_get_active_config_descriptor(dev, &config) != LIBUSB_SUCCESS)
+		return 0;
+	if (config->bNumInterfaces <= SOURCESINK_INTERFACE)
+		goto out;
+	iface = &config->interface[SOURCESINK_INTERFACE];
+	if (iface->num_altsetting <= altsetting)
+		goto out;
+	for (i = 0; i < iface->altsetting[altsetting].bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep =
+			&iface->altsetting[altsetting].endpoint[i];
+		if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) == type &&
+		    (ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK) == direction) {
+			endpoint = ep->bEndpointAddress;
+			break;
+		}
+	}
+out:
+	libusb_free_config_descriptor(config);
+	return endpoint;
+}
+
+static void LIBUSB_CALL bench_cb(struct libusb_transfer *transfer)
+{
+	struct bench_transfer *bt = transfer->user_data;
+	int i;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		bt->error = transfer->status;
+		bt->done = 1;
+		return;
+	}
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		for (i = 0; i < transfer->num_iso_packets; i++)
+			bt->bytes += transfer->iso_packet_desc[i].actual_length;
+	} else {
+		bt->bytes += transfer->actual_length;
+	}
+
+	if (*bt->stop || libusb_submit_transfer(transfer) != LIBUSB_SUCCESS)
+		bt->done = 1;
+}
+
+static void *bench_thread_main(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct timeval tv = { 0, 100000 };
+	int i, r, pending;
+
+	for (i = 0; i < bt->depth; i++) {
+		r = libusb_submit_transfer(bt->transfers[i].transfer);
+		if (r != LIBUSB_SUCCESS) {
+			bt->error = r;
+			bt->transfers[i].done = 1;
+		}
+	}
+
+	do {
+		r = libusb_handle_events_timeout_completed(bt->ctx, &tv, NULL);
+		if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_INTERRUPTED) {
+			bt->error = r;
+			break;
+		}
+		pending = 0;
+		for (i = 0; i < bt->depth; i++)
+			pending += !bt->transfers[i].done;
+	} while (pending);
+
+	return NULL;
+}
+
+/* latency percentile of the endpoint in microseconds */
+static double latency_us(const struct libusb_stats *stats,
+	unsigned char endpoint, double percentile)
+{
+	int i;
+
+	for (i = 0; i < stats->num_endpoints; i++) {
+		if (stats->endpoints[i].endpoint == endpoint)
+			return libusb_stats_histogram_percentile(
+				&stats->endpoints[i].transfer_latency, percentile) / 1000.0;
+	}
+	return 0.0;
+}
+
+/* run one combination, returns 0 on success, 1 if it is not supported by
+ * the gadget, or a LIBUSB_ERROR code */
+static int run_bench(uint16_t vid, uint16_t pid, enum bench_type type,
+	int size, int depth, int threads, int duration_ms)
+{
+	int is_iso = (type == BENCH_ISO_IN || type == BENCH_ISO_OUT);
+	unsigned char direction = (type == BENCH_BULK_IN || type == BENCH_ISO_IN) ?
+		LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT;
+	libusb_context *ctx = NULL;
+	libusb_device_handle *handle;
+	struct bench_thread *bts = NULL;
+	struct libusb_stats *stats;
+	volatile int stop = 0;
+	unsigned char endpoint;
+	uint64_t start, elapsed, bytes = 0, ops = 0;
+	int packets = 0, packet_size = 0;
+	int started, t, i, r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+	libusb_set_stats_enabled(ctx, 1);
+
+	handle = libusb_open_device_with_vid_pid(ctx, vid, pid);
+	if (!handle) {
+		libusb_exit(ctx);
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	libusb_set_auto_detach_kernel_driver(handle, 1);
+	r = libusb_claim_interface(handle, SOURCESINK_INTERFACE);
+	if (r != LIBUSB_SUCCESS)
+		goto out_close;
+
+	/* gadget zero has the isochronous endpoints in altsetting 1 */
+	r = libusb_set_interface_alt_setting(handle, SOURCESINK_INTERFACE, is_iso);
+	if (r != LIBUSB_SUCCESS) {
+		r = is_iso ? 1 : r;
+		goto out_release;
+	}
+
+	endpoint = find_endpoint(libusb_get_device(handle), is_iso,
+		is_iso ? LIBUSB_TRANSFER_TYPE_ISOCHRONOUS : LIBUSB_TRANSFER_TYPE_BULK,
+		direction);
+	if (!endpoint) {
+		r = 1;
+		goto out_release;
+	}
+	if (is_iso) {
+		packet_size = libusb_get_max_iso_packet_size(libusb_get_device(handle),
+			endpoint);
+		if (packet_size <= 0) {
+			r = 1;
+			goto out_release;
+		}
+		packets = size / packet_size;
+		if (!packets)
+			packets = 1;
+		size = packets * packet_size;
+	}
+
+	bts = calloc(threads, sizeof(*bts));
+	if (!bts) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out_release;
+	}
+	for (t = 0; t < threads; t++) {
+		bts[t].ctx = ctx;
+		bts[t].depth = depth;
+		bts[t].transfers = calloc(depth, sizeof(struct bench_transfer));
+		if (!bts[t].transfers) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out_free;
+		}
+		for (i = 0; i < depth; i++) {
+			struct bench_transfer *bt = &bts[t].transfers[i];
+			unsigned char *buf = calloc(1, size);
+
+			bt->stop = &stop;
+			bt->transfer = libusb_alloc_transfer(packets);
+			if (!buf || !bt->transfer) {
+				free(buf);
+				r = LIBUSB_ERROR_NO_MEM;
+				goto out_free;
+			}
+			if (is_iso) {
+				libusb_fill_iso_transfer(bt->transfer, handle, endpoint,
+					buf, size, packets, bench_cb, bt, 1000);
+				libusb_set_iso_packet_lengths(bt->transfer, packet_size);
+			} else {
+				libusb_fill_bulk_transfer(bt->transfer, handle, endpoint,
+					buf, size, bench_cb, bt, 1000);
+			}
+			bt->transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		}
+	}
+
+	start = get_time_ns();
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&bts[started].thread, NULL, bench_thread_main,
+		    &bts[started])) {
+			r = LIBUSB_ERROR_OTHER;
+			break;
+		}
+	}
+	if (r == LIBUSB_SUCCESS)
+		usleep(duration_ms * 1000);
+	stop = 1;
+	for (t = 0; t < started; t++)
+		pthread_join(bts[t].thread, NULL);
+	elapsed = get_time_ns() - start;
+	if (r != LIBUSB_SUCCESS)
+		goto out_free;
+
+	for (t = 0; t < threads; t++) {
+		if (bts[t].error)
+			r = bts[t].error;
+		for (i = 0; i < depth; i++) {
+			if (bts[t].transfers[i].error)
+				r = LIBUSB_ERROR_IO;
+			bytes += bts[t].transfers[i].bytes;
+		}
+	}
+	if (r != LIBUSB_SUCCESS)
+		goto out_free;
+
+	r = libusb_get_stats(ctx, &stats);
+	if (r != LIBUSB_SUCCESS)
+		goto out_free;
+	for (i = 0; i < stats->num_endpoints; i++) {
+		if (stats->endpoints[i].endpoint == endpoint)
+			ops = stats->endpoints[i].transfers;
+	}
+	printf("bench name=gadget type=%s size=%d depth=%d threads=%d ops=%llu "
+		"mb_per_s=%.2f p50_us=%.1f p99_us=%.1f p999_us=%.1f\n",
+		type_names[type], size, depth, threads, (unsigned long long)ops,
+		bytes * 1000.0 / elapsed, latency_us(stats, endpoint, 50.0),
+		latency_us(stats, endpoint, 99.0), latency_us(stats, endpoint, 99.9));
+	fflush(stdout);
+	libusb_free_stats(stats);
+
+out_free:
+	for (t = 0; bts && t < threads; t++) {
+		for (i = 0; bts[t].transfers && i < depth; i++)
+			libusb_free_transfer(bts[t].transfers[i].transfer);
+		free(bts[t].transfers);
+	}
+	free(bts);
+out_release:
+	libusb_release_interface(handle, SOURCESINK_INTERFACE);
+out_close:
+	libusb_close(handle);
+	libusb_exit(ctx);
+	return r;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-d vid:pid] [-t types] [-s sizes] [-q depths] [-n threads] [-T ms]\n"
+		"   -d   device to use, default %04x:%04x (gadget zero)\n"
+		"   -t   comma separated transfer types, from bulk_in, bulk_out, iso_in\n"
+		"        and iso_out, default all\n"
+		"   -s   comma separated transfer sizes in bytes\n"
+		"   -q   comma separated queue depths\n"
+		"   -n   comma separated numbers of threads\n"
+		"   -T   duration of each run in milliseconds, default 1000\n",
+		name, GADGET_ZERO_VID, GADGET_ZERO_PID);
+}
+
+int main(int argc, char **argv)
+{
+	int sizes[16] = { 512, 4096, 16384, 65536, 262144 };
+	int depths[16] = { 1, 2, 4, 8, 16, 32 };
+	int thread_counts[16] = { 1, 2, 4 };
+	int types[BENCH_TYPE_COUNT] = { 1, 1, 1, 1 };
+	int num_sizes = 5, num_depths = 6, num_thread_counts = 3;
+	unsigned int vid = GADGET_ZERO_VID, pid = GADGET_ZERO_PID;
+	libusb_device_handle *handle;
+	int duration_ms = 1000;
+	int type, s, q, n, opt, r, ret = 0;
+
+	while ((opt = getopt(argc, argv, "d:t:s:q:n:T:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (sscanf(optarg, "%x:%x", &vid, &pid) != 2) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 't':
+			for (type = 0; type < BENCH_TYPE_COUNT; type++)
+				types[type] = strstr(optarg, type_names[type]) != NULL;
+			break;
+		case 's':
+			num_sizes = parse_list(optarg, sizes, 16);
+			break;
+		case 'q':
+			num_depths = parse_list(optarg, depths, 16);
+			break;
+		case 'n':
+			num_thread_counts = parse_list(optarg, thread_counts, 16);
+			break;
+		case 'T':
+			duration_ms = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+
+	/* check that the device is there before starting the sweep */
+	r = libusb_init(NULL);
+	if (r != LIBUSB_SUCCESS) {
+		fprintf(stderr, "failed to initialise libusb: %s\n", libusb_error_name(r));
+		return 1;
+	}
+	handle = libusb_open_device_with_vid_pid(NULL, (uint16_t)vid, (uint16_t)pid);
+	if (!handle) {
+		fprintf(stderr, "cannot open device %04x:%04x, see gadget_setup.sh\n",
+			vid, pid);
+		libusb_exit(NULL);
+		return 1;
+	}
+	libusb_close(handle);
+	libusb_exit(NULL);
+
+	for (type = 0; type < BENCH_TYPE_COUNT; type++) {
+		if (!types[type])
+			continue;
+		for (s = 0; s < num_sizes; s++) {
+			for (q = 0; q < num_depths; q++) {
+				for (n = 0; n < num_thread_counts; n++) {
+					r = run_bench((uint16_t)vid, (uint16_t)pid, type,
+						sizes[s], depths[q], thread_counts[n], duration_ms);
+					if (r == 1) {
+						fprintf(stderr, "%s not supported by the device, skipped\n",
+							type_names[type]);
+						goto next_type;
+					}
+					if (r < 0) {
+						fprintf(stderr, "%s size=%d depth=%d threads=%d failed: %s\n",
+							type_names[type], sizes[s], depths[q],
+							thread_counts[n], libusb_error_name(r));
+						ret = 1;
+					}
+				}
+			}
+		}
+next_type:
+		;
+	}
+
+	return ret;
+}
@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Load the dummy_hcd virtual USB controller and the gadget zero driver, so
+# that gadget_benchmark can run on a machine without USB device hardware.
+# Must be run as root. Unload with "modprobe -r g_zero dummy_hcd".
+#
+# pattern=0 makes the sink accept, and the source send, all zero data,
+# which is what gadget_benchmark writes. Set DUMMY_HCD_SPEED to "super"
+# to emulate a SuperSpeed link.
+
+set -e
+
+case "${DUMMY_HCD_SPEED:-high}" in
+super)	speed="is_super_speed=1 is_high_speed=1" ;;
+high)	speed="is_high_speed=1" ;;
+*)	speed="is_high_speed=0" ;;
+esac
+
+modprobe dummy_hcd $speed
+modprobe g_zero pattern=0 buflen=65536 qlen=32 isoc_interval=1 isoc_maxpacket=1024
+
+# allow the benchmark to run unprivileged once the device has enumerated
+sleep 1
+for dev in /sys/bus/usb/devices/*; do
+	[ -f "$dev/idVendor" ] || continue
+	if [ "$(cat "$dev/idVendor"):$(cat "$dev/idProduct")" = "1a0a:badd" ]; then
+		chmod a+rw "/dev/bus/usb/$(printf %03d "$(cat "$dev/busnum")")/$(printf %03d "$(cat "$dev/devnum")")"
+	fi
+done
@@ -18,12 +18,90 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <memory.h>
+#include <time.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/time.h>
+#endif
 
 #include "libusb.h"
 #include "libusb_testlib.h"
 
+#if defined(_WIN32)
+typedef HANDLE stress_thread_t;
+#define STRESS_THREAD_FN(name, arg)	DWORD WINAPI name(LPVOID arg)
+
+static int stress_thread_create(stress_thread_t * thread,
+	LPTHREAD_START_ROUTINE start, void * arg)
+{
+	*thread = CreateThread(NULL, 0, start, arg, 0, NULL);
+	return *thread != NULL ? 0 : -1;
+}
+
+static void stress_thread_join(stress_thread_t thread)
+{
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+}
+
+static void stress_sleep_ms(unsigned int ms)
+{
+	Sleep(ms);
+}
+
+static uint64_t stress_time_ns(void)
+{
+	LARGE_INTEGER frequency, counter;
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+}
+#else
+typedef pthread_t stress_thread_t;
+#define STRESS_THREAD_FN(name, arg)	void * name(void * arg)
+
+static int stress_thread_create(stress_thread_t * thread,
+	void * (*start)(void *), void * arg)
+{
+	return pthread_create(thread, NULL, start, arg);
+}
+
+static void stress_thread_join(stress_thread_t thread)
+{
+	pthread_join(thread, NULL);
+}
+
+static void stress_sleep_ms(unsigned int ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long)(ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+static uint64_t stress_time_ns(void)
+{
+#if defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000 + tv.tv_usec * 1000;
+#endif
+}
+#endif
+
 /** Test that creates and destroys a single concurrent context
  * 10000 times. */
 static libusb_testlib_result test_init_and_exit(libusb_testlib_ctx * tctx)
@@ -145,12 +223,440 @@ static libusb_testlib_result test_default_context_change(libusb_testlib_ctx * tc
 	return TEST_STATUS_SUCCESS;
 }
 
+#define CONTENTION_MAX_THREADS 64
+#define CONTENTION_RUN_MS 500
+
+/* State shared by the threads of one contention run. */
+struct contention_run {
+	libusb_context * ctx;
+	libusb_device * dev;
+	int has_hotplug;
+	volatile int stop;
+};
+
+struct contention_thread {
+	struct contention_run * run;
+	stress_thread_t thread;
+	unsigned long ops;
+	unsigned long errors;
+};
+
+static int LIBUSB_CALL contention_hotplug_cb(libusb_context * ctx,
+	libusb_device * dev, libusb_hotplug_event event, void * user_data)
+{
+	(void)ctx;
+	(void)dev;
+	(void)event;
+	(void)user_data;
+	return 0;
+}
+
+static void LIBUSB_CALL contention_transfer_cb(struct libusb_transfer * transfer)
+{
+	*(int *)transfer->user_data = 1;
+}
+
+/** Opens the device, does a synchronous GET_STATUS request, then submits
+ * another one asynchronously and cancels it before closing the device
+ * again. Returns 0 on success. */
+static int contention_device_ops(libusb_context * ctx, libusb_device * dev)
+{
+	libusb_device_handle * handle;
+	struct libusb_transfer * transfer;
+	unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE + 2];
+	int completed = 0;
+	int r;
+
+	if (libusb_open(dev, &handle) != LIBUSB_SUCCESS)
+		return -1;
+
+	r = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, buf, 2, 1000);
+	if (r < 0)
+		goto out;
+
+	transfer = libusb_alloc_transfer(0);
+	if (!transfer) {
+		r = -1;
+		goto out;
+	}
+	libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+	libusb_fill_control_transfer(transfer, handle, buf,
+		contention_transfer_cb, &completed, 1000);
+	r = libusb_submit_transfer(transfer);
+	if (r == LIBUSB_SUCCESS) {
+		libusb_cancel_transfer(transfer);
+		while (!completed)
+			libusb_handle_events_completed(ctx, &completed);
+	}
+	libusb_free_transfer(transfer);
+
+out:
+	libusb_close(handle);
+	return r < 0 ? -1 : 0;
+}
+
+static STRESS_THREAD_FN(contention_thread_main, arg)
+{
+	struct contention_thread * t = arg;
+	struct contention_run * run = t->run;
+	struct timeval zero_tv = { 0, 0 };
+
+	while (!run->stop) {
+		struct libusb_transfer * transfer;
+
+		if (run->has_hotplug) {
+			libusb_hotplug_callback_handle cb;
+
+			if (libusb_hotplug_register_callback(run->ctx,
+					LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, 0,
+					LIBUSB_HOTPLUG_MATCH_ANY,
+					LIBUSB_HOTPLUG_MATCH_ANY,
+					LIBUSB_HOTPLUG_MATCH_ANY,
+					contention_hotplug_cb, NULL,
+					&cb) == LIBUSB_SUCCESS)
+				libusb_hotplug_deregister_callback(run->ctx, cb);
+			else
+				t->errors++;
+		}
+
+		libusb_handle_events_timeout_completed(run->ctx, &zero_tv, NULL);
+
+		transfer = libusb_alloc_transfer(0);
+		if (transfer)
+			libusb_free_transfer(transfer);
+		else
+			t->errors++;
+
+		if (run->dev && contention_device_ops(run->ctx, run->dev))
+			t->errors++;
+
+		t->ops++;
+	}
+
+	return 0;
+}
+
+/** Finds a device that can be opened, or returns NULL. The device is
+ * returned with a reference held. */
+static libusb_device * contention_find_device(libusb_context * ctx)
+{
+	libusb_device ** devs;
+	libusb_device * found = NULL;
+	ssize_t cnt, i;
+
+	cnt = libusb_get_device_list(ctx, &devs);
+	if (cnt < 0)
+		return NULL;
+	for (i = 0; i < cnt && !found; i++) {
+		libusb_device_handle * handle;
+
+		if (libusb_open(devs[i], &handle) == LIBUSB_SUCCESS) {
+			libusb_close(handle);
+			found = libusb_ref_device(devs[i]);
+		}
+	}
+	libusb_free_device_list(devs, 1);
+	return found;
+}
+
+/** Runs event handling, hotplug registration and, if a device can be
+ * opened, synchronous and cancelled asynchronous transfers from 1 up to
+ * 64 threads sharing one context, and reports the throughput and how
+ * contended the context locks were at each step. Statistics are enabled
+ * for the run, so that the time the locks are held is measured as well. */
+static libusb_testlib_result test_lock_contention(libusb_testlib_ctx * tctx)
+{
+	struct contention_thread threads[CONTENTION_MAX_THREADS];
+	struct contention_run run;
+	int nthreads, i, r;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+
+	memset(&run, 0, sizeof(run));
+	r = libusb_init(&run.ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+	libusb_set_stats_enabled(run.ctx, 1);
+	run.has_hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG);
+	run.dev = contention_find_device(run.ctx);
+	if (!run.dev)
+		libusb_testlib_logf(tctx,
+			"No device could be opened, skipping device operations");
+
+	for (nthreads = 1; nthreads <= CONTENTION_MAX_THREADS; nthreads *= 2) {
+		struct libusb_event_counters before, after;
+		unsigned long ops = 0, errors = 0;
+		uint64_t start, elapsed;
+		int started;
+
+		run.stop = 0;
+		libusb_get_event_counters(run.ctx, &before);
+		start = stress_time_ns();
+		for (started = 0; started < nthreads; started++) {
+			threads[started].run = &run;
+			threads[started].ops = 0;
+			threads[started].errors = 0;
+			if (stress_thread_create(&threads[started].thread,
+					contention_thread_main, &threads[started]))
+				break;
+		}
+		if (started == nthreads)
+			stress_sleep_ms(CONTENTION_RUN_MS);
+		run.stop = 1;
+		for (i = 0; i < started; i++) {
+			stress_thread_join(threads[i].thread);
+			ops += threads[i].ops;
+			errors += threads[i].errors;
+		}
+		elapsed = stress_time_ns() - start;
+		libusb_get_event_counters(run.ctx, &after);
+
+		if (started != nthreads) {
+			libusb_testlib_logf(tctx, "Failed to start thread %d",
+				started);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+
+		libusb_testlib_logf(tctx,
+			"contention threads=%d ops=%lu ops_per_sec=%.0f errors=%lu",
+			nthreads, ops, elapsed ? ops * 1e9 / elapsed : 0.0, errors);
+		libusb_testlib_logf(tctx,
+			"  events_lock acquisitions=%llu contended=%llu waits=%llu held_ns=%llu",
+			(unsigned long long)(after.events_lock_acquisitions - before.events_lock_acquisitions),
+			(unsigned long long)(after.events_lock_contended - before.events_lock_contended),
+			(unsigned long long)(after.events_lock_waits - before.events_lock_waits),
+			(unsigned long long)(after.events_lock_held_ns - before.events_lock_held_ns));
+		libusb_testlib_logf(tctx,
+			"  flying_transfers_lock acquisitions=%llu contended=%llu held_ns=%llu",
+			(unsigned long long)(after.flying_transfers_lock_acquisitions - before.flying_transfers_lock_acquisitions),
+			(unsigned long long)(after.flying_transfers_lock_contended - before.flying_transfers_lock_contended),
+			(unsigned long long)(after.flying_transfers_lock_held_ns - before.flying_transfers_lock_held_ns));
+		libusb_testlib_logf(tctx,
+			"  event_data_lock acquisitions=%llu contended=%llu held_ns=%llu",
+			(unsigned long long)(after.event_data_lock_acquisitions - before.event_data_lock_acquisitions),
+			(unsigned long long)(after.event_data_lock_contended - before.event_data_lock_contended),
+			(unsigned long long)(after.event_data_lock_held_ns - before.event_data_lock_held_ns));
+
+		if (errors)
+			result = TEST_STATUS_FAILURE;
+	}
+
+	if (run.dev)
+		libusb_unref_device(run.dev);
+	libusb_exit(run.ctx);
+	return result;
+}
+
+/* The functions starting and stopping the threads of a context, for
+ * test_start_stop(). */
+struct start_stop_ops {
+	const char * name;
+	int (*start)(libusb_context * ctx);
+	int (*stop)(libusb_context * ctx);
+};
+
+/** Starts and stops the threads of a context, checking that starting them
+ * twice and stopping them twice fails, then restarts them and leaves them
+ * running for libusb_exit() to stop, 100 times. No device is needed. */
+static libusb_testlib_result test_start_stop(libusb_testlib_ctx * tctx,
+	const struct start_stop_ops * ops)
+{
+	libusb_context * ctx = NULL;
+	int i, r;
+
+	for (i = 0; i < 100; ++i) {
+		r = libusb_init(&ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx,
+				"Failed to init libusb on iteration %d: %d",
+				i, r);
+			return TEST_STATUS_FAILURE;
+		}
+
+		r = ops->start(ctx);
+		if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+			libusb_exit(ctx);
+			return TEST_STATUS_SKIP;
+		}
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx,
+				"Failed to start %s on iteration %d: %d",
+				ops->name, i, r);
+			libusb_exit(ctx);
+			return TEST_STATUS_FAILURE;
+		}
+		r = ops->start(ctx);
+		if (r != LIBUSB_ERROR_BUSY) {
+			libusb_testlib_logf(tctx,
+				"Second %s start returned %d", ops->name, r);
+			libusb_exit(ctx);
+			return TEST_STATUS_FAILURE;
+		}
+
+		r = ops->stop(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx,
+				"Failed to stop %s on iteration %d: %d",
+				ops->name, i, r);
+			libusb_exit(ctx);
+			return TEST_STATUS_FAILURE;
+		}
+		r = ops->stop(ctx);
+		if (r != LIBUSB_ERROR_NOT_FOUND) {
+			libusb_testlib_logf(tctx,
+				"Second %s stop returned %d", ops->name, r);
+			libusb_exit(ctx);
+			return TEST_STATUS_FAILURE;
+		}
+
+		/* restart and let libusb_exit() stop them */
+		r = ops->start(ctx);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf(tctx,
+				"Failed to restart %s on iteration %d: %d",
+				ops->name, i, r);
+			libusb_exit(ctx);
+			return TEST_STATUS_FAILURE;
+		}
+		libusb_exit(ctx);
+		ctx = NULL;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static int start_event_thread(libusb_context * ctx)
+{
+	return libusb_start_event_thread(ctx, NULL);
+}
+
+static int stop_event_thread(libusb_context * ctx)
+{
+	return libusb_stop_event_thread(ctx);
+}
+
+static int start_event_shards(libusb_context * ctx)
+{
+	return libusb_start_event_shards(ctx, 4, NULL);
+}
+
+static int stop_event_shards(libusb_context * ctx)
+{
+	return libusb_stop_event_shards(ctx);
+}
+
+/** Starts and stops the event handling thread of a context. */
+static libusb_testlib_result test_event_thread(libusb_testlib_ctx * tctx)
+{
+	static const struct start_stop_ops ops = {
+		"event thread", &start_event_thread, &stop_event_thread
+	};
+
+	return test_start_stop(tctx, &ops);
+}
+
+static int count_pollfds(libusb_context * ctx)
+{
+	const struct libusb_pollfd ** pollfds = libusb_get_pollfds(ctx);
+	int n = 0;
+
+	if (!pollfds)
+		return -1;
+	while (pollfds[n])
+		n++;
+	libusb_free_pollfds(pollfds);
+	return n;
+}
+
+/** Checks that event shards keep their file descriptors, and on Linux
+ * those of the handles opened while they run if a device can be opened,
+ * out of libusb_get_pollfds(), then starts and stops them. */
+static libusb_testlib_result test_event_shards(libusb_testlib_ctx * tctx)
+{
+	static const struct start_stop_ops ops = {
+		"event shards", &start_event_shards, &stop_event_shards
+	};
+	libusb_context * ctx = NULL;
+	libusb_device * dev;
+	libusb_device_handle * handle;
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	int before, after, r;
+
+	r = libusb_init(&ctx);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	r = libusb_start_event_shards(ctx, 0, NULL);
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+		libusb_exit(ctx);
+		return TEST_STATUS_SKIP;
+	}
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf(tctx,
+			"Starting no event shards returned %d", r);
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+
+	before = count_pollfds(ctx);
+	r = libusb_start_event_shards(ctx, 2, NULL);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf(tctx, "Failed to start event shards: %d", r);
+		libusb_exit(ctx);
+		return TEST_STATUS_FAILURE;
+	}
+	after = count_pollfds(ctx);
+	if (before < 0 || after != before) {
+		libusb_testlib_logf(tctx,
+			"Event shards changed the pollfds from %d to %d",
+			before, after);
+		result = TEST_STATUS_FAILURE;
+	}
+
+#if defined(__linux__)
+	dev = contention_find_device(ctx);
+	if (!dev) {
+		libusb_testlib_logf(tctx,
+			"No device could be opened, skipping shard routing check");
+	} else {
+		r = libusb_open(dev, &handle);
+		if (r == LIBUSB_SUCCESS) {
+			after = count_pollfds(ctx);
+			if (after != before) {
+				libusb_testlib_logf(tctx,
+					"Handle opened with event shards running was added to the pollfds");
+				result = TEST_STATUS_FAILURE;
+			}
+			libusb_close(handle);
+		}
+		libusb_unref_device(dev);
+	}
+#else
+	(void)dev;
+	(void)handle;
+#endif
+	libusb_exit(ctx);
+
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+	return test_start_stop(tctx, &ops);
+}
+
 /* Fill in the list of tests. */
 static const libusb_testlib_test tests[] = {
 	{"init_and_exit", &test_init_and_exit},
 	{"get_device_list", &test_get_device_list},
 	{"many_device_lists", &test_many_device_lists},
 	{"default_context_change", &test_default_context_change},
+	{"lock_contention", &test_lock_contention},
+	{"event_thread", &test_event_thread},
+	{"event_shards", &test_event_shards},
 	LIBUSB_NULL_TEST
 };
 